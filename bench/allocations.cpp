@@ -0,0 +1,48 @@
+#include "allocations.hpp"
+
+#include <cstdlib>
+#include <new>
+
+
+namespace
+{
+
+
+size_t allocation_count = 0;
+
+
+} // namespace
+
+
+namespace allocations
+{
+
+
+size_t count()
+{
+	return allocation_count;
+}
+
+
+} // namespace allocations
+
+
+void *operator new(size_t size)
+{
+	++allocation_count;
+
+	if (void *p = std::malloc(size ? size : 1))
+		return p;
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	std::free(p);
+}
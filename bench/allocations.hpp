@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+
+
+// pgen-bench replaces the global operator new and delete to count calls. They
+// live in allocations.cpp, apart from the code that allocates, so that the
+// compiler doesn't pair an inlined std::free() with the new it came from.
+namespace allocations
+{
+
+
+// operator new calls in the process so far, the parsers only allocate through it
+size_t count();
+
+
+} // namespace allocations
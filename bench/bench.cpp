@@ -0,0 +1,272 @@
+#include "corpora.hpp"
+#include "allocations.hpp"
+
+#include "json.hpp"
+#include "csv.hpp"
+#include "arith.hpp"
+#include "clike.hpp"
+#include "log.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <type_traits>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+
+namespace
+{
+
+
+size_t peak_rss()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+	return counters.PeakWorkingSetSize;
+#else
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return (size_t)usage.ru_maxrss;
+#else
+	return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+template <typename Root>
+size_t count_nodes(const Root &root)
+{
+	using Node = typename std::remove_cvref_t<decltype(root.group)>::value_type;
+
+	size_t count = 0;
+	std::vector<const Node *> pending = { &root };
+
+	while (!pending.empty())
+	{
+		const Node *node = pending.back();
+		pending.pop_back();
+		++count;
+
+		for (const auto &v : node->group)
+			pending.push_back(&v);
+	}
+
+	return count;
+}
+
+struct Sample
+{
+	bool ok = false;
+	double seconds = 0;
+	size_t nodes = 0;
+	size_t allocations = 0;
+};
+
+// Times building the tree, walking and dropping it are not included
+template <typename Parse>
+Sample parse_once(const std::string &input, Parse parse)
+{
+	Sample sample;
+
+	const char *s = input.data();
+	const char *e = s + input.size();
+
+	const size_t before = allocations::count();
+	const auto start = std::chrono::steady_clock::now();
+
+	{
+		auto tree = parse(s, e);
+		sample.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		sample.allocations = allocations::count() - before;
+		sample.ok = tree && s == e;
+
+		if (tree)
+			sample.nodes = count_nodes(*tree);
+	}
+
+	return sample;
+}
+
+struct Benchmark
+{
+	const char *name;
+	std::string (*corpus)(size_t size, uint64_t seed);
+	Sample (*parse)(const std::string &input);
+};
+
+const Benchmark benchmarks[] = {
+	{ "json", corpora::json, [](const std::string &input) { return parse_once(input, [](const char *&s, const char *e) { return json_parser::$parse_json(s, e); }); } },
+	{ "csv", corpora::csv, [](const std::string &input) { return parse_once(input, [](const char *&s, const char *e) { return csv_parser::$parse_file(s, e); }); } },
+	{ "arith", corpora::arith, [](const std::string &input) { return parse_once(input, [](const char *&s, const char *e) { return arith_parser::$parse_file(s, e); }); } },
+	{ "clike", corpora::clike, [](const std::string &input) { return parse_once(input, [](const char *&s, const char *e) { return clike_parser::$parse_program(s, e); }); } },
+	{ "log", corpora::log, [](const std::string &input) { return parse_once(input, [](const char *&s, const char *e) { return log_parser::$parse_file(s, e); }); } },
+};
+
+// One row of the table. Best of `iterations` runs; peak RSS is for the
+// whole process, see main.
+bool run(const Benchmark &b, double size_mb, size_t iterations, uint64_t seed)
+{
+	const std::string input = b.corpus((size_t)(size_mb * 1024 * 1024), seed);
+	const double input_mb = input.size() / (1024.0 * 1024.0);
+
+	Sample best;
+
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		const Sample sample = b.parse(input);
+
+		if (!sample.ok)
+		{
+			best = sample;
+			break;
+		}
+
+		if (i == 0 || sample.seconds < best.seconds)
+			best = sample;
+	}
+
+	if (!best.ok)
+	{
+		std::printf("%-8s %10.2f %10s\n", b.name, input_mb, "FAILED");
+		return false;
+	}
+
+	std::printf("%-8s %10.2f %10.1f %10.2f %12zu %12.1f %12.1f\n",
+		b.name,
+		input_mb,
+		input_mb / best.seconds,
+		best.seconds * 1e9 / best.nodes,
+		best.nodes,
+		best.allocations / input_mb,
+		peak_rss() / (1024.0 * 1024.0));
+
+	std::fflush(stdout);
+
+	return true;
+}
+
+void usage()
+{
+	std::fprintf(stderr, "usage: pgen-bench [--size MB] [--iterations N] [--seed N] [grammar...]\n");
+	std::fprintf(stderr, "grammars:");
+
+	for (const auto &b : benchmarks)
+		std::fprintf(stderr, " %s", b.name);
+
+	std::fprintf(stderr, "\n");
+}
+
+
+} // namespace
+
+
+int main(int argc, char **argv)
+{
+	double size_mb = 4;
+	size_t iterations = 5;
+	uint64_t seed = 1;
+	std::vector<std::string_view> selected;
+
+	// prints just the row of the one grammar named, pgen-bench runs itself so
+	// for every grammar when there are more
+	bool row = false;
+	std::string options;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string_view arg = argv[i];
+
+		if (arg == "--size" && i + 1 < argc)
+			size_mb = std::atof(argv[++i]);
+		else
+		if (arg == "--iterations" && i + 1 < argc)
+			iterations = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+		else
+		if (arg == "--seed" && i + 1 < argc)
+			seed = std::strtoull(argv[++i], nullptr, 10);
+		else
+		if (arg == "--row")
+			row = true;
+		else
+		if (!arg.empty() && arg[0] != '-')
+			selected.push_back(arg);
+		else
+		{
+			usage();
+			return 1;
+		}
+
+		if (arg.starts_with("--") && arg != "--row")
+		{
+			options += ' ';
+			options += arg;
+			options += ' ';
+			options += argv[i];
+		}
+	}
+
+	for (const auto &name : selected)
+	{
+		if (std::none_of(std::begin(benchmarks), std::end(benchmarks), [&](const Benchmark &b) { return b.name == name; }))
+		{
+			usage();
+			return 1;
+		}
+	}
+
+	std::vector<const Benchmark *> chosen;
+
+	for (const auto &b : benchmarks)
+	{
+		if (selected.empty() || std::find(selected.begin(), selected.end(), b.name) != selected.end())
+			chosen.push_back(&b);
+	}
+
+	if (row && chosen.size() != 1)
+	{
+		usage();
+		return 1;
+	}
+
+	if (!row)
+		std::printf("%-8s %10s %10s %10s %12s %12s %12s\n", "grammar", "input MB", "MB/s", "ns/node", "nodes", "allocs/MB", "peak RSS MB");
+
+	if (chosen.size() == 1)
+		return run(*chosen[0], size_mb, iterations, seed) ? 0 : 1;
+
+	// peak RSS only ever grows, so every grammar gets a process of its own
+	// for its figure to be its own
+	bool failed = false;
+
+	for (const Benchmark *b : chosen)
+	{
+		std::string command = "\"";
+		command += argv[0];
+		command += '"';
+		command += options;
+		command += " --row ";
+		command += b->name;
+
+#ifdef _WIN32
+		// cmd /c drops the outer quotes
+		command.insert(command.begin(), '"');
+		command += '"';
+#endif
+
+		std::fflush(stdout);
+
+		if (std::system(command.c_str()) != 0)
+			failed = true;
+	}
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,537 @@
+#include "corpora.hpp"
+
+#include <string_view>
+
+
+namespace corpora
+{
+
+
+namespace
+{
+
+
+// xorshift64*, so corpora don't depend on the standard library's distributions
+class Random
+{
+public:
+	explicit Random(uint64_t seed)
+		: state(seed ? seed : 0x9e3779b97f4a7c15)
+	{
+	}
+
+	uint64_t next()
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 0x2545f4914f6cdd1d;
+	}
+
+	size_t below(size_t n)
+	{
+		return (size_t)(next() % n);
+	}
+
+	bool chance(size_t percent)
+	{
+		return below(100) < percent;
+	}
+
+	template <size_t N>
+	std::string_view pick(const std::string_view (&items)[N])
+	{
+		return items[below(N)];
+	}
+
+private:
+	uint64_t state;
+};
+
+const std::string_view words[] = {
+	"alpha", "beta", "gamma", "delta", "epsilon", "zeta", "theta", "kappa",
+	"lambda", "sigma", "omega", "node", "buffer", "count", "value", "name",
+	"offset", "length", "result", "total", "index", "item", "entry", "data",
+};
+
+void append_number(std::string &out, Random &rng, bool fraction)
+{
+	out += std::to_string(rng.below(100000));
+
+	if (fraction && rng.chance(40))
+	{
+		out += '.';
+		out += std::to_string(rng.below(1000));
+	}
+}
+
+void append_word(std::string &out, Random &rng)
+{
+	out += rng.pick(words);
+}
+
+void append_ident(std::string &out, Random &rng)
+{
+	append_word(out, rng);
+
+	if (rng.chance(30))
+		out += std::to_string(rng.below(10));
+}
+
+void append_json_string(std::string &out, Random &rng)
+{
+	out += '"';
+
+	const size_t count = 1 + rng.below(4);
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (i != 0)
+			out += ' ';
+
+		append_word(out, rng);
+
+		if (rng.chance(5))
+			out += "\\n";
+		else
+		if (rng.chance(5))
+			out += "\\\"";
+	}
+
+	out += '"';
+}
+
+void append_json_value(std::string &out, Random &rng, size_t depth)
+{
+	const size_t kind = depth >= 4 ? 2 + rng.below(4) : rng.below(6);
+
+	switch (kind)
+	{
+		case 0:
+			{
+				out += '{';
+
+				const size_t count = rng.below(6);
+
+				for (size_t i = 0; i < count; ++i)
+				{
+					out += i == 0 ? "\n" : ",\n";
+					out += std::string(depth + 1, '\t');
+					append_json_string(out, rng);
+					out += ": ";
+					append_json_value(out, rng, depth + 1);
+				}
+
+				if (count != 0)
+					out += "\n" + std::string(depth, '\t');
+
+				out += '}';
+				break;
+			}
+		case 1:
+			{
+				out += '[';
+
+				const size_t count = rng.below(6);
+
+				for (size_t i = 0; i < count; ++i)
+				{
+					if (i != 0)
+						out += ", ";
+
+					append_json_value(out, rng, depth + 1);
+				}
+
+				out += ']';
+				break;
+			}
+		case 2:
+			append_json_string(out, rng);
+			break;
+		case 3:
+			if (rng.chance(20))
+				out += '-';
+
+			append_number(out, rng, true);
+
+			if (rng.chance(10))
+				out += "e+" + std::to_string(rng.below(30));
+
+			break;
+		case 4:
+			out += rng.chance(50) ? "true" : "false";
+			break;
+		default:
+			out += "null";
+			break;
+	}
+}
+
+void append_expr(std::string &out, Random &rng, size_t depth)
+{
+	const size_t kind = depth >= 3 ? rng.below(3) : rng.below(7);
+
+	switch (kind)
+	{
+		case 0:
+			append_number(out, rng, true);
+			break;
+		case 1:
+		case 2:
+			append_ident(out, rng);
+			break;
+		case 3:
+			out += '(';
+			append_expr(out, rng, depth + 1);
+			out += ')';
+			break;
+		case 4:
+			{
+				append_ident(out, rng);
+				out += '(';
+
+				const size_t count = rng.below(4);
+
+				for (size_t i = 0; i < count; ++i)
+				{
+					if (i != 0)
+						out += ", ";
+
+					append_expr(out, rng, depth + 1);
+				}
+
+				out += ')';
+				break;
+			}
+		default:
+			{
+				static const std::string_view operators[] = { " + ", " - ", " * ", " / ", " % " };
+
+				append_expr(out, rng, depth + 1);
+				out += rng.pick(operators);
+				append_expr(out, rng, depth + 1);
+				break;
+			}
+	}
+}
+
+void append_clike_expr(std::string &out, Random &rng, size_t depth)
+{
+	const size_t kind = depth >= 3 ? rng.below(3) : rng.below(8);
+
+	switch (kind)
+	{
+		case 0:
+			append_number(out, rng, true);
+			break;
+		case 1:
+			append_ident(out, rng);
+			break;
+		case 2:
+			out += '"';
+			append_word(out, rng);
+			out += "\\n\"";
+			break;
+		case 3:
+			out += '(';
+			append_clike_expr(out, rng, depth + 1);
+			out += ')';
+			break;
+		case 4:
+			{
+				append_ident(out, rng);
+				out += '(';
+
+				const size_t count = rng.below(4);
+
+				for (size_t i = 0; i < count; ++i)
+				{
+					if (i != 0)
+						out += ", ";
+
+					append_clike_expr(out, rng, depth + 1);
+				}
+
+				out += ')';
+				break;
+			}
+		case 5:
+			append_ident(out, rng);
+			out += '[';
+			append_clike_expr(out, rng, depth + 1);
+			out += ']';
+			break;
+		case 6:
+			out += rng.chance(50) ? "!" : "-";
+			append_clike_expr(out, rng, depth + 1);
+			break;
+		default:
+			{
+				static const std::string_view operators[] = {
+					" + ", " - ", " * ", " / ", " % ", " < ", " > ", " <= ", " >= ", " == ", " != ", " && ", " || ",
+				};
+
+				append_clike_expr(out, rng, depth + 1);
+				out += rng.pick(operators);
+				append_clike_expr(out, rng, depth + 1);
+				break;
+			}
+	}
+}
+
+void append_clike_type(std::string &out, Random &rng)
+{
+	static const std::string_view types[] = { "int", "float", "char", "void" };
+
+	out += rng.pick(types);
+
+	if (rng.chance(20))
+		out += " *";
+}
+
+void append_clike_statement(std::string &out, Random &rng, size_t depth)
+{
+	const std::string indent(depth + 1, '\t');
+
+	out += indent;
+
+	const size_t kind = depth >= 3 ? 3 + rng.below(3) : rng.below(6);
+
+	switch (kind)
+	{
+		case 0:
+		case 1:
+			{
+				out += kind == 0 ? "if (" : "while (";
+				append_clike_expr(out, rng, 0);
+				out += ")\n" + indent + "{\n";
+
+				const size_t count = 1 + rng.below(4);
+
+				for (size_t i = 0; i < count; ++i)
+					append_clike_statement(out, rng, depth + 1);
+
+				out += indent + "}\n";
+
+				if (kind == 0 && rng.chance(30))
+				{
+					out += indent + "else\n";
+					append_clike_statement(out, rng, depth);
+				}
+
+				break;
+			}
+		case 2:
+			out += "return ";
+			append_clike_expr(out, rng, 0);
+			out += ";\n";
+			break;
+		case 3:
+			append_clike_type(out, rng);
+			out += ' ';
+			append_ident(out, rng);
+
+			if (rng.chance(70))
+			{
+				out += " = ";
+				append_clike_expr(out, rng, 0);
+			}
+
+			out += ";\n";
+			break;
+		default:
+			if (rng.chance(50))
+			{
+				append_ident(out, rng);
+				out += " = ";
+			}
+
+			append_clike_expr(out, rng, 0);
+			out += ";";
+
+			if (rng.chance(10))
+				out += " // " + std::string(rng.pick(words));
+
+			out += "\n";
+			break;
+	}
+}
+
+
+} // namespace
+
+
+std::string json(size_t size, uint64_t seed)
+{
+	Random rng(seed);
+
+	std::string out = "[\n";
+
+	while (out.size() < size)
+	{
+		if (out.size() != 2)
+			out += ",\n";
+
+		out += '\t';
+		append_json_value(out, rng, 1);
+	}
+
+	out += "\n]\n";
+	return out;
+}
+
+std::string csv(size_t size, uint64_t seed)
+{
+	Random rng(seed);
+
+	std::string out = "id,name,description,amount,count,category,comment,flag";
+
+	while (out.size() < size)
+	{
+		out += "\n";
+		out += std::to_string(rng.below(1000000));
+
+		for (size_t i = 1; i < 8; ++i)
+		{
+			out += ',';
+
+			switch (rng.below(5))
+			{
+				case 0:
+					append_number(out, rng, true);
+					break;
+				case 1:
+					out += '"';
+					append_word(out, rng);
+					out += ", ";
+					append_word(out, rng);
+
+					if (rng.chance(30))
+						out += " \"\"quoted\"\"";
+
+					out += '"';
+					break;
+				case 2:
+					break;
+				default:
+					append_word(out, rng);
+					break;
+			}
+		}
+	}
+
+	out += "\n";
+	return out;
+}
+
+std::string arith(size_t size, uint64_t seed)
+{
+	Random rng(seed);
+
+	std::string out;
+
+	while (out.size() < size)
+	{
+		if (rng.chance(70))
+		{
+			append_ident(out, rng);
+			out += " = ";
+		}
+
+		append_expr(out, rng, 0);
+		out += ";\n";
+	}
+
+	return out;
+}
+
+std::string clike(size_t size, uint64_t seed)
+{
+	Random rng(seed);
+
+	std::string out;
+
+	while (out.size() < size)
+	{
+		append_clike_type(out, rng);
+		out += ' ';
+		append_ident(out, rng);
+		out += "(";
+
+		const size_t params = rng.below(4);
+
+		for (size_t i = 0; i < params; ++i)
+		{
+			if (i != 0)
+				out += ", ";
+
+			append_clike_type(out, rng);
+			out += ' ';
+			append_ident(out, rng);
+		}
+
+		out += ")\n{\n";
+
+		const size_t count = 1 + rng.below(8);
+
+		for (size_t i = 0; i < count; ++i)
+			append_clike_statement(out, rng, 0);
+
+		out += "}\n\n";
+	}
+
+	return out;
+}
+
+std::string log(size_t size, uint64_t seed)
+{
+	static const std::string_view methods[] = { "GET", "GET", "GET", "POST", "PUT", "DELETE", "HEAD" };
+	static const std::string_view months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+	static const std::string_view statuses[] = { "200", "200", "200", "201", "204", "301", "304", "404", "500" };
+	static const std::string_view agents[] = {
+		"Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0",
+		"Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36",
+		"curl/8.4.0",
+		"Go-http-client/1.1",
+	};
+
+	Random rng(seed);
+
+	std::string out;
+
+	while (out.size() < size)
+	{
+		out += std::to_string(rng.below(256)) + "." + std::to_string(rng.below(256)) + "." + std::to_string(rng.below(256)) + "." + std::to_string(rng.below(256));
+		out += rng.chance(80) ? " - - [" : " - admin [";
+		out += std::to_string(1 + rng.below(28)) + "/" + std::string(rng.pick(months)) + "/2024:";
+		out += std::to_string(rng.below(24)) + ":" + std::to_string(rng.below(60)) + ":" + std::to_string(rng.below(60)) + " +0000] \"";
+		out += rng.pick(methods);
+		out += " /";
+
+		const size_t segments = 1 + rng.below(4);
+
+		for (size_t i = 0; i < segments; ++i)
+		{
+			if (i != 0)
+				out += '/';
+
+			append_ident(out, rng);
+		}
+
+		if (rng.chance(30))
+			out += "?id=" + std::to_string(rng.below(100000));
+
+		out += " HTTP/1.1\" ";
+		out += rng.pick(statuses);
+		out += ' ';
+		out += rng.chance(90) ? std::to_string(rng.below(100000)) : "-";
+		out += rng.chance(50) ? " \"-\" \"" : " \"https://example.com/\" \"";
+		out += rng.pick(agents);
+		out += "\"\n";
+	}
+
+	return out;
+}
+
+
+} // namespace corpora
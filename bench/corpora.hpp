@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+
+// Synthetic inputs for the reference grammars. Each generator appends whole
+// documents/lines until the result is at least `size` bytes, the same seed
+// always gives the same corpus.
+namespace corpora
+{
+
+
+std::string json(size_t size, uint64_t seed);
+std::string csv(size_t size, uint64_t seed);
+std::string arith(size_t size, uint64_t seed);
+std::string clike(size_t size, uint64_t seed);
+std::string log(size_t size, uint64_t seed);
+
+
+} // namespace corpora
@@ -0,0 +1,46 @@
+#include "pgen.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+
+// pgen-bench-gen <grammar> <namespace> <output>
+int main(int argc, char **argv)
+{
+	if (argc != 4)
+	{
+		std::cerr << "usage: pgen-bench-gen <grammar> <namespace> <output>\n";
+		return 1;
+	}
+
+	std::ifstream input(argv[1], std::ios::binary);
+
+	if (!input)
+	{
+		std::cerr << "can't open " << argv[1] << "\n";
+		return 1;
+	}
+
+	std::stringstream ss;
+	ss << input.rdbuf();
+	const std::string grammar = ss.str();
+
+	const auto parsed = pgen::try_parse(grammar.data(), grammar.size());
+
+	if (parsed.error)
+	{
+		std::cerr << argv[1] << ":" << parsed.error->message() << "\n";
+		return 1;
+	}
+
+	pgen::helpers::GenerateCodeParams params;
+	params.custom_namespace = argv[2];
+
+	const std::string code = pgen::helpers::generate_code(parsed.rules, params);
+
+	std::ofstream output(argv[3], std::ios::binary);
+	output << code;
+
+	return output ? 0 : 1;
+}
@@ -0,0 +1,22 @@
+# Arithmetic statements with calls, one per line
+file: (ws statement)* ws
+
+statement: (ident ws "=" ws)? expr ws ";"
+
+expr: term (ws [+\-] ws term)*
+
+term: factor (ws [*/%] ws factor)*
+
+factor: "-" ws factor | power
+
+power: primary (ws "^" ws factor)?
+
+primary: number | call | ident | "(" ws expr ws ")"
+
+call: ident ws "(" ws (expr (ws "," ws expr)*)? ws ")"
+
+ident: [a-zA-Z_] [a-zA-Z0-9_]*
+
+number: [0-9]+ ("." [0-9]+)?
+
+ws: [ \t\r\n]*
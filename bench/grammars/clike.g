@@ -0,0 +1,46 @@
+# Small C-like language with functions, statements and expressions
+program: ws (function ws)*
+
+function: type ws ident ws "(" ws params? ws ")" ws block
+
+params: param (ws "," ws param)*
+
+param: type ws ident
+
+type: ("int" | "float" | "char" | "void") (ws "*")*
+
+block: "{" ws (statement ws)* "}"
+
+statement: block | if | while | return | declaration | expression_statement
+
+if: "if" ws "(" ws expr ws ")" ws statement (ws "else" ws statement)?
+
+while: "while" ws "(" ws expr ws ")" ws statement
+
+return: "return" ws expr? ws ";"
+
+declaration: type ws ident (ws "=" ws expr)? ws ";"
+
+expression_statement: expr ws ";"
+
+expr: unary ws "=" ws expr | binary
+
+binary: unary (ws operator ws unary)*
+
+operator: "==" | "!=" | "<=" | ">=" | "&&" | "||" | [+\-*/%<>]
+
+unary: [!\-&*] ws unary | postfix
+
+postfix: primary (ws "(" ws args? ws ")" | ws "[" ws expr ws "]")*
+
+args: expr (ws "," ws expr)*
+
+primary: number | ident | string | "(" ws expr ws ")"
+
+ident: [a-zA-Z_] [a-zA-Z0-9_]*
+
+number: [0-9]+ ("." [0-9]+)?
+
+string: "\"" ([^"\\\n] | "\\" [\x00-\xff])* "\""
+
+ws: ([ \t\r\n] | "//" "\n"^*)*
@@ -0,0 +1,12 @@
+# RFC 4180 records, the last line may or may not end with a newline
+file: record (newline record)*
+
+record: field ("," field)*
+
+field: quoted | bare
+
+quoted: "\"" ([^"] | "\"\"")* "\""
+
+bare: [^,"\r\n]*
+
+newline: "\r\n" | "\n"
@@ -0,0 +1,16 @@
+# JSON, escapes are not validated
+json: ws value ws
+
+value: object | array | string | number | "true" | "false" | "null"
+
+object: "{" ws (member (ws "," ws member)*)? ws "}"
+
+member: string ws ":" ws value
+
+array: "[" ws (value (ws "," ws value)*)? ws "]"
+
+string: "\"" ([^"\\] | "\\" [\x00-\xff])* "\""
+
+number: "-"? [0-9]+ ("." [0-9]+)? ([eE] [+\-]? [0-9]+)?
+
+ws: [ \t\r\n]*
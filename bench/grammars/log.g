@@ -0,0 +1,20 @@
+# Access log lines in the combined log format
+file: (line "\n")*
+
+line: ip " - " user " [" timestamp "] \"" method " " path " HTTP/1." [01] "\" " status " " size " \"" quoted "\" \"" quoted "\""
+
+ip: [0-9]+ "." [0-9]+ "." [0-9]+ "." [0-9]+
+
+user: "-" | [a-z]+
+
+timestamp: [0-9]+ "/" [A-Za-z]+ "/" [0-9]+ ":" [0-9]+ ":" [0-9]+ ":" [0-9]+ " " [+\-] [0-9]+
+
+method: "GET" | "POST" | "PUT" | "DELETE" | "HEAD" | "OPTIONS"
+
+path: [^ ]+
+
+status: [0-9] [0-9] [0-9]
+
+size: [0-9]+ | "-"
+
+quoted: "\""^*
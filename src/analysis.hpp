@@ -0,0 +1,109 @@
+#pragma once
+
+#include "pgen.hpp"
+
+
+namespace pgen
+{
+
+
+namespace helpers
+{
+
+
+// Grammar analysis shared by the code generator and the vm compiler
+
+// Index ranges [first, second) of the '|' separated alternatives
+std::vector<std::pair<size_t, size_t>> split_alternatives(std::span<const ir::Node> items);
+
+// Every alternative is exactly one plain literal
+bool is_literal_alternation(std::span<const ir::Node> items);
+
+// Bytes a match can start with, and whether it can match nothing at all
+struct FirstSet
+{
+	std::bitset<256> bytes;
+	bool nullable = false;
+
+	bool operator==(const FirstSet &other) const = default;
+};
+
+// Indexed by definition id
+using FirstSets = std::vector<FirstSet>;
+
+// Of a single item, of a sequence of items, and of a whole body
+FirstSet first_set(const ir::Grammar &grammar, const ir::Node &node, const FirstSets &sets);
+FirstSet first_set(const ir::Grammar &grammar, std::span<const ir::Node> items, const FirstSets &sets);
+FirstSet first_set(const ir::Grammar &grammar, uint32_t id, const FirstSets &sets);
+
+FirstSets compute_first_sets(const ir::Grammar &grammar);
+
+// UTF-8 of the classes of UTF-8 mode
+
+std::string encode_utf8(char32_t c);
+
+// Code point of the valid sequence at s, s is moved past it
+std::optional<char32_t> decode_utf8(const char *&s, const char *e);
+
+// Sorts and merges, and drops surrogates and anything past U+10FFFF
+void normalize_code_points(std::vector<CodePointRange> &ranges);
+
+// Every code point but those, normalized
+std::vector<CodePointRange> negate_code_points(const std::vector<CodePointRange> &ranges);
+
+// Byte ranges, one per position of an encoding
+using Utf8Sequence = std::vector<std::pair<uint8_t, uint8_t>>;
+
+// Sequences that together match exactly the encodings of ranges
+std::vector<Utf8Sequence> utf8_sequences(const std::vector<CodePointRange> &ranges);
+
+// Bytes an encoding of ranges can start with
+std::bitset<256> utf8_first_bytes(const std::vector<CodePointRange> &ranges);
+
+// One DFA matching every token of a grammar: the @token and @skip rules, and
+// the literals and classes the other rules use
+struct Lexer
+{
+	struct Token
+	{
+		// rule name, or the dump of the literal or class
+		std::string name;
+
+		// the @token or @skip rule, 0 for literals and classes
+		uint32_t rule = 0;
+		bool skip = false;
+	};
+
+	// kind k is tokens[k - 1], the lower kind wins when two match as much;
+	// literals come first, so keywords win over names
+	std::vector<Token> tokens;
+
+	// kinds by literal, class and definition, 0 where there is none;
+	// a negated single byte literal is a token of its own
+	std::vector<uint32_t> literal_kinds;
+	std::vector<uint32_t> negated_kinds;
+	std::vector<uint32_t> class_kinds;
+	std::vector<uint32_t> rule_kinds;
+
+	// bytes that every state treats alike share a column
+	std::array<uint8_t, 256> columns{};
+	uint32_t column_count = 0;
+
+	// next[state * column_count + column], state 0 is dead and 1 the start
+	std::vector<uint32_t> next;
+
+	// kind a match ending in the state is, 0 for none
+	std::vector<uint32_t> accept;
+};
+
+// Token rules are read as regular expressions. Throws when one refers to
+// itself, negates a literal of more than one byte, or when another rule refers
+// to a @skip one or has a negated or empty literal. With utf8 classes and "x"^
+// match code points, and "x" may then be any single code point.
+Lexer build_lexer(const ir::Grammar &grammar, bool utf8);
+
+
+} // namespace helpers
+
+
+} // namespace pgen
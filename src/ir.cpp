@@ -0,0 +1,154 @@
+#include "pch.hpp"
+#include "pgen.hpp"
+
+
+namespace pgen
+{
+
+
+namespace ir
+{
+
+
+namespace
+{
+
+
+struct Lowering
+{
+	Grammar grammar;
+
+	std::unordered_map<std::string_view, uint32_t> rules;
+	std::unordered_map<std::string_view, uint32_t> literals;
+	std::unordered_multimap<std::bitset<256>, uint32_t> classes;
+
+	uint32_t literal(const std::string &lit)
+	{
+		auto [it, inserted] = literals.try_emplace(lit, (uint32_t)grammar.literals.size());
+
+		if (inserted)
+			grammar.literals.push_back(lit);
+
+		return it->second;
+	}
+
+	// the same bytes can stand for different code points
+	uint32_t char_class(const std::bitset<256> &bits, const std::vector<CodePointRange> &code_points)
+	{
+		auto [first, last] = classes.equal_range(bits);
+
+		for (auto it = first; it != last; ++it)
+		{
+			if (grammar.class_code_points[it->second] == code_points)
+				return it->second;
+		}
+
+		const uint32_t index = (uint32_t)grammar.classes.size();
+		grammar.classes.push_back(bits);
+		grammar.class_code_points.push_back(code_points);
+		classes.emplace(bits, index);
+
+		return index;
+	}
+
+	// The body gets its range up front, nested groups are numbered and laid out
+	// as they are reached: a group comes right after the one it is nested in,
+	// before the groups that follow it in the same body
+	void body(uint32_t id, const std::vector<RuleItem> &seq)
+	{
+		const uint32_t begin = (uint32_t)grammar.nodes.size();
+
+		grammar.definitions[id].begin = begin;
+		grammar.definitions[id].end = begin + (uint32_t)seq.size();
+		grammar.nodes.resize(grammar.nodes.size() + seq.size());
+
+		for (size_t i = 0; i < seq.size(); ++i)
+		{
+			const RuleItem &item = seq[i];
+
+			Node node;
+			node.optional = item.optional;
+			node.multiple = item.multiple;
+			node.negate = item.negate;
+
+			switch (item.type)
+			{
+				case RuleItemType::Literal:
+					node.type = NodeType::Literal;
+					node.value = literal(item.literal);
+					break;
+				case RuleItemType::CharClass:
+					node.type = NodeType::CharClass;
+					node.value = char_class(item.char_class, item.code_points);
+					break;
+				case RuleItemType::Identifier:
+					{
+						auto it = rules.find(item.identifier);
+
+						if (it == rules.end())
+							throw 2;
+
+						node.type = NodeType::Reference;
+						node.value = it->second;
+						break;
+					}
+				case RuleItemType::Group:
+					{
+						Definition group;
+						group.name = item.group.name;
+						group.parent = id;
+						group.group = true;
+
+						node.type = NodeType::Group;
+						node.value = (uint32_t)grammar.definitions.size();
+
+						grammar.definitions.push_back(std::move(group));
+						body(node.value, item.group.seq);
+						break;
+					}
+				case RuleItemType::Or:
+					node.type = NodeType::Or;
+					break;
+				case RuleItemType::Cut:
+					node.type = NodeType::Cut;
+					break;
+				default:
+					throw 2;
+			}
+
+			grammar.nodes[begin + i] = node;
+		}
+	}
+};
+
+
+} // namespace
+
+
+Grammar lower(const std::vector<Rule> &rules)
+{
+	Lowering l;
+
+	l.grammar.definitions.resize(1 + rules.size());
+	l.grammar.rule_count = (uint32_t)rules.size();
+
+	for (size_t i = 0; i < rules.size(); ++i)
+	{
+		l.grammar.definitions[1 + i].name = rules[i].name;
+		l.grammar.definitions[1 + i].token = rules[i].token;
+		l.grammar.definitions[1 + i].skip = rules[i].skip;
+		l.grammar.definitions[1 + i].sync = rules[i].sync;
+		l.rules.emplace(rules[i].name, (uint32_t)(1 + i));
+	}
+
+	for (size_t i = 0; i < rules.size(); ++i)
+		l.body((uint32_t)(1 + i), rules[i].seq);
+
+	return std::move(l.grammar);
+}
+
+
+} // namespace ir
+
+
+} // namespace pgen
@@ -0,0 +1,455 @@
+#include "pch.hpp"
+#include "pgen.hpp"
+#include "analysis.hpp"
+
+
+namespace pgen
+{
+
+
+namespace helpers
+{
+
+
+namespace
+{
+
+
+// The code point lit is made of, if it is exactly one
+std::optional<char32_t> single_code_point(const std::string &lit)
+{
+	const char *s = lit.data();
+	const char *e = lit.data() + lit.size();
+	const auto c = decode_utf8(s, e);
+
+	if (!c || s != e)
+		return std::nullopt;
+
+	return c;
+}
+
+// Thompson automaton, a state either takes a set of bytes to next or has
+// epsilon moves
+struct Nfa
+{
+	struct State
+	{
+		std::bitset<256> bytes;
+		uint32_t next = 0;
+		std::vector<uint32_t> epsilon;
+		uint32_t accept = 0;
+	};
+
+	struct Fragment
+	{
+		uint32_t begin;
+		uint32_t end;
+	};
+
+	const ir::Grammar &grammar;
+	const bool utf8;
+	std::vector<State> states;
+
+	// definitions being expanded, a reference back into one isn't regular
+	std::vector<bool> active;
+
+	Nfa(const ir::Grammar &grammar, bool utf8)
+		: grammar(grammar)
+		, utf8(utf8)
+		, active(grammar.size())
+	{
+	}
+
+	uint32_t add()
+	{
+		states.emplace_back();
+		return (uint32_t)states.size() - 1;
+	}
+
+	Fragment empty()
+	{
+		const uint32_t s = add();
+		return { s, s };
+	}
+
+	Fragment bytes(const std::bitset<256> &set)
+	{
+		const uint32_t begin = add();
+		const uint32_t end = add();
+		states[begin].bytes = set;
+		states[begin].next = end;
+		return { begin, end };
+	}
+
+	// One of the encodings, byte ranges in a row
+	Fragment code_points(const std::vector<CodePointRange> &ranges)
+	{
+		const Fragment result = empty();
+		const uint32_t end = add();
+
+		for (const auto &sequence : utf8_sequences(ranges))
+		{
+			uint32_t at = result.begin;
+
+			for (const auto &[first, last] : sequence)
+			{
+				std::bitset<256> set;
+
+				for (size_t c = first; c <= last; ++c)
+					set.set(c);
+
+				const Fragment b = bytes(set);
+				states[at].epsilon.push_back(b.begin);
+				at = b.end;
+			}
+
+			states[at].epsilon.push_back(end);
+		}
+
+		return { result.begin, end };
+	}
+
+	Fragment char_class(uint32_t index)
+	{
+		if (utf8)
+			return code_points(grammar.class_code_points[index]);
+
+		return bytes(grammar.classes[index]);
+	}
+
+	Fragment once(const ir::Node &node)
+	{
+		switch (node.type)
+		{
+			case ir::NodeType::Literal:
+				{
+					const std::string &lit = grammar.literals[node.value];
+
+					if (node.negate && utf8)
+					{
+						const auto c = single_code_point(lit);
+
+						if (!c)
+							throw 2;
+
+						return code_points(negate_code_points({ { c.value(), c.value() } }));
+					}
+
+					if (node.negate)
+					{
+						if (lit.size() != 1)
+							throw 2;
+
+						return bytes(std::bitset<256>().set().reset((uint8_t)lit[0]));
+					}
+
+					Fragment result = empty();
+
+					for (char c : lit)
+					{
+						const Fragment b = bytes(std::bitset<256>().set((uint8_t)c));
+						states[result.end].epsilon.push_back(b.begin);
+						result.end = b.end;
+					}
+
+					return result;
+				}
+			case ir::NodeType::CharClass:
+				return char_class(node.value);
+			case ir::NodeType::Reference:
+			case ir::NodeType::Group:
+				return body(node.value);
+			default:
+				return empty();
+		}
+	}
+
+	Fragment item(const ir::Node &node)
+	{
+		const Fragment f = once(node);
+
+		if (!node.optional && !node.multiple)
+			return f;
+
+		const Fragment result = empty();
+		const uint32_t end = add();
+
+		states[result.begin].epsilon.push_back(f.begin);
+		states[f.end].epsilon.push_back(end);
+
+		if (node.optional)
+			states[result.begin].epsilon.push_back(end);
+
+		if (node.multiple)
+			states[f.end].epsilon.push_back(f.begin);
+
+		return { result.begin, end };
+	}
+
+	// Alternatives are a union, ordered choice has no meaning for a DFA
+	Fragment body(uint32_t id)
+	{
+		if (active[id])
+			throw 2;
+
+		active[id] = true;
+
+		const auto items = grammar.body(id);
+		const Fragment result = empty();
+		const uint32_t end = add();
+
+		for (const auto &[begin, stop] : split_alternatives(items))
+		{
+			Fragment seq = empty();
+			states[result.begin].epsilon.push_back(seq.begin);
+
+			for (size_t i = begin; i < stop; ++i)
+			{
+				const Fragment f = item(items[i]);
+				states[seq.end].epsilon.push_back(f.begin);
+				seq.end = f.end;
+			}
+
+			states[seq.end].epsilon.push_back(end);
+		}
+
+		active[id] = false;
+
+		return { result.begin, end };
+	}
+
+	void closure(std::vector<uint32_t> &set) const
+	{
+		std::vector<bool> seen(states.size());
+		std::vector<uint32_t> pending = set;
+
+		for (uint32_t s : set)
+			seen[s] = true;
+
+		while (!pending.empty())
+		{
+			const uint32_t s = pending.back();
+			pending.pop_back();
+
+			for (uint32_t t : states[s].epsilon)
+			{
+				if (!seen[t])
+				{
+					seen[t] = true;
+					set.push_back(t);
+					pending.push_back(t);
+				}
+			}
+		}
+
+		std::sort(set.begin(), set.end());
+		set.erase(std::unique(set.begin(), set.end()), set.end());
+	}
+};
+
+// Literals and classes are named after their dump
+std::string token_name(const ir::Grammar &grammar, ir::Node node)
+{
+	node.optional = false;
+	node.multiple = false;
+	return dump(grammar, std::span<const ir::Node>(&node, 1));
+}
+
+uint32_t add_token(Lexer &lexer, std::string name, uint32_t rule = 0, bool skip = false)
+{
+	lexer.tokens.push_back({ std::move(name), rule, skip });
+	return (uint32_t)lexer.tokens.size();
+}
+
+
+} // namespace
+
+
+Lexer build_lexer(const ir::Grammar &grammar, bool utf8)
+{
+	Lexer lexer;
+	lexer.literal_kinds.resize(grammar.literals.size());
+	lexer.negated_kinds.resize(grammar.literals.size());
+	lexer.class_kinds.resize(grammar.classes.size());
+	lexer.rule_kinds.resize(grammar.size());
+
+	// literals first, then the rules in order, then the classes
+	for (uint32_t id = 1; id < grammar.size(); ++id)
+	{
+		if (grammar.lexed(id))
+			continue;
+
+		for (const auto &v : grammar.body(id))
+		{
+			if (v.type == ir::NodeType::Literal && !v.negate)
+			{
+				if (grammar.literals[v.value].empty())
+					throw 2;
+
+				if (lexer.literal_kinds[v.value] == 0)
+					lexer.literal_kinds[v.value] = add_token(lexer, token_name(grammar, v));
+			}
+			else
+			if (v.type == ir::NodeType::Reference && grammar.definitions[v.value].skip)
+			{
+				throw 2;
+			}
+		}
+	}
+
+	for (uint32_t id = 1; id <= grammar.rule_count; ++id)
+	{
+		const ir::Definition &d = grammar.definitions[id];
+
+		if (d.token || d.skip)
+			lexer.rule_kinds[id] = add_token(lexer, d.name, id, d.skip);
+	}
+
+	for (uint32_t id = 1; id < grammar.size(); ++id)
+	{
+		if (grammar.lexed(id))
+			continue;
+
+		for (const auto &v : grammar.body(id))
+		{
+			if (v.type == ir::NodeType::CharClass && lexer.class_kinds[v.value] == 0)
+			{
+				lexer.class_kinds[v.value] = add_token(lexer, token_name(grammar, v));
+			}
+			else
+			if (v.type == ir::NodeType::Literal && v.negate && lexer.negated_kinds[v.value] == 0)
+			{
+				if (utf8 ? !single_code_point(grammar.literals[v.value]) : grammar.literals[v.value].size() != 1)
+					throw 2;
+
+				lexer.negated_kinds[v.value] = add_token(lexer, token_name(grammar, v));
+			}
+		}
+	}
+
+	Nfa nfa(grammar, utf8);
+	const uint32_t start = nfa.add();
+
+	auto add_kind = [&](uint32_t kind, Nfa::Fragment f) {
+		nfa.states[start].epsilon.push_back(f.begin);
+		nfa.states[f.end].accept = kind;
+	};
+
+	for (uint32_t i = 0; i < grammar.literals.size(); ++i)
+	{
+		ir::Node node;
+		node.type = ir::NodeType::Literal;
+		node.value = i;
+
+		if (lexer.literal_kinds[i] != 0)
+			add_kind(lexer.literal_kinds[i], nfa.once(node));
+
+		node.negate = true;
+
+		if (lexer.negated_kinds[i] != 0)
+			add_kind(lexer.negated_kinds[i], nfa.once(node));
+	}
+
+	for (uint32_t i = 0; i < grammar.classes.size(); ++i)
+	{
+		if (lexer.class_kinds[i] != 0)
+			add_kind(lexer.class_kinds[i], nfa.char_class(i));
+	}
+
+	for (uint32_t id = 1; id <= grammar.rule_count; ++id)
+	{
+		if (lexer.rule_kinds[id] != 0)
+			add_kind(lexer.rule_kinds[id], nfa.body(id));
+	}
+
+	// bytes in the same sets everywhere get the same column
+	{
+		std::vector<std::bitset<256>> sets;
+
+		for (const auto &state : nfa.states)
+		{
+			if (state.bytes.any() && std::find(sets.begin(), sets.end(), state.bytes) == sets.end())
+				sets.push_back(state.bytes);
+		}
+
+		std::map<std::vector<bool>, uint8_t> signatures;
+
+		for (size_t c = 0; c < 256; ++c)
+		{
+			std::vector<bool> signature(sets.size());
+
+			for (size_t i = 0; i < sets.size(); ++i)
+				signature[i] = sets[i][c];
+
+			auto [it, inserted] = signatures.try_emplace(std::move(signature), (uint8_t)signatures.size());
+			lexer.columns[c] = it->second;
+		}
+
+		lexer.column_count = (uint32_t)signatures.size();
+	}
+
+	std::array<uint8_t, 256> representative{};
+
+	for (size_t c = 256; c-- > 0; )
+		representative[lexer.columns[c]] = (uint8_t)c;
+
+	// subset construction, state 0 is the empty set
+	std::map<std::vector<uint32_t>, uint32_t> ids;
+	std::vector<std::vector<uint32_t>> sets(2);
+
+	sets[1] = { start };
+	nfa.closure(sets[1]);
+
+	ids.emplace(std::vector<uint32_t>(), 0);
+	ids.emplace(sets[1], 1);
+
+	lexer.next.resize(2 * lexer.column_count);
+	lexer.accept.resize(2);
+
+	for (uint32_t state = 1; state < sets.size(); ++state)
+	{
+		uint32_t accept = 0;
+
+		for (uint32_t s : sets[state])
+		{
+			if (nfa.states[s].accept != 0 && (accept == 0 || nfa.states[s].accept < accept))
+				accept = nfa.states[s].accept;
+		}
+
+		lexer.accept[state] = accept;
+
+		for (uint32_t column = 0; column < lexer.column_count; ++column)
+		{
+			const uint8_t c = representative[column];
+
+			std::vector<uint32_t> target;
+
+			for (uint32_t s : sets[state])
+			{
+				if (nfa.states[s].bytes[c])
+					target.push_back(nfa.states[s].next);
+			}
+
+			nfa.closure(target);
+
+			auto [it, inserted] = ids.try_emplace(target, (uint32_t)sets.size());
+
+			if (inserted)
+			{
+				sets.push_back(std::move(target));
+				lexer.next.resize(sets.size() * lexer.column_count);
+				lexer.accept.resize(sets.size());
+			}
+
+			lexer.next[state * lexer.column_count + column] = it->second;
+		}
+	}
+
+	return lexer;
+}
+
+
+} // namespace helpers
+
+
+} // namespace pgen
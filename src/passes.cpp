@@ -0,0 +1,429 @@
+#include "pch.hpp"
+#include "pgen.hpp"
+#include "analysis.hpp"
+
+
+namespace pgen
+{
+
+
+namespace ir
+{
+
+
+namespace
+{
+
+
+bool same_node(const Node &a, const Node &b)
+{
+	return a.type == b.type
+		&& a.value == b.value
+		&& a.optional == b.optional
+		&& a.multiple == b.multiple
+		&& a.negate == b.negate;
+}
+
+// Bodies a pass rewrites are appended; the old range is left unused
+void set_body(Grammar &grammar, uint32_t id, const std::vector<Node> &items)
+{
+	grammar.definitions[id].begin = (uint32_t)grammar.nodes.size();
+	grammar.nodes.insert(grammar.nodes.end(), items.begin(), items.end());
+	grammar.definitions[id].end = (uint32_t)grammar.nodes.size();
+}
+
+uint32_t add_group(Grammar &grammar, std::unordered_set<std::string> &names, uint32_t parent, const std::vector<Node> &items)
+{
+	Definition group;
+	group.parent = parent;
+	group.group = true;
+	group.transparent = true;
+
+	for (size_t i = 0; ; ++i)
+	{
+		group.name = grammar.definitions[parent].name + "_$f" + std::to_string(i);
+
+		if (names.insert(group.name).second)
+			break;
+	}
+
+	grammar.definitions.push_back(std::move(group));
+
+	const uint32_t id = grammar.size() - 1;
+	set_body(grammar, id, items);
+
+	return id;
+}
+
+std::vector<uint32_t> find_rules(const Grammar &grammar, const std::vector<std::string> &names)
+{
+	std::vector<uint32_t> result;
+
+	for (uint32_t id = 1; id <= grammar.rule_count; ++id)
+	{
+		if (std::find(names.begin(), names.end(), grammar.definitions[id].name) != names.end())
+			result.push_back(id);
+	}
+
+	return result;
+}
+
+
+} // namespace
+
+
+void inline_rules(Grammar &grammar, const std::vector<std::string> &keep)
+{
+	const auto kept = find_rules(grammar, keep);
+
+	// a token's node is what the lexer hands over, there is nothing to inline;
+	// a parallel parse splits at calls of a @sync rule
+	auto inlinable = [&](uint32_t id) {
+		return !grammar.definitions[id].token
+			&& !grammar.definitions[id].skip
+			&& !grammar.definitions[id].sync
+			&& grammar.definitions[id].end - grammar.definitions[id].begin == 1
+			&& grammar.nodes[grammar.definitions[id].begin].type != NodeType::Or
+			&& grammar.nodes[grammar.definitions[id].begin].type != NodeType::Cut
+			&& std::find(kept.begin(), kept.end(), id) == kept.end();
+	};
+
+	// a chain of wrappers takes a round per link, a cycle of them would never settle
+	for (uint32_t round = 0; round < grammar.size(); ++round)
+	{
+		bool changed = false;
+
+		for (auto &node : grammar.nodes)
+		{
+			if (node.type != NodeType::Reference || !inlinable(node.value))
+				continue;
+
+			const Node &item = grammar.nodes[grammar.definitions[node.value].begin];
+
+			// (x?)* would loop forever, x+ under ? is fine as x*
+			if ((node.optional || node.multiple) && (item.optional || item.multiple))
+				continue;
+
+			if (item.type == NodeType::Reference && item.value == node.value)
+				continue;
+
+			const bool optional = node.optional;
+			const bool multiple = node.multiple;
+
+			node = item;
+			node.optional = node.optional || optional;
+			node.multiple = node.multiple || multiple;
+
+			changed = true;
+		}
+
+		if (!changed)
+			break;
+	}
+}
+
+void left_factor(Grammar &grammar)
+{
+	std::unordered_set<std::string> names;
+
+	for (const auto &d : grammar.definitions)
+		names.insert(d.name);
+
+	// groups added on the way are factored too
+	for (uint32_t id = 1; id < grammar.size(); ++id)
+	{
+		const auto body = grammar.body(id);
+		const std::vector<Node> items(body.begin(), body.end());
+
+		std::vector<std::vector<Node>> alternatives;
+
+		for (const auto &[begin, end] : helpers::split_alternatives(items))
+			alternatives.emplace_back(items.begin() + begin, items.begin() + end);
+
+		// moving a cut into a group would only commit the group
+		auto has_cut = [](const std::vector<Node> &alt) {
+			return std::any_of(alt.begin(), alt.end(), [](const Node &node) { return node.type == NodeType::Cut; });
+		};
+
+		std::vector<Node> result;
+		bool changed = false;
+
+		for (size_t i = 0; i < alternatives.size(); )
+		{
+			// extend the run while it keeps a common prefix that leaves every alternative an item
+			size_t prefix = has_cut(alternatives[i]) ? 0 : alternatives[i].size() - std::min<size_t>(alternatives[i].size(), 1);
+			size_t j = i + 1;
+
+			for (; j < alternatives.size(); ++j)
+			{
+				const auto &alt = alternatives[j];
+
+				if (has_cut(alt))
+					break;
+
+				size_t common = 0;
+
+				while (common < prefix && common + 1 < alt.size() && same_node(alternatives[i][common], alt[common]))
+					++common;
+
+				if (common == 0)
+					break;
+
+				prefix = common;
+			}
+
+			if (i != 0)
+				result.push_back({ NodeType::Or });
+
+			if (j - i < 2)
+			{
+				result.insert(result.end(), alternatives[i].begin(), alternatives[i].end());
+				++i;
+				continue;
+			}
+
+			std::vector<Node> suffixes;
+
+			for (size_t k = i; k < j; ++k)
+			{
+				if (k != i)
+					suffixes.push_back({ NodeType::Or });
+
+				suffixes.insert(suffixes.end(), alternatives[k].begin() + prefix, alternatives[k].end());
+			}
+
+			result.insert(result.end(), alternatives[i].begin(), alternatives[i].begin() + prefix);
+
+			Node group;
+			group.type = NodeType::Group;
+			group.value = add_group(grammar, names, id, suffixes);
+			result.push_back(group);
+
+			changed = true;
+			i = j;
+		}
+
+		if (changed)
+			set_body(grammar, id, result);
+	}
+}
+
+void merge_literals(Grammar &grammar)
+{
+	std::unordered_map<std::string, uint32_t> interned;
+
+	for (uint32_t i = 0; i < grammar.literals.size(); ++i)
+		interned.emplace(grammar.literals[i], i);
+
+	// an empty literal fails at the end of the input, merged into the one
+	// before it would not
+	auto plain = [&](const Node &node) {
+		return node.type == NodeType::Literal && !node.optional && !node.multiple && !node.negate && !grammar.literals[node.value].empty();
+	};
+
+	// outside of token rules every literal is a token of its own
+	const bool tokens = std::any_of(grammar.definitions.begin(), grammar.definitions.end(), [](const Definition &d) { return d.token || d.skip; });
+
+	// new literals are only appended once every lookup into the old ones is done
+	std::vector<std::string> added;
+
+	for (uint32_t id = 1; id < grammar.size(); ++id)
+	{
+		if (tokens && !grammar.lexed(id))
+			continue;
+
+		const auto body = grammar.body(id);
+
+		std::vector<Node> result;
+		bool changed = false;
+
+		for (size_t i = 0; i < body.size(); ++i)
+		{
+			if (!plain(body[i]) || i + 1 == body.size() || !plain(body[i + 1]))
+			{
+				result.push_back(body[i]);
+				continue;
+			}
+
+			std::string lit = grammar.literals[body[i].value];
+
+			for (; i + 1 < body.size() && plain(body[i + 1]); ++i)
+				lit += grammar.literals[body[i + 1].value];
+
+			Node node;
+			node.type = NodeType::Literal;
+
+			if (auto it = interned.find(lit); it != interned.end())
+			{
+				node.value = it->second;
+			}
+			else
+			{
+				node.value = (uint32_t)(grammar.literals.size() + added.size());
+				interned.emplace(lit, node.value);
+				added.push_back(std::move(lit));
+			}
+
+			result.push_back(node);
+			changed = true;
+		}
+
+		if (changed)
+			set_body(grammar, id, result);
+	}
+
+	for (auto &lit : added)
+		grammar.literals.push_back(std::move(lit));
+}
+
+// Renumbers what is left, rules first, and packs nodes, literals and classes
+void remove_unreachable(Grammar &grammar, const std::vector<std::string> &roots)
+{
+	std::vector<uint32_t> pending = find_rules(grammar, roots);
+
+	// nothing refers to what the lexer skips
+	for (uint32_t id = 1; id <= grammar.rule_count; ++id)
+	{
+		if (roots.empty() || grammar.definitions[id].skip)
+			pending.push_back(id);
+	}
+
+	std::vector<bool> reachable(grammar.size());
+
+	// the definition each one was first reached from
+	std::vector<uint32_t> referrer(grammar.size());
+
+	for (uint32_t id : pending)
+		reachable[id] = true;
+
+	while (!pending.empty())
+	{
+		const uint32_t id = pending.back();
+		pending.pop_back();
+
+		for (const auto &node : grammar.body(id))
+		{
+			if ((node.type == NodeType::Reference || node.type == NodeType::Group) && !reachable[node.value])
+			{
+				reachable[node.value] = true;
+				referrer[node.value] = id;
+				pending.push_back(node.value);
+			}
+		}
+	}
+
+	std::vector<uint32_t> ids(grammar.size());
+
+	Grammar result;
+	result.definitions.emplace_back();
+
+	for (uint32_t id = 1; id < grammar.size(); ++id)
+	{
+		if (!reachable[id])
+			continue;
+
+		// a group keeps the nearest ancestor that is left, so rule_of() and
+		// lexed() still see the rule it is in; with the rule inlined away it
+		// goes to where it is used
+		uint32_t parent = grammar.definitions[id].parent;
+
+		while (parent != 0 && !reachable[parent])
+			parent = grammar.definitions[parent].parent;
+
+		if (grammar.definitions[id].group && parent == 0)
+			parent = referrer[id];
+
+		ids[id] = result.size();
+		result.definitions.push_back(grammar.definitions[id]);
+		result.definitions.back().parent = parent;
+
+		if (id <= grammar.rule_count)
+			++result.rule_count;
+	}
+
+	std::unordered_map<std::string_view, uint32_t> literals;
+	std::unordered_multimap<std::bitset<256>, uint32_t> classes;
+
+	for (uint32_t id = 1; id < result.size(); ++id)
+	{
+		Definition &d = result.definitions[id];
+		const uint32_t begin = (uint32_t)result.nodes.size();
+
+		for (uint32_t i = d.begin; i < d.end; ++i)
+		{
+			Node node = grammar.nodes[i];
+
+			switch (node.type)
+			{
+				case NodeType::Literal:
+					{
+						auto [it, inserted] = literals.try_emplace(grammar.literals[node.value], (uint32_t)result.literals.size());
+
+						if (inserted)
+							result.literals.push_back(grammar.literals[node.value]);
+
+						node.value = it->second;
+						break;
+					}
+				case NodeType::CharClass:
+					{
+						const auto &code_points = grammar.class_code_points[node.value];
+						auto [first, last] = classes.equal_range(grammar.classes[node.value]);
+						auto it = std::find_if(first, last, [&](const auto &v) { return result.class_code_points[v.second] == code_points; });
+
+						if (it == last)
+						{
+							it = classes.emplace(grammar.classes[node.value], (uint32_t)result.classes.size());
+							result.classes.push_back(grammar.classes[node.value]);
+							result.class_code_points.push_back(code_points);
+						}
+
+						node.value = it->second;
+						break;
+					}
+				case NodeType::Reference:
+				case NodeType::Group:
+					node.value = ids[node.value];
+					break;
+				default:
+					break;
+			}
+
+			result.nodes.push_back(node);
+		}
+
+		d.begin = begin;
+		d.end = (uint32_t)result.nodes.size();
+		d.parent = ids[d.parent];
+	}
+
+	grammar = std::move(result);
+}
+
+void optimize(Grammar &grammar, const PassOptions &options)
+{
+	for (Pass pass : options.passes)
+	{
+		switch (pass)
+		{
+			case Pass::InlineRules:
+				inline_rules(grammar, options.keep);
+				break;
+			case Pass::LeftFactor:
+				left_factor(grammar);
+				break;
+			case Pass::MergeLiterals:
+				merge_literals(grammar);
+				break;
+			case Pass::RemoveUnreachable:
+				remove_unreachable(grammar, options.roots);
+				break;
+		}
+	}
+}
+
+
+} // namespace ir
+
+
+} // namespace pgen
@@ -4,3 +4,11 @@
 #include <vector>
 #include <optional>
 #include <unordered_map>
+#include <unordered_set>
+#include <bitset>
+#include <array>
+#include <algorithm>
+#include <map>
+#include <cstring>
+#include <charconv>
+#include <stdexcept>
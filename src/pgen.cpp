@@ -1,5 +1,6 @@
 #include "pch.hpp"
 #include "pgen.hpp"
+#include "analysis.hpp"
 
 
 namespace pgen
@@ -36,6 +37,14 @@ uint8_t hex2num(char c)
 	return 0;
 }
 
+bool is_hex(char c)
+{
+	return
+		(c >= 'a' && c <= 'f') ||
+		(c >= 'A' && c <= 'F') ||
+		(c >= '0' && c <= '9');
+}
+
 bool is_eof(const char *s, const char *e)
 {
 	return s >= e;
@@ -110,110 +119,157 @@ bool parse_literal(const char *&s, const char *e, const std::string_view &lit)
 	return true;
 }
 
-std::optional<std::string> parse_identifier(const char *&s, const char *e)
+// `{e9}` after a `\u`, a code point that UTF-8 can encode
+std::optional<char32_t> parse_code_point(const char *&s, const char *e)
 {
-	std::string result;
+	const char *sc = s;
+
+	if (!parse_literal(sc, e, "{"))
+		return std::nullopt;
+
+	char32_t c = 0;
+	size_t digits = 0;
+
+	for (; !is_eof(sc, e) && is_hex(*sc) && digits < 6; ++sc, ++digits)
+		c = c << 4 | hex2num(*sc);
+
+	if (digits == 0 || !parse_literal(sc, e, "}") || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+		return std::nullopt;
+
+	s = sc;
+	return c;
+}
+
+// A character of a class, as bytes and as a code point
+struct ClassChar
+{
+	std::string bytes;
+	char32_t code_point = 0;
+};
+
+std::optional<ClassChar> parse_class_char(const char *&s, const char *e)
+{
+	if (is_eof(s, e))
+		return std::nullopt;
 
-	while (!is_eof(s, e))
+	if (*s != '\\')
 	{
-		if (!is_identifier(*s))
-			break;
+		// raw text is read as UTF-8, a byte that starts no valid sequence as itself
+		const char *start = s;
+
+		if (auto c = helpers::decode_utf8(s, e))
+			return ClassChar{ std::string(start, s), c.value() };
 
-		result += *s;
 		++s;
+		return ClassChar{ std::string(start, s), (uint8_t)*start };
 	}
 
-	if (result.empty())
+	++s;
+
+	if (is_eof(s, e))
 		return std::nullopt;
 
-	return result;
+	char c = *s++;
+
+	auto byte = [](uint8_t v) {
+		return ClassChar{ std::string(1, (char)v), v };
+	};
+
+	switch (c)
+	{
+		case 'x':
+			{
+				if (s + 2 > e)
+					return std::nullopt;
+
+				uint8_t v = hex2num(s[0]) << 4 | hex2num(s[1]);
+				s += 2;
+				return byte(v);
+			}
+		case 'u':
+			{
+				auto v = parse_code_point(s, e);
+
+				if (!v)
+					return std::nullopt;
+
+				return ClassChar{ helpers::encode_utf8(v.value()), v.value() };
+			}
+		case 'a': return byte('\a');
+		case 'b': return byte('\b');
+		case 't': return byte('\t');
+		case 'n': return byte('\n');
+		case 'v': return byte('\v');
+		case 'f': return byte('\f');
+		case 'r': return byte('\r');
+		default: return byte((uint8_t)c);
+	}
 }
 
-std::optional<std::string> parse_string(const char *&s, const char *e)
+// [a-z_] or [^"\\], byte by byte and as code points
+bool parse_class(const char *&s, const char *e, std::bitset<256> &bytes, std::vector<CodePointRange> &code_points)
 {
-	std::string result;
-
 	const char *sc = s;
 
-	if (!parse_literal(sc, e, "\""))
-		return std::nullopt;
+	if (!parse_literal(sc, e, "["))
+		return false;
 
-	bool escape = false;
+	const bool negate = parse_literal(sc, e, "^");
 
 	while (!is_eof(sc, e))
 	{
-		if (escape)
+		if (parse_literal(sc, e, "]"))
 		{
-			escape = false;
+			helpers::normalize_code_points(code_points);
 
-			if (*sc == 'x')
+			if (negate)
 			{
-				++sc;
+				bytes.flip();
+				code_points = helpers::negate_code_points(code_points);
+			}
 
-				if (sc + 2 > e)
-					return std::nullopt;
+			s = sc;
+			return true;
+		}
 
-				char c0 = sc[0];
-				char c1 = sc[1];
+		auto first = parse_class_char(sc, e);
 
-				sc += 2;
+		if (!first)
+			return false;
 
-				result += (uint32_t)hex2num(c0) << 8 | (uint32_t)hex2num(c1);
-				continue;
-			}
-			if (*sc == '"' || *sc == '\\')
-			{
-				result += *sc;
-				++sc;
-				continue;
-			}
-			else
-			if (*sc == 'a')
-				result += "\a";
-			else
-			if (*sc == 'b')
-				result += "\b";
-			else
-			if (*sc == 't')
-				result += "\t";
-			else
-			if (*sc == 'n')
-				result += "\n";
-			else
-			if (*sc == 'v')
-				result += "\v";
-			else
-			if (*sc == 'f')
-				result += "\f";
-			else
-			if (*sc == 'r')
-				result += "\r";
-			else
-				result += "\\";
+		ClassChar last = first.value();
 
+		if (sc + 1 < e && sc[0] == '-' && sc[1] != ']')
+		{
 			++sc;
-			continue;
+
+			auto v = parse_class_char(sc, e);
+
+			if (!v || v->code_point < first->code_point)
+				return false;
+
+			last = v.value();
 		}
-		else
-		if (*sc == '"')
+
+		// a range of longer sequences has no byte form, its ends stand for themselves
+		if (first->bytes.size() == 1 && last.bytes.size() == 1)
 		{
-			++sc;
-			s = sc;
-			return result;
+			if ((uint8_t)last.bytes[0] < (uint8_t)first->bytes[0])
+				return false;
+
+			for (size_t c = (uint8_t)first->bytes[0]; c <= (uint8_t)last.bytes[0]; ++c)
+				bytes.set(c);
 		}
 		else
-		if (*sc == '\\')
 		{
-			++sc;
-			escape = true;
-			continue;
+			for (char c : first->bytes + last.bytes)
+				bytes.set((uint8_t)c);
 		}
 
-		result += *sc;
-		++sc;
+		code_points.push_back({ first->code_point, last.code_point });
 	}
 
-	return std::nullopt;
+	return false;
 }
 
 std::string escape_string(const std::string_view &str)
@@ -255,297 +311,564 @@ std::string escape_string(const std::string_view &str)
 	return result;
 }
 
-std::optional<RuleItem> parse_ruleitem(const char *&s, const char *e, const std::string_view &parent_group_prefix, size_t &parent_group_id);
-
-std::optional<RuleItemGroup> parse_group(const char *&s, const char *e, const std::string_view &parent_group_prefix, size_t &parent_group_id)
+// Grammar front end. Names and literals are sliced out of the source, items
+// are built in place and moved, the first error stops the parse.
+class GrammarParser
 {
-	RuleItemGroup result;
-
-	if (!parse_literal(s, e, "("))
-		return std::nullopt;
-
-	skip_whitespace(s, e);
-
-	result.name = std::string(parent_group_prefix) + "_$g" + std::to_string(parent_group_id);
-	size_t group_id = 0;
+public:
+	GrammarParser(const char *str, size_t size)
+		: begin(str)
+		, s(str)
+		, e(str + size)
+	{
+	}
 
-	while (!is_eof(s, e))
+	ParseResult parse()
 	{
-		if (parse_literal(s, e, ")"))
-			break;
+		ParseResult result;
 
-		auto r = parse_ruleitem(s, e, result.name, group_id).value();
+		skip_whitespace(s, e);
 
-		if (r.type == RuleItemType::ZeroOrMore)
-		{
-			if (!result.seq.empty())
-			{
-				result.seq.back().optional = true;
-				result.seq.back().multiple = true;
-			}
-		}
-		else
-		if (r.type == RuleItemType::OneOrMore)
-		{
-			if (!result.seq.empty())
-			{
-				result.seq.back().multiple = true;
-			}
-		}
-		else
-		if (r.type == RuleItemType::ZeroOrOne)
+		while (!is_eof(s, e))
 		{
-			if (!result.seq.empty())
+			if (parse_literal(s, e, "#"))
 			{
-				result.seq.back().optional = true;
+				while (!is_eof(s, e))
+				{
+					if (parse_newline(s, e))
+						break;
+
+					++s;
+				}
+
+				skip_whitespace(s, e);
+				continue;
 			}
+
+			Rule &rule = result.rules.emplace_back();
+
+			if (!parse_annotation(rule) || !parse_rule(rule))
+				break;
+
+			skip_whitespace(s, e);
 		}
-		else
-		if (r.type == RuleItemType::Negate)
-		{
-			if (!result.seq.empty())
-			{
-				if (result.seq.back().type != RuleItemType::Literal)
-					throw 2;
 
-				result.seq.back().negate = true;
-			}
+		if (!error)
+			check_references();
+
+		if (error)
+		{
+			result.rules.clear();
+			result.error = std::move(error);
 		}
 		else
 		{
-			result.seq.push_back(r);
+			result.grammar = ir::lower(result.rules);
 		}
 
-		skip_whitespace(s, e);
+		return result;
 	}
 
-	++parent_group_id;
-
-	return result;
-}
+private:
+	const char *begin;
+	const char *s;
+	const char *e;
 
-std::optional<RuleItem> parse_ruleitem(const char *&s, const char *e, const std::string_view &parent_group_prefix, size_t &parent_group_id)
-{
-	RuleItem result;
+	std::optional<ParseError> error;
 
-	if (is_eof(s, e))
-		return std::nullopt;
+	// rule names as slices of the source, and every name used as an item with
+	// where it was used; items still copy the name they refer to
+	std::unordered_map<std::string_view, const char *> rules;
+	std::vector<std::pair<std::string_view, const char *>> references;
 
-	if (auto v = parse_string(s, e))
-	{
-		result.type = RuleItemType::Literal;
-		result.literal = v.value();
-	}
-	else
-	if (auto v = parse_identifier(s, e))
-	{
-		result.type = RuleItemType::Identifier;
-		result.identifier = v.value();
-	}
-	else
-	if (auto v = parse_group(s, e, parent_group_prefix, parent_group_id))
-	{
-		result.type = RuleItemType::Group;
-		result.group = v.value();
-	}
-	else
-	if (parse_literal(s, e, "|"))
-	{
-		result.type = RuleItemType::Or;
-	}
-	else
-	if (parse_literal(s, e, "*"))
-	{
-		result.type = RuleItemType::ZeroOrMore;
-	}
-	else
-	if (parse_literal(s, e, "+"))
-	{
-		result.type = RuleItemType::OneOrMore;
-	}
-	else
-	if (parse_literal(s, e, "?"))
-	{
-		result.type = RuleItemType::ZeroOrOne;
-	}
-	else
-	if (parse_literal(s, e, "^"))
-	{
-		result.type = RuleItemType::Negate;
-	}
-	else
+	bool fail(ParseErrorKind kind, const char *at, std::string_view name = {})
 	{
-		return std::nullopt;
+		ParseError err;
+		err.kind = kind;
+		err.offset = at - begin;
+		err.line = 1 + std::count(begin, at, '\n');
+		err.column = 1 + (at - begin) - (std::string_view(begin, at - begin).rfind('\n') + 1);
+		err.name = name;
+
+		error = std::move(err);
+		return false;
 	}
 
-	return result;
-}
+	std::string_view parse_name()
+	{
+		const char *start = s;
 
-std::optional<Rule> parse_rule(const char *&s, const char *e)
-{
-	Rule result;
+		while (!is_eof(s, e) && is_identifier(*s))
+			++s;
 
-	result.name = parse_identifier(s, e).value();
+		return std::string_view(start, s - start);
+	}
 
-	skip_whitespace(s, e);
+	// Escape free literals are copied straight from the source
+	bool parse_string(std::string &out)
+	{
+		const char *start = s;
 
-	if (!parse_literal(s, e, ":"))
-		throw 2;
+		++s;
 
-	skip_whitespace(s, e);
+		const char *plain = s;
 
-	size_t group_id = 0;
+		while (!is_eof(s, e) && *s != '"' && *s != '\\')
+			++s;
 
-	while (!is_eof(s, e))
-	{
-		auto r = parse_ruleitem(s, e, result.name, group_id).value();
+		out.assign(plain, s);
 
-		if (r.type == RuleItemType::ZeroOrMore)
-		{
-			if (!result.seq.empty())
-			{
-				result.seq.back().optional = true;
-				result.seq.back().multiple = true;
-			}
-		}
-		else
-		if (r.type == RuleItemType::OneOrMore)
+		while (!is_eof(s, e))
 		{
-			if (!result.seq.empty())
+			if (*s == '"')
 			{
-				result.seq.back().multiple = true;
+				++s;
+				return true;
 			}
-		}
-		else
-		if (r.type == RuleItemType::ZeroOrOne)
-		{
-			if (!result.seq.empty())
+
+			if (*s != '\\')
 			{
-				result.seq.back().optional = true;
+				out += *s++;
+				continue;
 			}
-		}
-		else
-		if (r.type == RuleItemType::Negate)
-		{
-			if (!result.seq.empty())
+
+			++s;
+
+			if (is_eof(s, e))
+				break;
+
+			const char c = *s++;
+
+			switch (c)
 			{
-				if (result.seq.back().type != RuleItemType::Literal)
-					throw 2;
+				case 'x':
+					if (e - s < 2)
+						return fail(ParseErrorKind::UnterminatedString, start);
 
-				result.seq.back().negate = true;
+					out += (char)(hex2num(s[0]) << 4 | hex2num(s[1]));
+					s += 2;
+					break;
+				case 'u':
+					{
+						auto v = parse_code_point(s, e);
+
+						if (!v)
+							return fail(ParseErrorKind::UnterminatedString, start);
+
+						out += helpers::encode_utf8(v.value());
+						break;
+					}
+				case '"': out += '"'; break;
+				case '\\': out += '\\'; break;
+				case 'a': out += '\a'; break;
+				case 'b': out += '\b'; break;
+				case 't': out += '\t'; break;
+				case 'n': out += '\n'; break;
+				case 'v': out += '\v'; break;
+				case 'f': out += '\f'; break;
+				case 'r': out += '\r'; break;
+				default: out += '\\'; break;
 			}
 		}
-		else
-		{
-			result.seq.push_back(r);
-		}
-
-		if (parse_two_newlines(s, e))
-			break;
 
-		skip_whitespace(s, e);
+		return fail(ParseErrorKind::UnterminatedString, start);
 	}
 
-	if (result.seq.empty())
-		throw 2;
-
-	return result;
-}
-
-std::vector<Rule> parse(const char *str, size_t size)
-{
-	std::vector<Rule> result;
+	bool parse_group(RuleItemGroup &group, const std::string &parent, size_t &parent_group_id)
+	{
+		const char *start = s;
 
-	const char *s = str;
-	const char *e = str + size;
+		++s;
+		skip_whitespace(s, e);
 
-	skip_whitespace(s, e);
+		group.name = parent + "_$g" + std::to_string(parent_group_id++);
+		size_t group_id = 0;
 
-	while (!is_eof(s, e))
-	{
-		if (parse_literal(s, e, "#"))
+		while (!is_eof(s, e))
 		{
-			while (!is_eof(s, e))
-			{
-				if (parse_newline(s, e))
-					break;
+			if (parse_literal(s, e, ")"))
+				return true;
 
-				++s;
-			}
+			if (!parse_item(group.seq, group.name, group_id))
+				return false;
 
 			skip_whitespace(s, e);
-			continue;
 		}
 
-		result.push_back(parse_rule(s, e).value());
-		skip_whitespace(s, e);
+		return fail(ParseErrorKind::UnterminatedGroup, start);
 	}
 
-	return result;
-}
+	// Appends the next item to seq, postfix operators modify the last one instead
+	bool parse_item(std::vector<RuleItem> &seq, const std::string &parent, size_t &group_id)
+	{
+		const char *start = s;
 
+		if (is_eof(s, e))
+			return fail(ParseErrorKind::ExpectedItem, s);
 
-namespace helpers
-{
+		const char c = *s;
 
+		if (c == '"')
+		{
+			RuleItem &item = seq.emplace_back();
+			item.type = RuleItemType::Literal;
+			return parse_string(item.literal);
+		}
 
-std::string dump(const RuleItem &ruleitem);
+		if (is_identifier(c))
+		{
+			const std::string_view name = parse_name();
+			references.push_back({ name, start });
 
-std::string dump(const std::vector<RuleItem> &seq)
-{
-	std::string result;
+			RuleItem &item = seq.emplace_back();
+			item.type = RuleItemType::Identifier;
+			item.identifier = name;
+			return true;
+		}
 
-	for (const auto &v : seq)
-	{
-		result += dump(v);
+		if (c == '(')
+		{
+			RuleItem &item = seq.emplace_back();
+			item.type = RuleItemType::Group;
+			return parse_group(item.group, parent, group_id);
+		}
 
-		if (v.multiple)
+		if (c == '[')
 		{
-			if (v.optional)
-				result += "*";
-			else
-				result += "+";
+			RuleItem &item = seq.emplace_back();
+			item.type = RuleItemType::CharClass;
+
+			if (!parse_class(s, e, item.char_class, item.code_points))
+				return fail(ParseErrorKind::InvalidCharClass, start);
+
+			return true;
 		}
-		else
-		if (v.optional)
+
+		if (c == '|')
 		{
-			result += "?";
+			++s;
+
+			RuleItem &item = seq.emplace_back();
+			item.type = RuleItemType::Or;
+			return true;
 		}
 
-		result += " ";
-	}
+		if (c == '~')
+		{
+			++s;
 
-	if (result.back() == ' ')
-		result.resize(result.size() - 1);
+			RuleItem &item = seq.emplace_back();
+			item.type = RuleItemType::Cut;
+			return true;
+		}
 
-	return result;
-}
+		if (c != '*' && c != '+' && c != '?' && c != '^')
+			return fail(ParseErrorKind::ExpectedItem, s);
 
-std::string dump(const RuleItemGroup &group)
-{
-	std::string result;
+		++s;
 
-	result += "(";
+		// a postfix operator in front of everything applies to nothing
+		if (seq.empty())
+			return true;
 
-	result += dump(group.seq);
-	
-	result += ")";
+		RuleItem &last = seq.back();
 
-	return result;
-}
+		// a cut is passed once, there is nothing to repeat or make optional
+		if (last.type == RuleItemType::Cut)
+			return fail(ParseErrorKind::ExpectedItem, start);
 
-std::string dump(const RuleItem &ruleitem)
-{
-	switch (ruleitem.type)
-	{
-		case RuleItemType::Literal:
-			return std::string() + "\"" + escape_string(ruleitem.literal) + "\"";
-		case RuleItemType::Identifier:
-			return ruleitem.identifier;
-		case RuleItemType::Group:
-			return dump(ruleitem.group);
+		if (c == '*')
+		{
+			last.optional = true;
+			last.multiple = true;
+		}
+		else
+		if (c == '+')
+		{
+			last.multiple = true;
+		}
+		else
+		if (c == '?')
+		{
+			last.optional = true;
+		}
+		else
+		if (last.type == RuleItemType::CharClass)
+		{
+			last.char_class.flip();
+			last.code_points = helpers::negate_code_points(last.code_points);
+		}
+		else
+		if (last.type == RuleItemType::Literal)
+		{
+			last.negate = true;
+		}
+		else
+		{
+			return fail(ParseErrorKind::InvalidNegation, start);
+		}
+
+		return true;
+	}
+
+	// `@token`, `@skip` or `@sync` in front of a rule
+	bool parse_annotation(Rule &rule)
+	{
+		const char *start = s;
+
+		if (!parse_literal(s, e, "@"))
+			return true;
+
+		const std::string_view name = parse_name();
+
+		if (name == "token")
+			rule.token = true;
+		else
+		if (name == "skip")
+			rule.skip = true;
+		else
+		if (name == "sync")
+			rule.sync = true;
+		else
+			return fail(ParseErrorKind::UnknownAnnotation, start);
+
+		skip_whitespace(s, e);
+		return true;
+	}
+
+	bool parse_rule(Rule &rule)
+	{
+		const char *start = s;
+
+		const std::string_view name = parse_name();
+
+		if (name.empty())
+			return fail(ParseErrorKind::ExpectedRuleName, s);
+
+		if (!rules.emplace(name, start).second)
+			return fail(ParseErrorKind::DuplicateRule, start, name);
+
+		rule.name = name;
+
+		skip_whitespace(s, e);
+
+		if (!parse_literal(s, e, ":"))
+			return fail(ParseErrorKind::ExpectedColon, s);
+
+		skip_whitespace(s, e);
+
+		size_t group_id = 0;
+
+		while (!is_eof(s, e))
+		{
+			if (!parse_item(rule.seq, rule.name, group_id))
+				return false;
+
+			if (parse_two_newlines(s, e))
+				break;
+
+			skip_whitespace(s, e);
+		}
+
+		if (rule.seq.empty())
+			return fail(ParseErrorKind::EmptyRule, start, name);
+
+		return true;
+	}
+
+	void check_references()
+	{
+		for (const auto &[name, at] : references)
+		{
+			if (!rules.contains(name))
+			{
+				fail(ParseErrorKind::UndefinedRule, at, name);
+				return;
+			}
+		}
+	}
+};
+
+std::string ParseError::message() const
+{
+	std::string result = std::to_string(line) + ":" + std::to_string(column) + ": ";
+
+	switch (kind)
+	{
+		case ParseErrorKind::ExpectedRuleName:
+			return result + "expected a rule name";
+		case ParseErrorKind::ExpectedColon:
+			return result + "expected ':' after the rule name";
+		case ParseErrorKind::ExpectedItem:
+			return result + "expected a literal, name, group, character class or operator";
+		case ParseErrorKind::UnterminatedString:
+			return result + "unterminated literal";
+		case ParseErrorKind::UnterminatedGroup:
+			return result + "unterminated group";
+		case ParseErrorKind::InvalidCharClass:
+			return result + "invalid character class";
+		case ParseErrorKind::InvalidNegation:
+			return result + "'^' only applies to literals and character classes";
+		case ParseErrorKind::EmptyRule:
+			return result + "rule '" + name + "' has no items";
+		case ParseErrorKind::DuplicateRule:
+			return result + "rule '" + name + "' is already defined";
+		case ParseErrorKind::UndefinedRule:
+			return result + "rule '" + name + "' is not defined";
+		case ParseErrorKind::UnknownAnnotation:
+			return result + "expected @token, @skip or @sync";
+	}
+
+	return result;
+}
+
+ParseResult try_parse(const char *str, size_t size)
+{
+	return GrammarParser(str, size).parse();
+}
+
+std::vector<Rule> parse(const char *str, size_t size)
+{
+	auto result = try_parse(str, size);
+
+	if (result.error)
+		throw std::move(result.error.value());
+
+	return std::move(result.rules);
+}
+
+
+namespace helpers
+{
+
+
+std::string dump(const RuleItem &ruleitem);
+
+std::string dump(const std::vector<RuleItem> &seq)
+{
+	std::string result;
+
+	for (const auto &v : seq)
+	{
+		result += dump(v);
+
+		if (v.multiple)
+		{
+			if (v.optional)
+				result += "*";
+			else
+				result += "+";
+		}
+		else
+		if (v.optional)
+		{
+			result += "?";
+		}
+
+		result += " ";
+	}
+
+	if (result.back() == ' ')
+		result.resize(result.size() - 1);
+
+	return result;
+}
+
+std::string dump(const RuleItemGroup &group)
+{
+	std::string result;
+
+	result += "(";
+
+	result += dump(group.seq);
+	
+	result += ")";
+
+	return result;
+}
+
+// A member of a class as parse_class reads it, code points past U+00FF as `\u{...}`
+std::string dump_class_char(char32_t c)
+{
+	if (c == ']' || c == '\\' || c == '^' || c == '-')
+		return std::string("\\") + (char)c;
+
+	if (c > ' ' && c < 127)
+		return std::string(1, (char)c);
+
+	const char *digits = "0123456789abcdef";
+
+	if (c < 0x100)
+		return std::string("\\x") + digits[c / 16] + digits[c % 16];
+
+	std::string hex;
+
+	for (; c != 0; c /= 16)
+		hex.insert(hex.begin(), digits[c % 16]);
+
+	return "\\u{" + hex + "}";
+}
+
+std::string dump_class(const std::bitset<256> &bits)
+{
+	std::string result = "[";
+
+	for (size_t c = 0; c < 256; ++c)
+	{
+		if (!bits.test(c))
+			continue;
+
+		size_t last = c;
+
+		while (last + 1 < 256 && bits.test(last + 1))
+			++last;
+
+		result += dump_class_char(c);
+
+		if (last != c)
+			result += "-" + dump_class_char(last);
+
+		c = last;
+	}
+
+	result += "]";
+
+	return result;
+}
+
+std::string dump_class(const std::vector<CodePointRange> &code_points)
+{
+	std::string result = "[";
+
+	for (const auto &r : code_points)
+	{
+		result += dump_class_char(r.first);
+
+		if (r.last != r.first)
+			result += "-" + dump_class_char(r.last);
+	}
+
+	result += "]";
+
+	return result;
+}
+
+std::string dump(const RuleItem &ruleitem)
+{
+	switch (ruleitem.type)
+	{
+		case RuleItemType::Literal:
+			return std::string() + "\"" + escape_string(ruleitem.literal) + "\"";
+		case RuleItemType::Identifier:
+			return ruleitem.identifier;
+		case RuleItemType::Group:
+			return dump(ruleitem.group);
 		case RuleItemType::Or:
 			return "|";
+		case RuleItemType::Cut:
+			return "~";
+		case RuleItemType::CharClass:
+			return dump_class(ruleitem.char_class);
 		default:
 			return "<error>";
 	}
@@ -555,6 +878,15 @@ std::string dump(const Rule &rule)
 {
 	std::string result;
 
+	if (rule.token)
+		result += "@token ";
+	else
+	if (rule.skip)
+		result += "@skip ";
+	else
+	if (rule.sync)
+		result += "@sync ";
+
 	result += rule.name;
 	result += ": ";
 
@@ -576,127 +908,4202 @@ std::string dump(const std::vector<Rule> &rules)
 	return result;
 }
 
-
-void collect_groups(std::vector<const RuleItemGroup *> &groups, const std::vector<RuleItem> &seq)
+std::string dump(const ir::Grammar &grammar, std::span<const ir::Node> items)
 {
-	for (const auto &v : seq)
+	std::string result;
+
+	for (const auto &v : items)
 	{
-		if (v.type == RuleItemType::Group)
+		switch (v.type)
+		{
+			case ir::NodeType::Literal:
+				result += "\"" + escape_string(grammar.literals[v.value]) + "\"";
+				break;
+			case ir::NodeType::CharClass:
+				result += dump_class(grammar.classes[v.value]);
+				break;
+			case ir::NodeType::Reference:
+				result += grammar.definitions[v.value].name;
+				break;
+			case ir::NodeType::Group:
+				result += "(" + dump(grammar, grammar.body(v.value)) + ")";
+				break;
+			case ir::NodeType::Or:
+				result += "|";
+				break;
+			case ir::NodeType::Cut:
+				result += "~";
+				break;
+		}
+
+		if (v.multiple)
 		{
-			groups.push_back(&v.group);
-			collect_groups(groups, v.group.seq);
+			if (v.optional)
+				result += "*";
+			else
+				result += "+";
+		}
+		else
+		if (v.optional)
+		{
+			result += "?";
 		}
+
+		result += " ";
 	}
+
+	if (!result.empty())
+		result.resize(result.size() - 1);
+
+	return result;
 }
 
-std::string generate_rule(const std::vector<RuleItem> &seq, const std::string &name, const std::string &ptype)
+std::string dump(const ir::Grammar &grammar)
 {
 	std::string result;
 
-	result += "// Rule: ";
-	result += dump(seq);
-	result += "\n";
+	for (uint32_t id = 1; id <= grammar.rule_count; ++id)
+	{
+		if (grammar.definitions[id].token)
+			result += "@token ";
+		else
+		if (grammar.definitions[id].skip)
+			result += "@skip ";
+		else
+		if (grammar.definitions[id].sync)
+			result += "@sync ";
 
-	result += "[[nodiscard]]\n";
-	result += "std::optional<$Parsed> $parse_" + name + "(const char *&s, const char *e)\n";
-	result += "{\n";
-	result += "	$Parsed result;\n";
-	result += "	result.type = $ParsedType::" + ptype + ";\n";
-	result += "	result.identifier = $IdentifierType::$i_" + name + ";\n";
-	result += "\n";
+		result += grammar.definitions[id].name;
+		result += ": ";
+		result += dump(grammar, grammar.body(id));
+		result += "\n\n";
+	}
 
-	// each 'or'
-	for (size_t i = 0; i < seq.size(); ++i)
+	return result;
+}
+
+std::string ProfileError::message() const
+{
+	std::string result = std::to_string(line) + ":" + std::to_string(column) + ": ";
+
+	switch (kind)
 	{
-		result += "	{\n";
-		result += "		const char *sc = s;\n";
-		result += "		result.group.clear();\n";
+		case ProfileErrorKind::ExpectedWord:
+			return result + "expected a name or items";
+		case ProfileErrorKind::ExpectedNumber:
+			return result + "expected a count";
+		case ProfileErrorKind::UnknownLine:
+			return result + "expected 'rule' or 'alternative'";
+	}
 
-		size_t level = 0;
+	return result;
+}
 
-		for (; i < seq.size(); ++i)
-		{
-			if (seq[i].type == pgen::RuleItemType::Or)
-				break;
+// Lines of
+//   rule <name> <calls> [<reentries>]
+//   alternative <name> <successes> <items>
+ProfileResult parse_profile(const char *str, size_t size)
+{
+	ProfileResult result;
 
-			//  optional &&  multiple - . if while
-			//  optional && !multiple - . if
-			// !optional &&  multiple - if . while
-			// !optional && !multiple - if .
+	std::string_view text(str, size);
+	size_t line_number = 0;
 
-			result += "\n";
+	// the next word, empty at the end of the line
+	auto next_word = [](std::string_view &line) {
+		while (!line.empty() && line.front() == ' ')
+			line.remove_prefix(1);
 
-			if (seq[i].type == RuleItemType::Literal)
-			{
-				if (seq[i].negate)
-					result += std::string(level, '\t') + "		if (auto v = $parse_negate_literal(sc, e, \"" + escape_string(seq[i].literal) + "\"))\n";
-				else
-					result += std::string(level, '\t') + "		if (auto v = $parse_literal(sc, e, \"" + escape_string(seq[i].literal) + "\"))\n";
-			}
-			else
-			if (seq[i].type == RuleItemType::Group)
-				result += std::string(level, '\t') + "		if (auto v = $parse_" + seq[i].group.name + "(sc, e))\n";
-			else
-				result += std::string(level, '\t') + "		if (auto v = $parse_" + seq[i].identifier + "(sc, e))\n";
+		const size_t end = std::min(line.find(' '), line.size());
+		const std::string_view word = line.substr(0, end);
+		line.remove_prefix(end);
 
-			result += std::string(level, '\t') + "		{\n";
-			result += std::string(level, '\t') + "			result.group.push_back(std::move(v).value());\n";
+		return word;
+	};
 
-			if (seq[i].multiple)
-			{
-				result += "\n";
+	auto to_number = [](std::string_view word) -> std::optional<uint64_t> {
+		uint64_t v = 0;
+		auto [ptr, ec] = std::from_chars(word.data(), word.data() + word.size(), v);
 
-				if (seq[i].type == RuleItemType::Literal)
-				{
-					if (seq[i].negate)
-						result += std::string(level, '\t') + "			while (auto v = $parse_negate_literal(sc, e, \"" + escape_string(seq[i].literal) + "\"))\n";
-					else
-						result += std::string(level, '\t') + "			while (auto v = $parse_literal(sc, e, \"" + escape_string(seq[i].literal) + "\"))\n";
-				}
-				else
-				if (seq[i].type == RuleItemType::Group)
-					result += std::string(level, '\t') + "			while (auto v = $parse_" + seq[i].group.name + "(sc, e))\n";
-				else
-					result += std::string(level, '\t') + "			while (auto v = $parse_" + seq[i].identifier + "(sc, e))\n";
+		if (word.empty() || ec != std::errc() || ptr != word.data() + word.size())
+			return std::nullopt;
 
-				result += std::string(level, '\t') + "			{\n";
-				result += std::string(level, '\t') + "				result.group.push_back(std::move(v).value());\n";
-				result += std::string(level, '\t') + "			}\n";
-				result += "\n";
+		return v;
+	};
+
+	while (!text.empty())
+	{
+		const size_t end = std::min(text.find('\n'), text.size());
+		std::string_view line = text.substr(0, end);
+		text.remove_prefix(std::min(end + 1, text.size()));
+
+		++line_number;
+		const char *line_start = line.data();
+
+		auto error = [&](ProfileErrorKind kind, std::string_view at) {
+			ProfileError e;
+			e.kind = kind;
+			e.offset = at.data() - str;
+			e.line = line_number;
+			e.column = at.data() - line_start + 1;
+
+			return ProfileResult{ {}, e };
+		};
+
+		if (!line.empty() && line.back() == '\r')
+			line.remove_suffix(1);
+
+		if (line.empty() || line.front() == '#')
+			continue;
+
+		const std::string_view kind = next_word(line);
+		const std::string_view name = next_word(line);
+
+		if (kind != "rule" && kind != "alternative")
+			return error(ProfileErrorKind::UnknownLine, kind);
+
+		if (name.empty())
+			return error(ProfileErrorKind::ExpectedWord, name);
+
+		RuleProfile &rule = result.data[std::string(name)];
+
+		const std::string_view count = next_word(line);
+		const auto v = to_number(count);
+
+		if (!v)
+			return error(ProfileErrorKind::ExpectedNumber, count);
+
+		if (kind == "rule")
+		{
+			rule.calls = v.value();
+
+			// only there when the run counted them
+			const std::string_view reentries = next_word(line);
+
+			if (!reentries.empty())
+			{
+				rule.reentries = to_number(reentries);
+
+				if (!rule.reentries)
+					return error(ProfileErrorKind::ExpectedNumber, reentries);
 			}
+		}
+		else
+		{
+			if (line.empty() || line.front() != ' ')
+				return error(ProfileErrorKind::ExpectedWord, line);
 
-			if (seq[i].optional)
-				result += std::string(level, '\t') + "		}\n";
-			else
-				++level;
+			rule.alternatives[std::string(line.substr(1))] = v.value();
 		}
+	}
 
-		result += "\n";
+	return result;
+}
 
-		result += std::string(level, '\t') + "		s = sc;\n";
-		result += std::string(level, '\t') + "		return result;\n";
 
-		for (; level != 0; --level)
-			result += std::string(level - 1, '\t') + "		}\n";
+std::vector<std::pair<size_t, size_t>> split_alternatives(std::span<const ir::Node> items)
+{
+	std::vector<std::pair<size_t, size_t>> result;
+
+	size_t begin = 0;
+
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		if (items[i].type == ir::NodeType::Or)
+		{
+			result.push_back({ begin, i });
+			begin = i + 1;
+		}
+	}
+
+	result.push_back({ begin, items.size() });
+
+	return result;
+}
+
+FirstSet first_set(const ir::Grammar &grammar, const ir::Node &node, const FirstSets &sets)
+{
+	FirstSet result;
+
+	switch (node.type)
+	{
+		case ir::NodeType::Literal:
+			{
+				const std::string &lit = grammar.literals[node.value];
+
+				if (node.negate)
+				{
+					// "x"^ takes any byte but 'x', "xy"^ any byte at all
+					if (lit.size() == 1)
+						result.bytes.set().reset((uint8_t)lit[0]);
+					else
+					if (!lit.empty())
+						result.bytes.set();
+				}
+				else
+				{
+					if (lit.empty())
+						result.nullable = true;
+					else
+						result.bytes.set((uint8_t)lit[0]);
+				}
+			}
+			break;
+
+		case ir::NodeType::CharClass:
+			result.bytes = grammar.classes[node.value];
+			break;
+
+		case ir::NodeType::Reference:
+		case ir::NodeType::Group:
+			result = sets[node.value];
+			break;
+
+		case ir::NodeType::Cut:
+			result.nullable = true;
+			break;
+
+		default:
+			break;
+	}
+
+	if (node.optional)
+		result.nullable = true;
+
+	return result;
+}
+
+FirstSet first_set(const ir::Grammar &grammar, std::span<const ir::Node> items, const FirstSets &sets)
+{
+	FirstSet result;
+	result.nullable = true;
+
+	for (size_t i = 0; i < items.size() && result.nullable; ++i)
+	{
+		// a cut reached before any byte is taken can fail the whole definition,
+		// so the alternative is never skipped
+		if (items[i].type == ir::NodeType::Cut)
+			break;
+
+		FirstSet item = first_set(grammar, items[i], sets);
+		result.bytes |= item.bytes;
+		result.nullable = item.nullable;
+	}
+
+	return result;
+}
+
+FirstSet first_set(const ir::Grammar &grammar, uint32_t id, const FirstSets &sets)
+{
+	const auto items = grammar.body(id);
+
+	FirstSet result;
+
+	for (const auto &[begin, end] : split_alternatives(items))
+	{
+		FirstSet alt = first_set(grammar, items.subspan(begin, end - begin), sets);
+		result.bytes |= alt.bytes;
+		result.nullable = result.nullable || alt.nullable;
+	}
+
+	return result;
+}
+
+// Least fixpoint over all rules and groups, recursion only ever grows the sets
+FirstSets compute_first_sets(const ir::Grammar &grammar)
+{
+	FirstSets result(grammar.size());
+
+	bool changed = true;
+
+	while (changed)
+	{
+		changed = false;
+
+		for (uint32_t id = 1; id < grammar.size(); ++id)
+		{
+			FirstSet v = first_set(grammar, id, result);
+
+			if (!(v == result[id]))
+			{
+				result[id] = v;
+				changed = true;
+			}
+		}
+	}
+
+	return result;
+}
+
+// Names an alternative in recorded profiles
+std::string alternative_key(const ir::Grammar &grammar, std::span<const ir::Node> items)
+{
+	if (items.empty())
+		return "";
+
+	return dump(grammar, items);
+}
+
+// Moves alternatives that succeed more often to the front. An alternative only
+// passes a neighbour it is disjoint with: neither can match nothing and their
+// FIRST sets don't overlap, so no input is matched by both and the swap is invisible.
+// The body keeps its range of nodes, only their order within it changes.
+void apply_profile(ir::Grammar &grammar, uint32_t id, const ProfileData &data, const FirstSets &first_sets)
+{
+	auto it = data.find(grammar.definitions[id].name);
+
+	if (it == data.end())
+		return;
+
+	const auto items = grammar.body(id);
+
+	struct Alternative
+	{
+		std::span<const ir::Node> items;
+		FirstSet first;
+		uint64_t successes = 0;
+	};
+
+	std::vector<Alternative> alternatives;
+
+	for (const auto &[begin, end] : split_alternatives(items))
+	{
+		Alternative alt;
+		alt.items = items.subspan(begin, end - begin);
+		alt.first = first_set(grammar, alt.items, first_sets);
+
+		if (auto found = it->second.alternatives.find(alternative_key(grammar, alt.items)); found != it->second.alternatives.end())
+			alt.successes = found->second;
+
+		alternatives.push_back(alt);
+	}
+
+	if (alternatives.size() < 2)
+		return;
+
+	auto disjoint = [](const Alternative &a, const Alternative &b) {
+		return !a.first.nullable && !b.first.nullable && (a.first.bytes & b.first.bytes).none();
+	};
 
+	for (size_t i = 1; i < alternatives.size(); ++i)
+	{
+		for (size_t j = i; j > 0 && alternatives[j].successes > alternatives[j - 1].successes && disjoint(alternatives[j], alternatives[j - 1]); --j)
+			std::swap(alternatives[j], alternatives[j - 1]);
+	}
+
+	std::vector<ir::Node> reordered;
+	reordered.reserve(items.size());
+
+	for (size_t i = 0; i < alternatives.size(); ++i)
+	{
+		if (i != 0)
+			reordered.push_back({ ir::NodeType::Or });
+
+		reordered.insert(reordered.end(), alternatives[i].items.begin(), alternatives[i].items.end());
+	}
+
+	std::copy(reordered.begin(), reordered.end(), grammar.nodes.begin() + grammar.definitions[id].begin);
+}
+
+// With a profile only rules re-entered at an offset in at least one of ten calls pay for the memo,
+// every rule listed when it has no re-entry counts
+bool should_memoize(const std::string &name, const GenerateCodeParams &params)
+{
+	if (params.memoize == MemoizeMode::None)
+		return false;
+
+	if (!params.profile_data)
+		return true;
+
+	auto it = params.profile_data->find(name);
+
+	if (it == params.profile_data->end())
+		return false;
+
+	const auto &reentries = it->second.reentries;
+
+	return !reentries || (reentries.value() != 0 && reentries.value() * 10 >= it->second.calls);
+}
+
+std::string to_hex(uint64_t v)
+{
+	const char *digits = "0123456789abcdef";
+
+	std::string result;
+
+	do
+	{
+		result.insert(result.begin(), digits[v % 16]);
+		v /= 16;
+	}
+	while (v != 0);
+
+	return "0x" + result;
+}
+
+// Byte indexed table with a bit for every alternative that can start with that byte.
+// Empty when it would not rule anything out.
+std::string generate_dispatch(const ir::Grammar &grammar, std::span<const ir::Node> items, const FirstSets &first_sets)
+{
+	const auto alternatives = split_alternatives(items);
+
+	if (alternatives.size() > 64)
+		return {};
+
+	std::vector<FirstSet> sets;
+	bool useful = false;
+
+	for (const auto &[begin, end] : alternatives)
+	{
+		sets.push_back(first_set(grammar, items.subspan(begin, end - begin), first_sets));
+
+		if (!sets.back().nullable && !sets.back().bytes.all())
+			useful = true;
+	}
+
+	if (!useful)
+		return {};
+
+	std::string type =
+		alternatives.size() <= 8 ? "uint8_t" :
+		alternatives.size() <= 16 ? "uint16_t" :
+		alternatives.size() <= 32 ? "uint32_t" :
+		"uint64_t";
+
+	uint64_t eof_mask = 0;
+
+	for (size_t i = 0; i < sets.size(); ++i)
+	{
+		if (sets[i].nullable)
+			eof_mask |= (uint64_t)1 << i;
+	}
+
+	std::string result;
+
+	result += "	static constexpr " + type + " first[256] =\n";
+	result += "	{\n";
+
+	for (size_t c = 0; c < 256; ++c)
+	{
+		uint64_t mask = eof_mask;
+
+		for (size_t i = 0; i < sets.size(); ++i)
+		{
+			if (sets[i].bytes.test(c))
+				mask |= (uint64_t)1 << i;
+		}
+
+		if (c % 16 == 0)
+			result += "		";
+
+		result += to_hex(mask) + ",";
+		result += c % 16 == 15 ? "\n" : " ";
+	}
+
+	result += "	};\n";
+	result += "\n";
+	result += "	const " + type + " feasible = $is_eof(s, e) ? " + to_hex(eof_mask) + " : first[(uint8_t)$peek(s)];\n";
+	result += "\n";
+
+	return result;
+}
+
+std::string generate_memo_wrapper(const std::string &name, const std::string &prefix, const GenerateCodeParams &params)
+{
+	std::string result;
+
+	result += "[[nodiscard]]\n";
+	result += "std::optional<$Parsed> " + prefix + name + "($Context &ctx, $Pos &s, $Pos e)\n";
+	result += "{\n";
+	result += "	const size_t key = ctx.memo_key(s, $IdentifierType::$i_" + name + ");\n";
+	result += "\n";
+
+	if (params.incremental)
+	{
+		result += "	if (auto it = ctx.memo.find(key); it != ctx.memo.end())\n";
+		result += "	{\n";
+		result += "		ctx.reach = std::max(ctx.reach, it->second.reach);\n";
+		result += "		s = ctx.begin + it->second.end;\n";
+		result += "		return it->second.parsed;\n";
+		result += "	}\n";
+		result += "\n";
+		result += "	const size_t outer = ctx.reach;\n";
+		result += "	ctx.reach = s - ctx.begin;\n";
+		result += "\n";
+		result += "	std::optional<$Parsed> result;\n";
+		result += "\n";
+		result += "	if (!ctx.reuse(s, $IdentifierType::$i_" + name + ", result))\n";
+		result += "		result = $eval_" + name + "(ctx, s, e);\n";
+		result += "\n";
+		result += "	ctx.memo.emplace(key, $Memo{ result, (size_t)(s - ctx.begin), ctx.reach, false });\n";
+		result += "	ctx.reach = std::max(outer, ctx.reach);\n";
+	}
+	else
+	if (params.memoize == MemoizeMode::Full)
+	{
+		result += "	if (auto it = ctx.memo.find(key); it != ctx.memo.end())\n";
+		result += "	{\n";
+		result += "		s = it->second.end;\n";
+		result += "		return it->second.parsed;\n";
 		result += "	}\n";
 		result += "\n";
+		result += "	auto result = $eval_" + name + "(ctx, s, e);\n";
+		result += "\n";
+		result += "	ctx.memo.emplace(key, $Context::Memo{ result, s });\n";
+	}
+	else
+	{
+		result += "	if (ctx.memo_failed(key))\n";
+		result += "		return std::nullopt;\n";
+		result += "\n";
+		result += "	auto result = $eval_" + name + "(ctx, s, e);\n";
+		result += "\n";
+		result += "	if (!result)\n";
+		result += "		ctx.memo_set_failed(key);\n";
 	}
 
-	result += "	return std::nullopt;\n";
+	result += "\n";
+	result += "	return result;\n";
+	result += "}\n";
+
+	return result;
+}
+
+// Counts calls, successes, consumed bytes and inclusive ticks of `inner`
+std::string generate_profile_wrapper(const std::string &name, const std::string &inner, const GenerateCodeParams &params)
+{
+	std::string result;
+
+	result += "[[nodiscard]]\n";
+	result += "std::optional<$Parsed> $parse_" + name + "($Context &ctx, $Pos &s, $Pos e)\n";
+	result += "{\n";
+	result += "	$RuleCounters &counters = $profile.rules[(size_t)$IdentifierType::$i_" + name + "];\n";
+	result += "\n";
+	result += "	$Pos start = s;\n";
+	result += "	const uint64_t ticks = $profile_ticks();\n";
+	result += "\n";
+	result += "	auto result = " + inner + name + "(ctx, s, e);\n";
+	result += "\n";
+	result += "	$RuleCounters::add(counters.ticks, $profile_ticks() - ticks);\n";
+	result += "	$RuleCounters::add(counters.calls, 1);\n";
+	result += "\n";
+	if (params.profile_reentries)
+	{
+		result += "	if (ctx.profile_revisit(start, $IdentifierType::$i_" + name + "))\n";
+		result += "		$RuleCounters::add(counters.reentries, 1);\n";
+		result += "\n";
+	}
+
+	result += "	if (result)\n";
+	result += "	{\n";
+	result += "		$RuleCounters::add(counters.successes, 1);\n";
+	result += "		$RuleCounters::add(counters.bytes, s - start);\n";
+	result += "	}\n";
+	result += "\n";
+	result += "	return result;\n";
 	result += "}\n";
 
 	return result;
 }
 
-std::string generate_code(const std::vector<Rule> &rules, const GenerateCodeParams &params)
-{
-	std::string result;
+// Grammar wide data the rule generators look things up in
+struct GrammarInfo
+{
+	FirstSets first_sets;
+
+	// emitted as $class_<index>
+	std::vector<std::bitset<256>> char_classes;
+
+	std::string char_class_name(uint32_t index) const
+	{
+		return "$class_" + std::to_string(index);
+	}
+
+	// profiled alternatives as (rule, key), and where the ones of each definition start
+	std::vector<std::pair<std::string, std::string>> alternatives;
+	std::vector<size_t> alternative_base;
+
+	// definitions that can pass a cut, directly or in something they call;
+	// only choices pending around those are tracked
+	std::vector<bool> reaches_cut;
+	bool cuts = false;
+
+	// rules run on its tokens instead of bytes when set
+	std::optional<Lexer> lexer;
+
+	// rule calls record how far they looked, see GenerateCodeParams::incremental
+	bool incremental = false;
+
+	// UTF-8 mode, with the code points of the grammar's classes
+	bool utf8 = false;
+	std::vector<std::vector<CodePointRange>> class_code_points;
+
+	// Classes of UTF-8 mode that match past ASCII are a $UnicodeClass
+	bool unicode_class(uint32_t index) const
+	{
+		return utf8
+			&& index < class_code_points.size()
+			&& !class_code_points[index].empty()
+			&& class_code_points[index].back().last >= 0x80;
+	}
+};
+
+std::vector<bool> find_reaches_cut(const ir::Grammar &grammar)
+{
+	std::vector<bool> result(grammar.size());
+
+	bool changed = true;
+
+	while (changed)
+	{
+		changed = false;
+
+		for (uint32_t id = 1; id < grammar.size(); ++id)
+		{
+			if (result[id])
+				continue;
+
+			for (const auto &v : grammar.body(id))
+			{
+				if (v.type == ir::NodeType::Cut || ((v.type == ir::NodeType::Reference || v.type == ir::NodeType::Group) && result[v.value]))
+				{
+					result[id] = true;
+					changed = true;
+					break;
+				}
+			}
+		}
+	}
+
+	return result;
+}
+
+// Only literals and classes, possibly grouped; such a match has no named nodes worth keeping
+bool is_terminal(const ir::Grammar &grammar, const ir::Node &node)
+{
+	if (node.type == ir::NodeType::Literal || node.type == ir::NodeType::CharClass)
+		return true;
+
+	if (node.type != ir::NodeType::Group)
+		return false;
+
+	for (const auto &v : grammar.body(node.value))
+	{
+		if (v.type != ir::NodeType::Or && !is_terminal(grammar, v))
+			return false;
+	}
+
+	return true;
+}
+
+// Expression matching a single occurrence of the node at sc
+std::string generate_call(const ir::Grammar &grammar, const ir::Node &node, const GrammarInfo &info)
+{
+	if (info.lexer)
+	{
+		const Lexer &lexer = info.lexer.value();
+
+		if (node.type == ir::NodeType::CharClass)
+			return "$parse_token(sc, e, " + std::to_string(lexer.class_kinds[node.value]) + ")";
+
+		if (node.type == ir::NodeType::Literal && node.negate)
+			return "$parse_token(sc, e, " + std::to_string(lexer.negated_kinds[node.value]) + ")";
+
+		if (node.type == ir::NodeType::Literal)
+			return "$parse_token(sc, e, " + std::to_string(lexer.literal_kinds[node.value]) + ")";
+
+		if (node.type == ir::NodeType::Reference && lexer.rule_kinds[node.value] != 0)
+			return "$parse_token(sc, e, " + std::to_string(lexer.rule_kinds[node.value]) + ", $IdentifierType::$i_" + grammar.definitions[node.value].name + ")";
+	}
+
+	// an incremental parse notes the bytes a match may look at, end of input included
+	auto looked = [&](size_t count, const std::string &call) {
+		if (!info.incremental)
+			return call;
+
+		return "(ctx.touch(sc, " + std::to_string(count) + "), " + call + ")";
+	};
+
+	const size_t code_point = info.utf8 ? 4 : 1;
+
+	if (node.type == ir::NodeType::CharClass)
+		return looked(info.unicode_class(node.value) ? 4 : 1, "$parse_class(sc, e, " + info.char_class_name(node.value) + ")");
+
+	if (node.type == ir::NodeType::Literal)
+	{
+		const std::string &lit = grammar.literals[node.value];
+
+		if (node.negate)
+			return looked(std::max(lit.size(), code_point), std::string(info.utf8 ? "$parse_negate_code_point" : "$parse_negate_literal") + "(sc, e, \"" + escape_string(lit) + "\")");
+		else
+			return looked(std::max<size_t>(lit.size(), 1), "$parse_literal(sc, e, \"" + escape_string(lit) + "\")");
+	}
+
+	return "$parse_" + grammar.definitions[node.value].name + "(ctx, sc, e)";
+}
+
+bool is_literal_alternation(std::span<const ir::Node> items)
+{
+	const auto alternatives = split_alternatives(items);
+
+	if (alternatives.size() < 2)
+		return false;
+
+	for (const auto &[begin, end] : alternatives)
+	{
+		if (end - begin != 1)
+			return false;
+
+		const auto &node = items[begin];
+
+		if (node.type != ir::NodeType::Literal || node.negate || node.optional || node.multiple)
+			return false;
+	}
+
+	return true;
+}
+
+struct TrieNode
+{
+	// lowest alternative ending here / anywhere below
+	size_t terminal = SIZE_MAX;
+	size_t lowest = SIZE_MAX;
+
+	std::map<uint8_t, TrieNode> children;
+};
+
+std::string char_literal(uint8_t c)
+{
+	if (c == '\'' || c == '\\')
+		return std::string("'\\") + (char)c + "'";
+
+	if (c >= ' ' && c < 127)
+		return std::string("'") + (char)c + "'";
+
+	return to_hex(c);
+}
+
+// Keeps the PEG order: among the literals that match, the one listed first wins,
+// so subtrees only holding later alternatives than an accepted one are pruned.
+void generate_trie_node(std::string &result, const TrieNode &node, size_t depth, size_t accepted, const std::string &indent)
+{
+	// an empty literal fails at the end of the input, as in $parse_literal
+	if (node.terminal < accepted && depth == 0)
+	{
+		result += indent + "if (e - s > 0)\n";
+		result += indent + "	length = 0;\n";
+		accepted = node.terminal;
+	}
+	else
+	if (node.terminal < accepted)
+	{
+		result += indent + "length = " + std::to_string(depth) + ";\n";
+		accepted = node.terminal;
+	}
+
+	std::vector<std::pair<uint8_t, const TrieNode *>> children;
+
+	for (const auto &[c, child] : node.children)
+	{
+		if (child.lowest < accepted)
+			children.push_back({ c, &child });
+	}
+
+	if (children.empty())
+		return;
+
+	if (children.size() == 1)
+	{
+		// follow the chain while there is nothing to decide and compare it in one go
+		std::string chain(1, (char)children[0].first);
+		const TrieNode *next = children[0].second;
+
+		while (next->terminal >= accepted && next->children.size() == 1 && next->children.begin()->second.lowest < accepted)
+		{
+			chain += (char)next->children.begin()->first;
+			next = &next->children.begin()->second;
+		}
+
+		if (chain.size() == 1)
+			result += indent + "if (e - s > " + std::to_string(depth) + " && (uint8_t)s[" + std::to_string(depth) + "] == " + char_literal(chain[0]) + ")\n";
+		else
+			result += indent + "if (e - s >= " + std::to_string(depth + chain.size()) + " && std::memcmp(s + " + std::to_string(depth) + ", \"" + escape_string(chain) + "\", " + std::to_string(chain.size()) + ") == 0)\n";
+
+		result += indent + "{\n";
+		generate_trie_node(result, *next, depth + chain.size(), accepted, indent + "\t");
+		result += indent + "}\n";
+		return;
+	}
+
+	result += indent + "if (e - s > " + std::to_string(depth) + ")\n";
+	result += indent + "{\n";
+	result += indent + "	switch ((uint8_t)s[" + std::to_string(depth) + "])\n";
+	result += indent + "	{\n";
+
+	for (const auto &[c, child] : children)
+	{
+		result += indent + "		case " + char_literal(c) + ":\n";
+		generate_trie_node(result, *child, depth + 1, accepted, indent + "\t\t\t");
+		result += indent + "			break;\n";
+	}
+
+	result += indent + "	}\n";
+	result += indent + "}\n";
+}
+
+// Sets `length` to the size of the first literal matching at s, or leaves it at -1
+std::string generate_trie_match(const std::vector<std::string_view> &literals, const std::string &indent)
+{
+	TrieNode root;
+
+	for (size_t i = 0; i < literals.size(); ++i)
+	{
+		TrieNode *node = &root;
+		node->lowest = std::min(node->lowest, i);
+
+		for (char c : literals[i])
+		{
+			node = &node->children[(uint8_t)c];
+			node->lowest = std::min(node->lowest, i);
+		}
+
+		node->terminal = std::min(node->terminal, i);
+	}
+
+	std::string result;
+
+	result += indent + "ptrdiff_t length = -1;\n";
+	result += "\n";
+
+	generate_trie_node(result, root, 0, SIZE_MAX, indent);
+
+	return result;
+}
+
+std::string generate_trie(const ir::Grammar &grammar, uint32_t id)
+{
+	const auto items = grammar.body(id);
+
+	std::vector<std::string_view> literals;
+
+	for (const auto &[begin, end] : split_alternatives(items))
+		literals.push_back(grammar.literals[items[begin].value]);
+
+	std::string result;
+
+	result += generate_trie_match(literals, "\t");
+
+	result += "\n";
+	result += "	if (length < 0)\n";
+	result += "		return std::nullopt;\n";
+	result += "\n";
+	result += "	ctx.stack.push_back($literal_node(s, length));\n";
+	result += "\n";
+	result += "	result.span = std::string_view(s, length);\n";
+
+	// a transparent match leaves its children to the caller
+	if (!grammar.definitions[id].transparent)
+		result += "	result.group = ctx.commit(mark);\n";
+
+	result += "	s += length;\n";
+	result += "	return result;\n";
+
+	return result;
+}
+
+// A call that may fail after passing a cut, while the caller still has
+// somewhere else to go, runs as a pending choice
+std::string generate_attempt(const ir::Grammar &grammar, const ir::Node &node, const GrammarInfo &info)
+{
+	const std::string call = generate_call(grammar, node, info);
+
+	if ((node.type == ir::NodeType::Reference || node.type == ir::NodeType::Group) && info.reaches_cut[node.value])
+		return "ctx.attempt(sc, [&] { return " + call + "; })";
+
+	return call;
+}
+
+// Ordered choice over the '|' separated alternatives of seq
+std::string generate_alternatives(const ir::Grammar &grammar, uint32_t id, const GenerateCodeParams &params, const GrammarInfo &info)
+{
+	const auto seq = grammar.body(id);
+
+	std::string result;
+
+	// alternatives that cannot start with the next byte are skipped
+	const std::string dispatch = params.first_set_dispatch ? generate_dispatch(grammar, seq, info.first_sets) : "";
+
+	if (!dispatch.empty() && info.incremental)
+		result += "	ctx.touch(s, 1);\n";
+
+	result += dispatch;
+
+	// each 'or'
+	for (size_t i = 0, alt = 0; i < seq.size(); ++i, ++alt)
+	{
+		if (!dispatch.empty())
+			result += "	if (feasible & " + to_hex((uint64_t)1 << alt) + ")\n";
+
+		size_t end = i;
+
+		while (end < seq.size() && seq[end].type != ir::NodeType::Or)
+			++end;
+
+		// a cut in the alternative, and whether later alternatives are a pending choice
+		const bool cut = std::any_of(seq.begin() + i, seq.begin() + end, [](const ir::Node &v) { return v.type == ir::NodeType::Cut; });
+		const bool choice = end != seq.size() && info.reaches_cut[id] && std::any_of(seq.begin() + i, seq.begin() + end, [&](const ir::Node &v) { return v.type == ir::NodeType::Cut || ((v.type == ir::NodeType::Reference || v.type == ir::NodeType::Group) && info.reaches_cut[v.value]); });
+		bool passed = false;
+
+		result += "	{\n";
+		result += "		$Pos sc = s;\n";
+
+		// children of the previous failed alternative are still on the stack
+		if (i != 0)
+			result += "		ctx.rewind(mark);\n";
+
+		if (cut)
+			result += "		bool cut = false;\n";
+
+		if (choice)
+			result += "		ctx.choices.push_back(s);\n";
+
+		size_t level = 0;
+
+		for (; i < seq.size(); ++i)
+		{
+			if (seq[i].type == ir::NodeType::Or)
+				break;
+
+			if (seq[i].type == ir::NodeType::Cut)
+			{
+				// the first cut takes the choice of the alternative with it
+				result += "\n";
+				result += std::string(level, '\t') + "		ctx.cut(sc, " + (choice && !passed ? "true" : "false") + ");\n";
+				result += std::string(level, '\t') + "		cut = true;\n";
+
+				passed = true;
+				continue;
+			}
+
+			//  optional &&  multiple - . if while
+			//  optional && !multiple - . if
+			// !optional &&  multiple - if . while
+			// !optional && !multiple - if .
+
+			result += "\n";
+
+			// in UTF-8 mode the literal has to start a code point for the run to end at one
+			const bool scan = seq[i].multiple && seq[i].type == ir::NodeType::Literal && seq[i].negate && !grammar.literals[seq[i].value].empty() && params.vectorized_scan
+				&& (!info.utf8 || ((uint8_t)grammar.literals[seq[i].value][0] & 0xC0) != 0x80);
+
+			if (seq[i].multiple && params.coalesce_repetitions && is_terminal(grammar, seq[i]))
+			{
+				// the whole run becomes a single literal node
+				const std::string run = "run_" + std::to_string(i);
+				const std::string mark = "mark_" + std::to_string(i);
+
+				result += std::string(level, '\t') + "		const char *" + run + " = sc;\n";
+
+				if (seq[i].type == ir::NodeType::Group)
+					result += std::string(level, '\t') + "		const auto " + mark + " = ctx.mark();\n";
+
+				result += "\n";
+				result += std::string(level, '\t') + "		if (" + generate_call(grammar, seq[i], info) + ")\n";
+				result += std::string(level, '\t') + "		{\n";
+
+				if (scan)
+				{
+					result += std::string(level, '\t') + "			sc = $scan_negate_literal(sc, e, \"" + escape_string(grammar.literals[seq[i].value]) + "\");\n";
+				}
+				else
+				if (seq[i].type == ir::NodeType::CharClass)
+				{
+					result += std::string(level, '\t') + "			sc = $scan_class(sc, e, " + info.char_class_name(seq[i].value) + ");\n";
+				}
+				else
+				{
+					result += std::string(level, '\t') + "			while (" + generate_call(grammar, seq[i], info) + ")\n";
+					result += std::string(level, '\t') + "			{\n";
+					result += std::string(level, '\t') + "			}\n";
+				}
+
+				result += "\n";
+
+				if (seq[i].type == ir::NodeType::Group)
+					result += std::string(level, '\t') + "			ctx.rewind(" + mark + ");\n";
+
+				result += std::string(level, '\t') + "			ctx.stack.push_back($literal_node(" + run + ", sc - " + run + "));\n";
+				result += "\n";
+
+				if (seq[i].optional)
+					result += std::string(level, '\t') + "		}\n";
+				else
+					++level;
+
+				continue;
+			}
+
+			// children of a transparent group are already on the stack
+			const bool splice = (seq[i].type == ir::NodeType::Reference || seq[i].type == ir::NodeType::Group) && grammar.definitions[seq[i].value].transparent;
+
+			// repetitions and optional items can fall back to not matching
+			const std::string first = seq[i].optional ? generate_attempt(grammar, seq[i], info) : generate_call(grammar, seq[i], info);
+
+			if (splice)
+			{
+				result += std::string(level, '\t') + "		if (" + first + ")\n";
+				result += std::string(level, '\t') + "		{\n";
+			}
+			else
+			{
+				result += std::string(level, '\t') + "		if (auto v = " + first + ")\n";
+				result += std::string(level, '\t') + "		{\n";
+				result += std::string(level, '\t') + "			ctx.stack.push_back(v.value());\n";
+			}
+
+			if (scan && info.utf8)
+			{
+				// every code point up to the next occurrence of the literal matches
+				result += "\n";
+				result += std::string(level, '\t') + "			for (const char *stop = $scan_negate_literal(sc, e, \"" + escape_string(grammar.literals[seq[i].value]) + "\"); sc != stop; )\n";
+				result += std::string(level, '\t') + "			{\n";
+				result += std::string(level, '\t') + "				const size_t size = $utf8_length(*sc);\n";
+				result += std::string(level, '\t') + "				ctx.stack.push_back($literal_node(sc, size));\n";
+				result += std::string(level, '\t') + "				sc += size;\n";
+				result += std::string(level, '\t') + "			}\n";
+				result += "\n";
+			}
+			else
+			if (scan)
+			{
+				// every byte up to the next occurrence of the literal matches
+				result += "\n";
+				result += std::string(level, '\t') + "			for (const char *stop = $scan_negate_literal(sc, e, \"" + escape_string(grammar.literals[seq[i].value]) + "\"); sc != stop; ++sc)\n";
+				result += std::string(level, '\t') + "				ctx.stack.push_back($literal_node(sc, 1));\n";
+				result += "\n";
+			}
+			else
+			if (seq[i].multiple && splice)
+			{
+				result += "\n";
+				result += std::string(level, '\t') + "			while (" + generate_attempt(grammar, seq[i], info) + ")\n";
+				result += std::string(level, '\t') + "			{\n";
+				result += std::string(level, '\t') + "			}\n";
+				result += "\n";
+			}
+			else
+			if (seq[i].multiple && params.parallel && seq[i].type == ir::NodeType::Reference && grammar.definitions[seq[i].value].sync)
+			{
+				const std::string indent = std::string(level, '\t');
+				const std::string attempt = generate_attempt(grammar, seq[i], info);
+
+				result += "\n";
+				result += indent + "			if (ctx.pool)\n";
+				result += indent + "			{\n";
+				result += indent + "				$parse_parallel(ctx, sc, e, []($Context &ctx, $Pos &sc, $Pos e) { return " + attempt + "; });\n";
+				result += indent + "			}\n";
+				result += indent + "			else\n";
+				result += indent + "			{\n";
+				result += indent + "				while (auto v = " + attempt + ")\n";
+				result += indent + "				{\n";
+				result += indent + "					ctx.stack.push_back(v.value());\n";
+				result += indent + "				}\n";
+				result += indent + "			}\n";
+				result += "\n";
+			}
+			else
+			if (seq[i].multiple)
+			{
+				result += "\n";
+				result += std::string(level, '\t') + "			while (auto v = " + generate_attempt(grammar, seq[i], info) + ")\n";
+				result += std::string(level, '\t') + "			{\n";
+				result += std::string(level, '\t') + "				ctx.stack.push_back(v.value());\n";
+				result += std::string(level, '\t') + "			}\n";
+				result += "\n";
+			}
+
+			if (seq[i].optional)
+				result += std::string(level, '\t') + "		}\n";
+			else
+				++level;
+		}
+
+		result += "\n";
+
+		if (params.profile)
+			result += std::string(level, '\t') + "		$RuleCounters::add($profile.alternatives[" + std::to_string(info.alternative_base[id] + alt) + "], 1);\n";
+
+		if (choice && !cut)
+			result += std::string(level, '\t') + "		ctx.choices.pop_back();\n";
+
+		result += std::string(level, '\t') + "		result.span = $span(s, sc);\n";
+
+		if (!grammar.definitions[id].transparent)
+			result += std::string(level, '\t') + "		result.group = ctx.commit(mark);\n";
+
+		result += std::string(level, '\t') + "		s = sc;\n";
+		result += std::string(level, '\t') + "		return result;\n";
+
+		for (; level != 0; --level)
+			result += std::string(level - 1, '\t') + "		}\n";
+
+		// only failed alternatives get here
+		if (params.profile)
+		{
+			result += "\n";
+			result += "		$RuleCounters::add($profile.rules[(size_t)result.identifier].failed_alternatives, 1);\n";
+		}
+
+		// failing after the cut fails the whole definition
+		if (cut)
+		{
+			result += "\n";
+			result += "		if (cut)\n";
+			result += "		{\n";
+			result += "			ctx.rewind(mark);\n";
+			result += "			return std::nullopt;\n";
+			result += "		}\n";
+		}
+
+		if (choice)
+		{
+			result += "\n";
+			result += "		ctx.choices.pop_back();\n";
+		}
+
+		result += "	}\n";
+		result += "\n";
+	}
+
+	result += "	ctx.rewind(mark);\n";
+	result += "	return std::nullopt;\n";
+
+	return result;
+}
+
+std::string generate_rule(const ir::Grammar &grammar, uint32_t id, const GenerateCodeParams &params, const GrammarInfo &info)
+{
+	const auto seq = grammar.body(id);
+	const std::string &name = grammar.definitions[id].name;
+	const std::string ptype = grammar.definitions[id].group ? "Group" : "Identifier";
+
+	std::string result;
+
+	// memoized rules get a cache lookup in front of the actual body,
+	// profiled ones a layer of counters in front of that
+	const bool memoize = !grammar.definitions[id].transparent && (params.incremental || should_memoize(name, params));
+
+	result += "// Rule: ";
+	result += dump(grammar, seq);
+	result += "\n";
+
+	result += "[[nodiscard]]\n";
+	result += "std::optional<$Parsed> " + std::string(memoize || params.profile ? "$eval_" : "$parse_") + name + "($Context &ctx, $Pos &s, $Pos e)\n";
+	result += "{\n";
+	result += "	$Parsed result;\n";
+	result += "	result.type = $ParsedType::" + ptype + ";\n";
+	result += "	result.identifier = $IdentifierType::$i_" + name + ";\n";
+	result += "\n";
+	result += "	const auto mark = ctx.mark();\n";
+	result += "\n";
+
+	// "if" | "else" | "elif" is one walk down a trie instead of a call per keyword
+	if (params.literal_trie && is_literal_alternation(seq))
+	{
+		if (params.incremental)
+		{
+			size_t longest = 0;
+
+			for (const auto &v : seq)
+			{
+				if (v.type == ir::NodeType::Literal)
+					longest = std::max(longest, grammar.literals[v.value].size());
+			}
+
+			result += "	ctx.touch(s, " + std::to_string(longest) + ");\n";
+			result += "\n";
+		}
+
+		result += generate_trie(grammar, id);
+	}
+	else
+		result += generate_alternatives(grammar, id, params, info);
+
+	result += "}\n";
+
+	if (memoize)
+	{
+		result += "\n";
+		result += generate_memo_wrapper(name, params.profile ? "$memo_" : "$parse_", params);
+	}
+
+	if (params.profile)
+	{
+		result += "\n";
+		result += generate_profile_wrapper(name, memoize ? "$memo_" : "$eval_", params);
+	}
+
+	return result;
+}
+
+// Comma separated numbers, `per_line` to a line
+std::string generate_table(const std::vector<uint32_t> &values, size_t per_line)
+{
+	std::string result;
+
+	for (size_t i = 0; i < values.size(); ++i)
+	{
+		if (i % per_line == 0)
+			result += "\t";
+
+		result += std::to_string(values[i]) + ",";
+		result += (i % per_line == per_line - 1 || i + 1 == values.size()) ? "\n" : " ";
+	}
+
+	return result;
+}
+
+// What rules take as position: bytes, or tokens of the generated lexer
+std::string generate_input(const GrammarInfo &info)
+{
+	if (!info.lexer)
+	{
+		return R"AAA(using $Pos = const char *;
+
+[[nodiscard]]
+char $peek($Pos s)
+{
+	return *s;
+}
+
+[[nodiscard]]
+std::string_view $span($Pos s, $Pos e)
+{
+	return std::string_view(s, e - s);
+}
+)AAA";
+	}
+
+	const Lexer &lexer = info.lexer.value();
+	const std::string state = lexer.accept.size() <= 0x10000 ? "uint16_t" : "uint32_t";
+
+	std::string result;
+
+	result += "// Tokens of the lexer stage, kind 0 marks the end\n";
+	result += "enum class $TokenKind : uint32_t\n";
+	result += "{\n";
+	result += "	None,\n";
+
+	for (size_t k = 0; k < lexer.tokens.size(); ++k)
+		result += "	$k_" + std::to_string(k + 1) + ", // " + (lexer.tokens[k].skip ? "@skip " : "") + lexer.tokens[k].name + "\n";
+
+	result += "};\n";
+	result += "\n";
+
+	result += R"AAA(struct $Token
+{
+	$TokenKind kind;
+	std::string_view span;
+};
+
+)AAA";
+
+	std::vector<uint32_t> columns(lexer.columns.begin(), lexer.columns.end());
+	std::vector<uint32_t> skip(1 + lexer.tokens.size());
+
+	for (size_t k = 0; k < lexer.tokens.size(); ++k)
+		skip[k + 1] = lexer.tokens[k].skip;
+
+	result += "constexpr size_t $lex_column_count = " + std::to_string(lexer.column_count) + ";\n";
+	result += "\n";
+	result += "constexpr uint8_t $lex_columns[256] =\n";
+	result += "{\n";
+	result += generate_table(columns, 16);
+	result += "};\n";
+	result += "\n";
+	result += "// next state by state and column, 0 is dead and 1 the start\n";
+	result += "constexpr " + state + " $lex_next[] =\n";
+	result += "{\n";
+	result += generate_table(lexer.next, lexer.column_count);
+	result += "};\n";
+	result += "\n";
+	result += "// kind of a token ending in the state\n";
+	result += "constexpr uint32_t $lex_accept[] =\n";
+	result += "{\n";
+	result += generate_table(lexer.accept, 16);
+	result += "};\n";
+	result += "\n";
+	result += "constexpr bool $lex_skip[] =\n";
+	result += "{\n";
+	result += generate_table(skip, 16);
+	result += "};\n";
+	result += "\n";
+
+	result += R"AAA(// Splits the input into the longest tokens, on a tie the lower kind wins.
+// Skipped ones are left out. Stops in front of the first byte no token
+// matches at, with s there, and ends the result with an empty token at s.
+[[nodiscard]]
+std::vector<$Token> $lex(const char *&s, const char *e)
+{
+	std::vector<$Token> result;
+
+	while (s != e)
+	{
+		uint32_t state = 1;
+		uint32_t kind = 0;
+		const char *end = s;
+
+		for (const char *p = s; p != e; )
+		{
+			state = $lex_next[state * $lex_column_count + $lex_columns[(uint8_t)*p]];
+
+			if (state == 0)
+				break;
+
+			++p;
+
+			if ($lex_accept[state] != 0)
+			{
+				kind = $lex_accept[state];
+				end = p;
+			}
+		}
+
+		if (kind == 0)
+			break;
+
+		if (!$lex_skip[kind])
+			result.push_back({ ($TokenKind)kind, std::string_view(s, end - s) });
+
+		s = end;
+	}
+
+	result.push_back({ $TokenKind::None, std::string_view(s, 0) });
+	return result;
+}
+
+using $Pos = const $Token *;
+
+[[nodiscard]]
+bool $is_eof($Pos s, $Pos e)
+{
+	return s >= e;
+}
+
+// First byte of the next token
+[[nodiscard]]
+char $peek($Pos s)
+{
+	return s->span[0];
+}
+
+// Text from the first token to the end of the last one, tokens skipped in
+// between included
+[[nodiscard]]
+std::string_view $span($Pos s, $Pos e)
+{
+	if (s == e)
+		return std::string_view(s->span.data(), 0);
+
+	return std::string_view(s->span.data(), (e - 1)->span.data() + (e - 1)->span.size() - s->span.data());
+}
+
+// Literals and classes of rules are literal nodes, @token rules have one of their own
+[[nodiscard]]
+std::optional<$Parsed> $parse_token($Pos &s, $Pos e, uint32_t kind, $IdentifierType id = $IdentifierType::None)
+{
+	if (s == e || s->kind != ($TokenKind)kind)
+		return std::nullopt;
+
+	$Parsed result;
+	result.type = id == $IdentifierType::None ? $ParsedType::Literal : $ParsedType::Identifier;
+	result.identifier = id;
+	result.span = s->span;
+
+	++s;
+	return result;
+}
+)AAA";
+
+	return result;
+}
+
+std::string generate_context(const GenerateCodeParams &params, const GrammarInfo &info)
+{
+	std::string result;
+
+	result += R"AAA(// State of a single parse, shared by every rule function
+struct $Context
+{
+	struct Mark
+	{
+		size_t stack;
+		$Arena::Mark arena;
+	};
+
+	$Pos begin;
+	$Pos end;
+
+	// finished child blocks
+	$Arena &arena;
+
+	// children of the rules currently being matched
+	std::vector<$Parsed> stack;
+)AAA";
+
+	if (params.parallel)
+	{
+		result += R"AAA(
+	// repetitions of @sync rules run on it when set
+	$ThreadPool *pool = nullptr;
+
+	// child blocks of the chunks parsed on the pool, the tree takes them over
+	std::vector<$Arena> arenas;
+)AAA";
+	}
+
+	if (params.incremental)
+	{
+		result += R"AAA(
+	// every memoized call by key, as offsets, so that the tree can hand them
+	// to the next parse
+	std::unordered_map<size_t, $Memo> memo;
+
+	// calls of the previous parse made by the ones reused, moved to this input
+	std::vector<std::pair<size_t, $Memo>> carried;
+
+	// one past the furthest byte the innermost memoized call looked at so far
+	size_t reach = 0;
+
+	// the tree of the previous parse and how its input became this one
+	const $Tree *previous = nullptr;
+	$Edit edit;
+
+	// previous->memo in key order, sorted on the first reuse
+	std::vector<std::pair<size_t, const $Memo *>> previous_memo;
+)AAA";
+	}
+	else
+	if (params.memoize == MemoizeMode::Full)
+	{
+		result += R"AAA(
+	// with tokens a span no longer tells where the match ended
+	struct Memo
+	{
+		std::optional<$Parsed> parsed;
+		$Pos end;
+	};
+
+	std::unordered_map<size_t, Memo> memo;
+)AAA";
+	}
+	else
+	if (params.memoize == MemoizeMode::FailuresOnly)
+	{
+		result += R"AAA(
+	// word i holds keys from (memo_base + i) * 64 on, it grows up to the
+	// furthest failure so far and cuts drop the words before
+	std::vector<uint64_t> memo_failures;
+	size_t memo_base = 0;
+)AAA";
+	}
+
+	if (info.cuts)
+	{
+		result += R"AAA(
+	// where pending choices that may see a cut resume, oldest first
+	std::vector<$Pos> choices;
+
+	// input before this is never looked at again
+	$Pos committed;
+)AAA";
+	}
+
+	if (params.profile && params.profile_reentries)
+	{
+		result += R"AAA(
+	// (offset, rule) pairs tried so far
+	std::unordered_set<uint64_t> profile_visited;
+)AAA";
+	}
+
+	result += R"AAA(
+	$Context($Pos begin, $Pos end, $Arena &arena)
+		: begin(begin)
+		, end(end)
+		, arena(arena)
+)AAA";
+
+	if (info.cuts)
+	{
+		result += R"AAA(		, committed(begin)
+)AAA";
+	}
+
+	result += R"AAA(	{
+	}
+
+	[[nodiscard]]
+	Mark mark() const
+	{
+		return { stack.size(), arena.mark() };
+	}
+
+	// Moves children pushed since the mark into one contiguous arena block
+	[[nodiscard]]
+	std::span<const $Parsed> commit(const Mark &m)
+	{
+		const size_t count = stack.size() - m.stack;
+
+		if (count == 0)
+			return {};
+
+		$Parsed *block = arena.allocate(count);
+		std::copy(stack.begin() + m.stack, stack.end(), block);
+		stack.resize(m.stack);
+
+		return { block, count };
+	}
+)AAA";
+
+	// memoized subtrees must survive the failure of an enclosing alternative
+	if (params.memoize == MemoizeMode::Full)
+	{
+		result += R"AAA(
+	void rewind(const Mark &m)
+	{
+		stack.resize(m.stack);
+	}
+)AAA";
+	}
+	else
+	{
+		result += R"AAA(
+	void rewind(const Mark &m)
+	{
+		stack.resize(m.stack);
+		arena.rewind(m.arena);
+	}
+)AAA";
+	}
+
+	if (params.memoize != MemoizeMode::None)
+	{
+		result += R"AAA(
+	[[nodiscard]]
+	size_t memo_key($Pos s, $IdentifierType id) const
+	{
+		return (size_t)(s - begin) * $identifier_count + (size_t)id;
+	}
+)AAA";
+	}
+
+	if (params.incremental)
+	{
+		result += R"AAA(
+	void touch($Pos s, size_t count)
+	{
+		reach = std::max(reach, (size_t)(s - begin) + count);
+	}
+
+	// Takes over the previous parse's call at s when all it looked at is
+	// outside the edit, moving s and reach past it
+	[[nodiscard]]
+	bool reuse($Pos &s, $IdentifierType id, std::optional<$Parsed> &result)
+	{
+		if (!previous)
+			return false;
+
+		const size_t at = s - begin;
+		const bool after = at >= edit.offset + edit.inserted;
+
+		if (!after && at >= edit.offset)
+			return false;
+
+		const size_t old = after ? at - edit.inserted + edit.removed : at;
+		const $Memo *m = find_previous(old * $identifier_count + (size_t)id);
+
+		if (!m || (!after && m->reach > edit.offset))
+			return false;
+
+		if (m->parsed)
+		{
+			// a call carried over has its node in the tree, unless the parse
+			// dropped it
+			const $Parsed *v = m->in_tree ? locate(*previous, old, m->parsed->span.size(), id) : &m->parsed.value();
+
+			if (!v)
+				return false;
+
+			result = copy(*v, after);
+		}
+		else
+		{
+			result = std::nullopt;
+		}
+
+		s = begin + shift(m->end, after);
+		reach = std::max(reach, shift(m->reach, after));
+
+		carry_over(old, m->end, after);
+
+		return true;
+	}
+
+	// An offset of the previous input in this one
+	[[nodiscard]]
+	size_t shift(size_t offset, bool after) const
+	{
+		return after ? offset - edit.removed + edit.inserted : offset;
+	}
+
+	[[nodiscard]]
+	const $Memo *find_previous(size_t key) const
+	{
+		if (auto it = previous->memo.find(key); it != previous->memo.end())
+			return &it->second;
+
+		auto it = std::lower_bound(previous->carried.begin(), previous->carried.end(), key, [](const auto &v, size_t k) { return v.first < k; });
+
+		return it != previous->carried.end() && it->first == key ? &it->second : nullptr;
+	}
+
+	// The node of the previous tree a call at `at` made, if it is in there
+	[[nodiscard]]
+	const $Parsed *locate(const $Parsed &node, size_t at, size_t size, $IdentifierType id) const
+	{
+		auto offset = [&](const $Parsed &v) {
+			return (size_t)((uintptr_t)v.span.data() - previous->memo_base);
+		};
+
+		if (node.identifier == id && offset(node) == at && node.span.size() == size)
+			return &node;
+
+		// children that start at or before `at`, the last one first; those
+		// ending in front of the call don't hold it and neither do earlier ones
+		auto it = std::upper_bound(node.group.begin(), node.group.end(), at, [&](size_t o, const $Parsed &v) { return o < offset(v); });
+
+		while (it != node.group.begin())
+		{
+			--it;
+
+			if (offset(*it) + it->span.size() < at + size)
+				break;
+
+			if (const $Parsed *found = locate(*it, at, size, id))
+				return found;
+		}
+
+		return nullptr;
+	}
+
+	// Notes the previous parse's calls within [from, to) of its input, the
+	// ones a reused call made among them, so that the next reparse can take
+	// those over in turn. A call that ends further is left to be reused itself,
+	// one at `to` to the call after. Nodes aren't copied: locate() finds them
+	// in this tree by where they are.
+	void carry_over(size_t from, size_t to, bool after)
+	{
+		if (previous_memo.size() != previous->memo.size())
+		{
+			previous_memo.reserve(previous->memo.size());
+			carried.reserve(previous->memo.size() + previous->carried.size());
+
+			for (const auto &[key, m] : previous->memo)
+				previous_memo.emplace_back(key, &m);
+
+			std::sort(previous_memo.begin(), previous_memo.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+		}
+
+		auto carry = [&](size_t key, const $Memo &m) {
+			if (m.end > to || (!after && m.reach > edit.offset))
+				return;
+
+			$Memo moved = m;
+			moved.end = shift(m.end, after);
+			moved.reach = shift(m.reach, after);
+
+			const size_t at = shift(key / $identifier_count, after);
+
+			if (moved.parsed)
+			{
+				moved.parsed->span = std::string_view(begin + at, m.parsed->span.size());
+				moved.parsed->group = {};
+				moved.parsed->custom_data = nullptr;
+				moved.in_tree = true;
+			}
+
+			carried.emplace_back(at * $identifier_count + key % $identifier_count, moved);
+		};
+
+		// both in key order, merged so that carried stays in order
+		const size_t first = from * $identifier_count;
+		const size_t last = to * $identifier_count;
+
+		auto a = std::lower_bound(previous_memo.begin(), previous_memo.end(), first, [](const auto &v, size_t k) { return v.first < k; });
+		auto b = std::lower_bound(previous->carried.begin(), previous->carried.end(), first, [](const auto &v, size_t k) { return v.first < k; });
+
+		for (;;)
+		{
+			const bool more_a = a != previous_memo.end() && a->first < last;
+			const bool more_b = b != previous->carried.end() && b->first < last;
+
+			if (more_a && (!more_b || a->first <= b->first))
+			{
+				carry(a->first, *a->second);
+				++a;
+			}
+			else
+			if (more_b)
+			{
+				carry(b->first, b->second);
+				++b;
+			}
+			else
+			{
+				break;
+			}
+		}
+	}
+
+	// carried in key order with each call once, for the tree
+	[[nodiscard]]
+	std::vector<std::pair<size_t, $Memo>> take_carried()
+	{
+		auto by_key = [](const auto &a, const auto &b) { return a.first < b.first; };
+
+		// out of order only where the parse went back into a reused call
+		if (!std::is_sorted(carried.begin(), carried.end(), by_key))
+			std::stable_sort(carried.begin(), carried.end(), by_key);
+
+		carried.erase(std::unique(carried.begin(), carried.end(), [](const auto &a, const auto &b) { return a.first == b.first; }), carried.end());
+
+		return std::move(carried);
+	}
+
+	// A node of the previous tree and everything below it, moved to this
+	// input and arena
+	[[nodiscard]]
+	$Parsed copy(const $Parsed &v, bool after)
+	{
+		const size_t at = (uintptr_t)v.span.data() - previous->memo_base;
+
+		$Parsed result = v;
+		result.span = std::string_view(begin + (after ? at - edit.removed + edit.inserted : at), v.span.size());
+		result.custom_data = nullptr;
+
+		if (!v.group.empty())
+		{
+			$Parsed *block = arena.allocate(v.group.size());
+
+			for (size_t i = 0; i < v.group.size(); ++i)
+				block[i] = copy(v.group[i], after);
+
+			result.group = { block, v.group.size() };
+		}
+
+		return result;
+	}
+)AAA";
+	}
+
+	if (params.memoize == MemoizeMode::FailuresOnly)
+	{
+		result += R"AAA(
+	[[nodiscard]]
+	bool memo_failed(size_t key) const
+	{
+		const size_t i = key / 64 - memo_base;
+		return key / 64 >= memo_base && i < memo_failures.size() && ((memo_failures[i] >> (key % 64)) & 1);
+	}
+
+	void memo_set_failed(size_t key)
+	{
+		// a call that started before the last cut may still finish after it
+		if (key / 64 < memo_base)
+			return;
+
+		const size_t i = key / 64 - memo_base;
+
+		if (i >= memo_failures.size())
+			memo_failures.resize(i + 1);
+
+		memo_failures[i] |= (uint64_t)1 << (key % 64);
+	}
+)AAA";
+	}
+
+	if (info.cuts)
+	{
+		result += R"AAA(
+	// Runs f as a pending choice resuming at s
+	template <typename F>
+	auto attempt($Pos s, F f)
+	{
+		choices.push_back(s);
+		auto result = f();
+		choices.pop_back();
+		return result;
+	}
+
+	// Passes a cut at s, own drops the choice of the alternative it is in.
+	// Whatever lies before the oldest choice left is committed, and so is
+	// its memo.
+	void cut($Pos s, bool own)
+	{
+		if (own)
+			choices.pop_back();
+
+		$Pos floor = choices.empty() ? s : choices.front();
+
+		if (floor <= committed)
+			return;
+
+		committed = floor;
+)AAA";
+
+		// an incremental memo is kept for the next parse
+		if (params.memoize == MemoizeMode::Full && !params.incremental)
+		{
+			result += R"AAA(
+		const size_t key = memo_key(floor, $IdentifierType::None);
+		std::erase_if(memo, [&](const auto &v) { return v.first < key; });
+)AAA";
+		}
+		else
+		if (params.memoize == MemoizeMode::FailuresOnly)
+		{
+			result += R"AAA(
+		const size_t base = memo_key(floor, $IdentifierType::None) / 64;
+		memo_failures.erase(memo_failures.begin(), memo_failures.begin() + std::min(base - memo_base, memo_failures.size()));
+		memo_base = base;
+)AAA";
+		}
+
+		result += R"AAA(	}
+)AAA";
+	}
+
+	if (params.profile && params.profile_reentries)
+	{
+		result += R"AAA(
+	// Marks the pair as tried, true when it already was
+	bool profile_revisit($Pos s, $IdentifierType id)
+	{
+		return !profile_visited.insert((uint64_t)(s - begin) * $identifier_count + (uint64_t)id).second;
+	}
+)AAA";
+	}
+
+	result += R"AAA(};
+)AAA";
+
+	return result;
+}
+
+std::string generate_cpu_features()
+{
+	return R"AAA([[nodiscard]]
+bool $has_avx2()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_cpu_supports("avx2");
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	__cpuidex(info, 7, 0);
+
+	return osxsave && (info[1] & (1 << 5)) != 0 && (_xgetbv(0) & 6) == 6;
+#else
+	return false;
+#endif
+#else
+	return false;
+#endif
+}
+)AAA";
+}
+
+// Read-only mapping of a whole file, pages are read in as the parser gets to them
+std::string generate_mapped_file()
+{
+	return R"AAA(class $MappedFile
+{
+public:
+	$MappedFile(const $MappedFile &) = delete;
+	$MappedFile &operator=(const $MappedFile &) = delete;
+
+	~$MappedFile()
+	{
+		if (length == 0)
+			return;
+
+#ifdef _WIN32
+		UnmapViewOfFile(data);
+#else
+		munmap((void *)data, length);
+#endif
+	}
+
+	// nullptr with `error` set if the file can't be opened or mapped
+	[[nodiscard]]
+	static std::unique_ptr<$MappedFile> open(const char *path, std::error_code &error)
+	{
+		std::unique_ptr<$MappedFile> result(new $MappedFile());
+		error.clear();
+
+#ifdef _WIN32
+		const HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			error = std::error_code((int)GetLastError(), std::system_category());
+			return nullptr;
+		}
+
+		LARGE_INTEGER size;
+
+		if (!GetFileSizeEx(file, &size))
+		{
+			error = std::error_code((int)GetLastError(), std::system_category());
+			CloseHandle(file);
+			return nullptr;
+		}
+
+		if ((uint64_t)size.QuadPart > SIZE_MAX)
+		{
+			error = std::make_error_code(std::errc::file_too_large);
+			CloseHandle(file);
+			return nullptr;
+		}
+
+		if (size.QuadPart == 0)
+		{
+			CloseHandle(file);
+			return result;
+		}
+
+		// the view keeps the file open after both handles are closed
+		const HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		const void *view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+
+		if (!view)
+			error = std::error_code((int)GetLastError(), std::system_category());
+
+		if (mapping)
+			CloseHandle(mapping);
+
+		CloseHandle(file);
+
+		if (!view)
+			return nullptr;
+
+		result->data = (const char *)view;
+		result->length = (size_t)size.QuadPart;
+#else
+		const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+
+		if (fd < 0)
+		{
+			error = std::error_code(errno, std::generic_category());
+			return nullptr;
+		}
+
+		struct stat st;
+
+		if (fstat(fd, &st) != 0)
+			error = std::error_code(errno, std::generic_category());
+		else
+		if (S_ISDIR(st.st_mode))
+			error = std::make_error_code(std::errc::is_a_directory);
+		else
+		if (!S_ISREG(st.st_mode))
+			error = std::make_error_code(std::errc::invalid_argument);
+		else
+		if ((uint64_t)st.st_size > SIZE_MAX)
+			error = std::make_error_code(std::errc::file_too_large);
+
+		if (error)
+		{
+			::close(fd);
+			return nullptr;
+		}
+
+		// mmap refuses empty files
+		if (st.st_size == 0)
+		{
+			::close(fd);
+			return result;
+		}
+
+		void *view = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (view == MAP_FAILED)
+			error = std::error_code(errno, std::generic_category());
+
+		::close(fd);
+
+		if (view == MAP_FAILED)
+			return nullptr;
+
+		// hints only, the mapping works the same without them
+		madvise(view, (size_t)st.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+		if ((size_t)st.st_size >= ((size_t)2 << 20))
+			madvise(view, (size_t)st.st_size, MADV_HUGEPAGE);
+#endif
+
+		result->data = (const char *)view;
+		result->length = (size_t)st.st_size;
+#endif
+
+		return result;
+	}
+
+	[[nodiscard]]
+	const char *begin() const
+	{
+		return data;
+	}
+
+	[[nodiscard]]
+	const char *end() const
+	{
+		return data + length;
+	}
+
+	[[nodiscard]]
+	size_t size() const
+	{
+		return length;
+	}
+
+private:
+	$MappedFile() = default;
+
+	const char *data = "";
+	size_t length = 0;
+};
+)AAA";
+}
+
+// Threads a parallel parse hands its chunks to
+std::string generate_thread_pool()
+{
+	return R"AAA(// Worker threads, started once and kept waiting for jobs. A job is a count
+// of indices the threads and the caller of run() take one at a time, so the
+// ones done first take over what is left of the others.
+class $ThreadPool
+{
+public:
+	explicit $ThreadPool(size_t threads = std::thread::hardware_concurrency())
+	{
+		for (size_t i = 1; i < threads; ++i)
+			workers.emplace_back([this] { work(); });
+	}
+
+	$ThreadPool(const $ThreadPool &) = delete;
+	$ThreadPool &operator=(const $ThreadPool &) = delete;
+
+	~$ThreadPool()
+	{
+		{
+			std::lock_guard lock(mutex);
+			stopping = true;
+		}
+
+		wake.notify_all();
+
+		for (auto &v : workers)
+			v.join();
+	}
+
+	// Threads a job runs on, the caller's included
+	[[nodiscard]]
+	size_t size() const
+	{
+		return workers.size() + 1;
+	}
+
+	// Calls f(i) for every i below count, returns when all calls did
+	template <typename F>
+	void run(size_t count, F f)
+	{
+		std::lock_guard running(jobs);
+		std::unique_lock lock(mutex);
+
+		job = [](void *data, size_t i) { (*static_cast<F *>(data))(i); };
+		job_data = &f;
+		job_count = count;
+		next = 0;
+		finished = 0;
+		++generation;
+
+		lock.unlock();
+		wake.notify_all();
+
+		take();
+
+		lock.lock();
+		idle.wait(lock, [&] { return finished == workers.size(); });
+	}
+
+private:
+	void take()
+	{
+		for (size_t i = next++; i < job_count; i = next++)
+			job(job_data, i);
+	}
+
+	// every worker takes part in every job, run() waits for all of them
+	void work()
+	{
+		std::unique_lock lock(mutex);
+
+		for (uint64_t seen = 0; ; )
+		{
+			wake.wait(lock, [&] { return stopping || generation != seen; });
+
+			if (stopping)
+				return;
+
+			seen = generation;
+
+			lock.unlock();
+			take();
+			lock.lock();
+
+			if (++finished == workers.size())
+				idle.notify_one();
+		}
+	}
+
+	std::vector<std::thread> workers;
+
+	std::mutex jobs;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable idle;
+
+	void (*job)(void *, size_t) = nullptr;
+	void *job_data = nullptr;
+	size_t job_count = 0;
+	std::atomic<size_t> next = 0;
+	size_t finished = 0;
+	uint64_t generation = 0;
+	bool stopping = false;
+};
+)AAA";
+}
+
+// Repetitions of @sync rules on a $ThreadPool, after $Context
+std::string generate_parallel(bool utf8)
+{
+	std::string result;
+
+	result += R"AAA(// Chunks are no smaller than this, smaller inputs are parsed in order
+constexpr size_t $parallel_min_chunk = 64 * 1024;
+
+// Parses a chunk may fail looking for where its matches start
+constexpr size_t $parallel_max_misses = 64;
+
+// Matches parse from s on as long as it matches, like `rule*` does, with the
+// input split into chunks parsed on ctx.pool. A chunk has runs of matches:
+// one from the first match past the chunk's offset until it passes the end
+// of the chunk, and after one that fails, another from the first match past
+// that. A match need not start where the sequence gets to, so matches are
+// only taken from one that does to the end of its run, and whatever lies in
+// between is parsed again here. A wrong start costs time, not correctness,
+// and a chunk stops after $parallel_max_misses parses that fail, leaving the
+// rest of it to be parsed here: one of those may parse as far as the end.
+template <typename F>
+void $parse_parallel($Context &ctx, const char *&s, const char *e, F parse)
+{
+	struct Run
+	{
+		size_t first;
+		const char *end;
+	};
+
+	struct Chunk
+	{
+		$Arena arena;
+		std::vector<$Parsed> matches;
+		std::vector<Run> runs;
+		const char *to;
+	};
+
+	// a few chunks a thread, so the threads done first take over the rest
+	const size_t size = e - s;
+	const size_t count = ctx.pool->size() > 1 ? std::min(ctx.pool->size() * 4, size / $parallel_min_chunk) : 1;
+
+	// chunks end where the next one starts
+	auto offset = [&](size_t i) {
+		const char *result = s + size * i / count;
+)AAA";
+
+	if (utf8)
+	{
+		result += R"AAA(
+		while (result < e && ((uint8_t)*result & 0xC0) == 0x80)
+			++result;
+)AAA";
+	}
+
+	result += R"AAA(
+		return result;
+	};
+
+	std::vector<Chunk> chunks(std::max<size_t>(count, 1));
+
+	if (count > 1)
+	{
+		ctx.pool->run(count, [&](size_t i) {
+			Chunk &c = chunks[i];
+			const char *p = offset(i);
+			c.to = offset(i + 1);
+
+			$Context local(p, e, c.arena);
+			size_t misses = 0;
+
+			while (p < c.to)
+			{
+				const size_t first = c.matches.size();
+
+				// the first chunk's only run starts at s
+				for (const char *sc = p; p < c.to; sc = ++p)
+				{
+					if (auto v = parse(local, sc, e); v && sc != p)
+					{
+						c.matches.push_back(v.value());
+						p = sc;
+						break;
+					}
+
+					if (i == 0 || ++misses == $parallel_max_misses)
+						break;
+				}
+
+				if (c.matches.size() == first)
+					break;
+
+				for (const char *sc = p; p < c.to; p = sc)
+				{
+					auto v = parse(local, sc, e);
+
+					if (!v || sc == p)
+						break;
+
+					c.matches.push_back(v.value());
+				}
+
+				c.runs.push_back({ first, p });
+
+				if (i == 0 || p >= c.to || ++misses == $parallel_max_misses)
+					break;
+
+				++p;
+			}
+		});
+
+		// child blocks stay where they are, the tree keeps the arenas
+		for (Chunk &c : chunks)
+			ctx.arenas.push_back(std::move(c.arena));
+	}
+	else
+	{
+		chunks[0].to = e;
+	}
+
+	const char *p = s;
+
+	for (const Chunk &c : chunks)
+	{
+		while (p < c.to)
+		{
+			auto it = std::lower_bound(c.matches.begin(), c.matches.end(), p, [](const $Parsed &v, const char *p) { return v.span.data() < p; });
+
+			// the same matches up to the end of the run as parsing in order would give
+			if (it != c.matches.end() && it->span.data() == p)
+			{
+				const size_t index = it - c.matches.begin();
+				auto run = std::upper_bound(c.runs.begin(), c.runs.end(), index, [](size_t i, const Run &r) { return i < r.first; }) - 1;
+				const size_t last = run + 1 != c.runs.end() ? (run + 1)->first : c.matches.size();
+
+				ctx.stack.insert(ctx.stack.end(), it, c.matches.begin() + last);
+				p = run->end;
+
+				// where the run failed, so does the sequence
+				if (p < c.to)
+				{
+					s = p;
+					return;
+				}
+
+				break;
+			}
+
+			const char *sc = p;
+			auto v = parse(ctx, sc, e);
+
+			if (!v || sc == p)
+			{
+				s = p;
+				return;
+			}
+
+			ctx.stack.push_back(v.value());
+			p = sc;
+		}
+	}
+
+	s = p;
+}
+)AAA";
+
+	return result;
+}
+
+// Documents of a batch on a $ThreadPool, after $ThreadPool, and after $Machine
+// for the state machine of explicit_stack, which a thread keeps too
+std::string generate_batch(bool machine)
+{
+	std::string result;
+
+	result += R"AAA(// Outcome of one document of a batch
+struct $BatchStatus
+{
+	bool parsed = false;
+
+	// how far the rule matched, like s after $parse_<rule>
+	size_t consumed = 0;
+};
+
+// What a thread keeps from one document of a batch to the next
+struct $BatchBuffers
+{
+	$Arena arena;
+)AAA";
+
+	result += machine ? "	$Machine machine{ arena };\n" : "	std::vector<$Parsed> stack;\n";
+
+	result += R"AAA(};
+
+[[nodiscard]]
+$BatchBuffers &$batch_buffers()
+{
+	thread_local $BatchBuffers buffers;
+	return buffers;
+}
+
+// Parses every input with parse(s, e, buffers) on pool, the documents are
+// handed out one at a time. visit(index, node) is called for the ones that
+// parsed, on the thread that parsed them and before its arena is reset for
+// the next one, so it has to be thread safe and copy what it keeps. It must
+// not run a job on the same pool.
+template <typename Parse, typename Visit>
+std::vector<$BatchStatus> $parse_batch(std::span<const std::string_view> inputs, $ThreadPool &pool, Parse parse, Visit &visit)
+{
+	std::vector<$BatchStatus> result(inputs.size());
+
+	pool.run(inputs.size(), [&](size_t i) {
+		$BatchBuffers &buffers = $batch_buffers();
+		buffers.arena.reset();
+)AAA";
+
+	result += machine ? "		buffers.machine.reset();\n" : "		buffers.stack.clear();\n";
+
+	result += R"AAA(
+
+		const char *s = inputs[i].data();
+		auto v = parse(s, s + inputs[i].size(), buffers);
+
+		result[i].parsed = v.has_value();
+		result[i].consumed = s - inputs[i].data();
+
+		if (v)
+			visit(i, v.value());
+	});
+
+	return result;
+}
+)AAA";
+
+	return result;
+}
+
+std::string generate_scanners()
+{
+	return R"AAA(// Runtime selected kernels that find the next occurrence of a byte
+using $FindByte = const char *(*)(const char *s, const char *e, char c);
+
+[[nodiscard]]
+const char *$find_byte_scalar(const char *s, const char *e, char c)
+{
+	for (; s != e; ++s)
+	{
+		if (*s == c)
+			return s;
+	}
+
+	return e;
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+[[nodiscard]]
+const char *$find_byte_sse2(const char *s, const char *e, char c)
+{
+	const __m128i needle = _mm_set1_epi8(c);
+
+	for (; e - s >= 16; s += 16)
+	{
+		const __m128i block = _mm_loadu_si128((const __m128i *)s);
+		const unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+
+		if (mask != 0)
+			return s + std::countr_zero(mask);
+	}
+
+	return $find_byte_scalar(s, e, c);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("avx2")))
+#endif
+[[nodiscard]]
+const char *$find_byte_avx2(const char *s, const char *e, char c)
+{
+	const __m256i needle = _mm256_set1_epi8(c);
+
+	for (; e - s >= 32; s += 32)
+	{
+		const __m256i block = _mm256_loadu_si256((const __m256i *)s);
+		const unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+
+		if (mask != 0)
+			return s + std::countr_zero(mask);
+	}
+
+	return $find_byte_sse2(s, e, c);
+}
+
+#endif
+
+[[nodiscard]]
+$FindByte $select_find_byte()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+	return $has_avx2() ? $find_byte_avx2 : $find_byte_sse2;
+#else
+	return $find_byte_scalar;
+#endif
+}
+
+const $FindByte $find_byte = $select_find_byte();
+
+// Where a "lit"^ repetition stops: the first position the literal matches at, or e
+[[nodiscard]]
+const char *$scan_negate_literal(const char *s, const char *e, const std::string_view &lit)
+{
+	while ((size_t)(e - s) >= lit.size())
+	{
+		s = $find_byte(s, e, lit[0]);
+
+		if ((size_t)(e - s) < lit.size())
+			break;
+
+		if (std::equal(lit.begin() + 1, lit.end(), s + 1))
+			return s;
+
+		++s;
+	}
+
+	return e;
+}
+)AAA";
+}
+
+std::string generate_utf8()
+{
+	return R"AAA(// Code points from U+0080 on that a class matches, sorted and disjoint
+struct $CodePointRange
+{
+	char32_t first;
+	char32_t last;
+};
+
+// Class of UTF-8 mode that matches past ASCII
+struct $UnicodeClass
+{
+	// the ASCII members, and the bytes a longer member can start with
+	$CharClass bytes;
+
+	const $CodePointRange *ranges;
+	size_t count;
+
+	// whether a member can start with c, for ASCII whether c is one
+	[[nodiscard]]
+	constexpr bool contains(char c) const
+	{
+		return bytes.contains(c);
+	}
+
+	[[nodiscard]]
+	constexpr bool contains_code_point(char32_t c) const
+	{
+		const $CodePointRange *it = std::lower_bound(ranges, ranges + count, c, [](const $CodePointRange &r, char32_t v) { return r.last < v; });
+		return it != ranges + count && it->first <= c;
+	}
+};
+
+// Size of the sequence a lead byte starts. Entry points validate the input,
+// so every sequence is complete.
+[[nodiscard]]
+size_t $utf8_length(char c)
+{
+	const uint8_t b = (uint8_t)c;
+	return b < 0x80 ? 1 : b < 0xE0 ? 2 : b < 0xF0 ? 3 : 4;
+}
+
+[[nodiscard]]
+char32_t $utf8_decode(const char *s, size_t size)
+{
+	constexpr uint8_t lead[] = { 0, 0x7F, 0x1F, 0x0F, 0x07 };
+
+	char32_t c = (uint8_t)s[0] & lead[size];
+
+	for (size_t i = 1; i < size; ++i)
+		c = c << 6 | ((uint8_t)s[i] & 0x3F);
+
+	return c;
+}
+
+// ASCII is decided by the byte lookup alone
+[[nodiscard]]
+std::optional<$Parsed> $parse_class(const char *&s, const char *e, const $UnicodeClass &cls)
+{
+	if ($is_eof(s, e) || !cls.contains(*s))
+		return std::nullopt;
+
+	const size_t size = $utf8_length(*s);
+
+	if (size != 1 && !cls.contains_code_point($utf8_decode(s, size)))
+		return std::nullopt;
+
+	s += size;
+	return $literal_node(s - size, size);
+}
+
+[[nodiscard]]
+const char *$scan_class(const char *s, const char *e, const $UnicodeClass &cls)
+{
+	while (s != e && cls.contains(*s))
+	{
+		const size_t size = $utf8_length(*s);
+
+		if (size != 1 && !cls.contains_code_point($utf8_decode(s, size)))
+			break;
+
+		s += size;
+	}
+
+	return s;
+}
+
+// "lit"^ of UTF-8 mode, takes one code point where lit does not match
+[[nodiscard]]
+std::optional<$Parsed> $parse_negate_code_point(const char *&s, const char *e, const std::string_view &lit)
+{
+	if ($is_eof(s, e) || std::string_view(s, e - s).starts_with(lit))
+		return std::nullopt;
+
+	const size_t size = $utf8_length(*s);
+
+	s += size;
+	return $literal_node(s - size, size);
+}
+
+// Size of the valid sequence at s, 0 if there is none
+[[nodiscard]]
+size_t $utf8_sequence(const char *s, const char *e)
+{
+	const uint8_t b = (uint8_t)*s;
+
+	if (b < 0x80)
+		return 1;
+
+	const size_t size = b >= 0xC2 && b <= 0xDF ? 2 : b >= 0xE0 && b <= 0xEF ? 3 : b >= 0xF0 && b <= 0xF4 ? 4 : 0;
+
+	if (size == 0 || (size_t)(e - s) < size)
+		return 0;
+
+	// the second byte rules out overlong forms, surrogates and code points past U+10FFFF
+	const uint8_t c = (uint8_t)s[1];
+	const uint8_t min = b == 0xE0 ? 0xA0 : b == 0xF0 ? 0x90 : 0x80;
+	const uint8_t max = b == 0xED ? 0x9F : b == 0xF4 ? 0x8F : 0xBF;
+
+	if (c < min || c > max)
+		return 0;
+
+	for (size_t i = 2; i < size; ++i)
+	{
+		if (((uint8_t)s[i] & 0xC0) != 0x80)
+			return 0;
+	}
+
+	return size;
+}
+
+// Runtime selected kernels that find the first byte of the first invalid
+// sequence, or e
+using $ValidateUtf8 = const char *(*)(const char *s, const char *e);
+
+[[nodiscard]]
+const char *$validate_utf8_scalar(const char *s, const char *e)
+{
+	while (s != e)
+	{
+		const size_t size = $utf8_sequence(s, e);
+
+		if (size == 0)
+			return s;
+
+		s += size;
+	}
+
+	return e;
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+// Blocks of ASCII are skipped, anything else is checked a sequence at a time
+[[nodiscard]]
+const char *$validate_utf8_sse2(const char *s, const char *e)
+{
+	while (s != e)
+	{
+		if (e - s >= 16)
+		{
+			const unsigned mask = (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)s));
+
+			if (mask == 0)
+			{
+				s += 16;
+				continue;
+			}
+
+			s += std::countr_zero(mask);
+		}
+
+		const size_t size = $utf8_sequence(s, e);
+
+		if (size == 0)
+			return s;
+
+		s += size;
+	}
+
+	return e;
+}
+
+// Keiser and Lemire's lookup: three nibble lookups per byte pair flag every
+// error but a missing third or fourth byte, which is checked from the bytes
+// two and three back. Blocks of ASCII only need the previous block to be
+// complete. The scalar kernel finds the exact position from the start of the
+// sequence the first failing block begins in, and checks the tail.
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("avx2")))
+#endif
+[[nodiscard]]
+const char *$validate_utf8_avx2(const char *s, const char *e)
+{
+	constexpr char too_short = 1 << 0;
+	constexpr char too_long = 1 << 1;
+	constexpr char overlong_3 = 1 << 2;
+	constexpr char too_large = 1 << 3;
+	constexpr char surrogate = 1 << 4;
+	constexpr char overlong_2 = 1 << 5;
+	constexpr char too_large_1000 = 1 << 6;
+	constexpr char overlong_4 = 1 << 6;
+	constexpr char two_conts = (char)(1 << 7);
+	constexpr char carry = too_short | too_long | two_conts;
+
+	const __m256i byte_1_high = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+		too_long, too_long, too_long, too_long, too_long, too_long, too_long, too_long,
+		two_conts, two_conts, two_conts, two_conts,
+		too_short | overlong_2,
+		too_short,
+		too_short | overlong_3 | surrogate,
+		too_short | too_large | too_large_1000 | overlong_4));
+
+	const __m256i byte_1_low = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+		carry | overlong_3 | overlong_2 | overlong_4,
+		carry | overlong_2,
+		carry,
+		carry,
+		carry | too_large,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000 | surrogate,
+		carry | too_large | too_large_1000,
+		carry | too_large | too_large_1000));
+
+	const __m256i byte_2_high = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+		too_short, too_short, too_short, too_short, too_short, too_short, too_short, too_short,
+		too_long | overlong_2 | two_conts | overlong_3 | too_large_1000 | overlong_4,
+		too_long | overlong_2 | two_conts | overlong_3 | too_large,
+		too_long | overlong_2 | two_conts | surrogate | too_large,
+		too_long | overlong_2 | two_conts | surrogate | too_large,
+		too_short, too_short, too_short, too_short));
+
+	// a lead byte this close to the end of a block is continued in the next one
+	const __m256i incomplete = _mm256_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+
+	const __m256i nibble = _mm256_set1_epi8(0x0F);
+	const char *begin = s;
+
+	__m256i previous = _mm256_setzero_si256();
+	__m256i previous_incomplete = _mm256_setzero_si256();
+
+	for (; e - s >= 32; s += 32)
+	{
+		const __m256i input = _mm256_loadu_si256((const __m256i *)s);
+		__m256i error = previous_incomplete;
+
+		if (_mm256_movemask_epi8(input) != 0)
+		{
+			const __m256i carried = _mm256_permute2x128_si256(previous, input, 0x21);
+			const __m256i prev1 = _mm256_alignr_epi8(input, carried, 15);
+			const __m256i prev2 = _mm256_alignr_epi8(input, carried, 14);
+			const __m256i prev3 = _mm256_alignr_epi8(input, carried, 13);
+
+			const __m256i special = _mm256_and_si256(
+				_mm256_and_si256(
+					_mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+					_mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+				_mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+			// third and fourth bytes are two continuations in a row, which is only fine there
+			const __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+			const __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+			const __m256i must_continue = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+
+			error = _mm256_xor_si256(must_continue, special);
+			previous_incomplete = _mm256_subs_epu8(input, incomplete);
+		}
+		else
+		{
+			previous_incomplete = _mm256_setzero_si256();
+		}
+
+		if (!_mm256_testz_si256(error, error))
+			break;
+
+		previous = input;
+	}
+
+	// a sequence cut by the block boundary starts at most three bytes back
+	const char *start = s - std::min<size_t>(s - begin, 3);
+
+	while (start != s && ((uint8_t)*start & 0xC0) == 0x80)
+		++start;
+
+	return $validate_utf8_scalar(start, e);
+}
+
+#endif
+
+[[nodiscard]]
+$ValidateUtf8 $select_validate_utf8()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+	return $has_avx2() ? $validate_utf8_avx2 : $validate_utf8_sse2;
+#else
+	return $validate_utf8_scalar;
+#endif
+}
+
+const $ValidateUtf8 $validate_utf8 = $select_validate_utf8();
+)AAA";
+}
+
+std::string generate_profile(const GrammarInfo &info, const GenerateCodeParams &params)
+{
+	std::string result;
+
+	result += "// whether $Context counts calls at an offset tried before\n";
+	result += "constexpr bool $profile_reentries = " + std::string(params.profile_reentries ? "true" : "false") + ";\n";
+	result += "\n";
+	result += "constexpr size_t $alternative_count = " + std::to_string(info.alternatives.size()) + ";\n";
+	result += "\n";
+	result += "// Alternatives with a success counter, as (rule, items)\n";
+	result += "const std::pair<$IdentifierType, std::string_view> $profile_alternatives[]\n";
+	result += "{\n";
+
+	for (const auto &[name, key] : info.alternatives)
+		result += "	{ $IdentifierType::$i_" + name + ", \"" + escape_string(key) + "\" },\n";
+
+	if (info.alternatives.empty())
+		result += "	{},\n";
+
+	result += "};\n";
+	result += "\n";
+
+	result += R"AAA(// Counters of one rule on one thread. Only the owning thread writes them,
+// relaxed atomics let profile_report() read them meanwhile.
+struct $RuleCounters
+{
+	std::atomic<uint64_t> calls{ 0 };
+	std::atomic<uint64_t> reentries{ 0 };
+	std::atomic<uint64_t> successes{ 0 };
+	std::atomic<uint64_t> failed_alternatives{ 0 };
+	std::atomic<uint64_t> bytes{ 0 };
+	std::atomic<uint64_t> ticks{ 0 };
+
+	static void add(std::atomic<uint64_t> &counter, uint64_t v)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+	}
+};
+
+// Plain copy of the counters, summed over threads
+struct $ProfileTotals
+{
+	struct Rule
+	{
+		uint64_t calls = 0;
+		uint64_t reentries = 0;
+		uint64_t successes = 0;
+		uint64_t failed_alternatives = 0;
+		uint64_t bytes = 0;
+		uint64_t ticks = 0;
+	};
+
+	Rule rules[$identifier_count];
+	uint64_t alternatives[$alternative_count + 1] = {};
+};
+
+struct $ThreadProfile;
+
+// Live thread profiles plus the totals of threads that already exited
+struct $ProfileRegistry
+{
+	std::mutex mutex;
+	std::vector<const $ThreadProfile *> live;
+	$ProfileTotals retired;
+};
+
+[[nodiscard]]
+$ProfileRegistry &$profile_registry()
+{
+	static $ProfileRegistry registry;
+	return registry;
+}
+
+struct $ThreadProfile
+{
+	$RuleCounters rules[$identifier_count];
+	std::atomic<uint64_t> alternatives[$alternative_count + 1];
+
+	$ThreadProfile()
+	{
+		auto &registry = $profile_registry();
+		std::lock_guard lock(registry.mutex);
+		registry.live.push_back(this);
+	}
+
+	~$ThreadProfile()
+	{
+		auto &registry = $profile_registry();
+		std::lock_guard lock(registry.mutex);
+
+		collect(registry.retired);
+		registry.live.erase(std::find(registry.live.begin(), registry.live.end(), this));
+	}
+
+	$ThreadProfile(const $ThreadProfile &) = delete;
+	$ThreadProfile &operator=(const $ThreadProfile &) = delete;
+
+	void collect($ProfileTotals &totals) const
+	{
+		for (size_t i = 0; i < $identifier_count; ++i)
+		{
+			totals.rules[i].calls += rules[i].calls.load(std::memory_order_relaxed);
+			totals.rules[i].reentries += rules[i].reentries.load(std::memory_order_relaxed);
+			totals.rules[i].successes += rules[i].successes.load(std::memory_order_relaxed);
+			totals.rules[i].failed_alternatives += rules[i].failed_alternatives.load(std::memory_order_relaxed);
+			totals.rules[i].bytes += rules[i].bytes.load(std::memory_order_relaxed);
+			totals.rules[i].ticks += rules[i].ticks.load(std::memory_order_relaxed);
+		}
+
+		for (size_t i = 0; i < $alternative_count; ++i)
+			totals.alternatives[i] += alternatives[i].load(std::memory_order_relaxed);
+	}
+};
+
+thread_local $ThreadProfile $profile;
+
+// TSC cycles where available, steady_clock ticks otherwise
+[[nodiscard]]
+uint64_t $profile_ticks()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+	return __rdtsc();
+#else
+	return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+[[nodiscard]]
+$ProfileTotals $profile_totals()
+{
+	auto &registry = $profile_registry();
+	std::lock_guard lock(registry.mutex);
+
+	$ProfileTotals totals = registry.retired;
+
+	for (const auto *p : registry.live)
+		p->collect(totals);
+
+	return totals;
+}
+
+namespace helpers
+{
+
+
+// One line per rule/group that was called, most expensive first. Ticks are
+// inclusive, a rule's ticks contain the ticks of everything it called.
+// Re-entries read - unless profile_reentries counted them.
+std::string profile_report()
+{
+	const $ProfileTotals totals = $profile_totals();
+
+	std::vector<size_t> order;
+
+	for (size_t i = 1; i < $identifier_count; ++i)
+	{
+		if (totals.rules[i].calls != 0)
+			order.push_back(i);
+	}
+
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return totals.rules[a].ticks > totals.rules[b].ticks; });
+
+	std::string result;
+	char line[256];
+
+	std::snprintf(line, sizeof(line), "%-24s %14s %14s %14s %14s %14s %16s %12s\n", "rule", "calls", "reentries", "successes", "failed alts", "bytes", "ticks", "ticks/call");
+	result += line;
+
+	for (size_t i : order)
+	{
+		const auto &t = totals.rules[i];
+
+		const std::string reentries = $profile_reentries ? std::to_string(t.reentries) : "-";
+
+		std::snprintf(line, sizeof(line), "%-24s %14llu %14s %14llu %14llu %14llu %16llu %12.1f\n",
+			table_$IdentifierType[i].c_str(),
+			(unsigned long long)t.calls,
+			reentries.c_str(),
+			(unsigned long long)t.successes,
+			(unsigned long long)t.failed_alternatives,
+			(unsigned long long)t.bytes,
+			(unsigned long long)t.ticks,
+			(double)t.ticks / t.calls);
+
+		result += line;
+	}
+
+	return result;
+}
+
+// Counters in the format pgen::helpers::parse_profile() reads back
+std::string profile_dump()
+{
+	const $ProfileTotals totals = $profile_totals();
+
+	std::string result;
+
+	for (size_t i = 1; i < $identifier_count; ++i)
+	{
+		const auto &t = totals.rules[i];
+		result += "rule " + table_$IdentifierType[i] + " " + std::to_string(t.calls);
+
+		if ($profile_reentries)
+			result += " " + std::to_string(t.reentries);
+
+		result += "\n";
+	}
+
+	for (size_t i = 0; i < $alternative_count; ++i)
+	{
+		const auto &[id, items] = $profile_alternatives[i];
+		result += "alternative " + table_$IdentifierType[(size_t)id] + " " + std::to_string(totals.alternatives[i]) + " " + std::string(items) + "\n";
+	}
+
+	return result;
+}
+
+
+} // namespace helpers
+)AAA";
+
+	return result;
+}
+
+// With reparse, the $reparse_ variant that starts from the calls of a previous tree;
+// with parallel, the one running repetitions of @sync rules on a pool
+std::string generate_entry_point(const std::string &name, bool utf8, bool incremental = false, bool reparse = false, bool parallel = false)
+{
+	std::string result;
+
+	result += "[[nodiscard]]\n";
+
+	if (reparse)
+		result += "std::optional<$Tree> $reparse_" + name + "(const $Tree &previous, const $Edit &edit, const char *&s, const char *e)\n";
+	else
+	if (parallel)
+		result += "std::optional<$Tree> $parse_" + name + "(const char *&s, const char *e, $ThreadPool &pool)\n";
+	else
+		result += "std::optional<$Tree> $parse_" + name + "(const char *&s, const char *e)\n";
+
+	result += "{\n";
+
+	if (utf8)
+	{
+		result += "	// the input ends in front of the first invalid sequence\n";
+		result += "	e = $validate_utf8(s, e);\n";
+		result += "\n";
+	}
+
+	result += "	$Tree tree;\n";
+	result += "	$Context ctx(s, e, tree.arena);\n";
+
+	if (reparse)
+	{
+		result += "	ctx.previous = &previous;\n";
+		result += "	ctx.edit = edit;\n";
+	}
+
+	if (parallel)
+		result += "	ctx.pool = &pool;\n";
+
+	if (reparse && utf8)
+	{
+		result += "\n";
+		result += "	// a sequence is valid or not by all of its bytes, and the previous input\n";
+		result += "	// ended in front of the first invalid one\n";
+		result += "	const size_t back = std::min<size_t>(ctx.edit.offset, 3);\n";
+		result += "	const size_t past = ctx.edit.offset - back > previous.memo_end ? ctx.edit.offset - back - previous.memo_end : 0;\n";
+		result += "\n";
+		result += "	ctx.edit.offset -= back + past;\n";
+		result += "	ctx.edit.removed += back + past;\n";
+		result += "	ctx.edit.inserted += back + past;\n";
+	}
+
+	result += "\n";
+	result += "	auto v = $parse_" + name + "(ctx, s, e);\n";
+	result += "\n";
+
+	if (incremental)
+	{
+		result += "	tree.memo = std::move(ctx.memo);\n";
+		result += "	tree.carried = ctx.take_carried();\n";
+		result += "	tree.memo_base = (uintptr_t)ctx.begin;\n";
+		result += "	tree.memo_end = ctx.end - ctx.begin;\n";
+		result += "\n";
+	}
+
+	if (parallel)
+	{
+		result += "	tree.arenas = std::move(ctx.arenas);\n";
+		result += "\n";
+	}
+
+	result += "	if (!v)\n";
+	result += "		return std::nullopt;\n";
+	result += "\n";
+	result += "	static_cast<$Parsed &>(tree) = v.value();\n";
+	result += "	return tree;\n";
+	result += "}\n";
+
+	return result;
+}
+
+// The tokens live as long as the parse, the tree views the input
+std::string generate_token_entry_point(const std::string &name, bool utf8)
+{
+	std::string result;
+
+	result += "[[nodiscard]]\n";
+	result += "std::optional<$Tree> $parse_" + name + "(const char *&s, const char *e)\n";
+	result += "{\n";
+
+	if (utf8)
+	{
+		result += "	// the input ends in front of the first invalid sequence\n";
+		result += "	e = $validate_utf8(s, e);\n";
+		result += "\n";
+	}
+
+	result += "	const char *lexed = s;\n";
+	result += "	const std::vector<$Token> tokens = $lex(lexed, e);\n";
+	result += "\n";
+	result += "	$Pos ts = tokens.data();\n";
+	result += "	$Pos te = tokens.data() + tokens.size() - 1;\n";
+	result += "\n";
+	result += "	$Tree tree;\n";
+	result += "	$Context ctx(ts, te, tree.arena);\n";
+	result += "\n";
+	result += "	auto v = $parse_" + name + "(ctx, ts, te);\n";
+	result += "\n";
+	result += "	if (!v)\n";
+	result += "		return std::nullopt;\n";
+	result += "\n";
+	result += "	// up to the next token, or to where the lexer stopped after the last one\n";
+	result += "	s = ts == te ? lexed : ts->span.data();\n";
+	result += "\n";
+	result += "	static_cast<$Parsed &>(tree) = v.value();\n";
+	result += "	return tree;\n";
+	result += "}\n";
+
+	return result;
+}
+
+// Wraps the entry point above, the tree takes over the mapping. A file that
+// can't be opened or mapped sets *error and *consumed to 0, a parse that fails
+// leaves *error clear.
+std::string generate_file_entry_point(const std::string &name, bool parallel = false)
+{
+	std::string result;
+
+	result += "[[nodiscard]]\n";
+
+	if (parallel)
+		result += "std::optional<$Tree> $parse_file_" + name + "(const char *path, $ThreadPool &pool, size_t *consumed = nullptr, std::error_code *error = nullptr)\n";
+	else
+		result += "std::optional<$Tree> $parse_file_" + name + "(const char *path, size_t *consumed = nullptr, std::error_code *error = nullptr)\n";
+
+	result += "{\n";
+	result += "	std::error_code open_error;\n";
+	result += "	std::unique_ptr<$MappedFile> file = $MappedFile::open(path, open_error);\n";
+	result += "\n";
+	result += "	if (error)\n";
+	result += "		*error = open_error;\n";
+	result += "\n";
+	result += "	if (!file)\n";
+	result += "	{\n";
+	result += "		if (consumed)\n";
+	result += "			*consumed = 0;\n";
+	result += "\n";
+	result += "		return std::nullopt;\n";
+	result += "	}\n";
+	result += "\n";
+	result += "	const char *s = file->begin();\n";
+	result += "	auto tree = $parse_" + name + "(s, file->end()" + (parallel ? ", pool" : "") + ");\n";
+	result += "\n";
+	result += "	if (consumed)\n";
+	result += "		*consumed = s - file->begin();\n";
+	result += "\n";
+	result += "	if (tree)\n";
+	result += "		tree->input = std::move(file);\n";
+	result += "\n";
+	result += "	return tree;\n";
+	result += "}\n";
+
+	return result;
+}
+
+// $parse_batch_<rule>, with `document` the body of the lambda that parses
+// one input into the buffers of its thread
+std::string generate_batch_entry_point(const std::string &name, const std::string &document)
+{
+	std::string result;
+
+	result += "template <typename F>\n";
+	result += "std::vector<$BatchStatus> $parse_batch_" + name + "(std::span<const std::string_view> inputs, $ThreadPool &pool, F visit)\n";
+	result += "{\n";
+	result += "	return $parse_batch(inputs, pool, [](const char *&s, const char *e, $BatchBuffers &buffers) {\n";
+	result += document;
+	result += "	}, visit);\n";
+	result += "}\n";
+
+	return result;
+}
+
+// Parses a document like the entry points do, with the buffers' arena and
+// stack. Tokens are lexed into a vector of their own, the state machine of
+// explicit_stack starts at entry on the buffers' machine.
+std::string generate_batch_document(const std::string &name, bool utf8, bool tokens, std::optional<uint32_t> entry = std::nullopt)
+{
+	std::string result;
+
+	if (utf8)
+		result += "		e = $validate_utf8(s, e);\n";
+
+	if (entry)
+	{
+		result += "		return $run(buffers.machine, " + std::to_string(entry.value()) + ", s, e);\n";
+		return result;
+	}
+
+	if (tokens)
+	{
+		result += "		const char *lexed = s;\n";
+		result += "		const std::vector<$Token> tokens = $lex(lexed, e);\n";
+		result += "\n";
+		result += "		$Pos ts = tokens.data();\n";
+		result += "		$Pos te = tokens.data() + tokens.size() - 1;\n";
+		result += "\n";
+		result += "		$Context ctx(ts, te, buffers.arena);\n";
+		result += "		ctx.stack.swap(buffers.stack);\n";
+		result += "\n";
+		result += "		auto v = $parse_" + name + "(ctx, ts, te);\n";
+		result += "\n";
+		result += "		ctx.stack.swap(buffers.stack);\n";
+		result += "\n";
+		result += "		if (v)\n";
+		result += "			s = ts == te ? lexed : ts->span.data();\n";
+	}
+	else
+	{
+		result += "		$Context ctx(s, e, buffers.arena);\n";
+		result += "		ctx.stack.swap(buffers.stack);\n";
+		result += "\n";
+		result += "		auto v = $parse_" + name + "(ctx, s, e);\n";
+		result += "\n";
+		result += "		ctx.stack.swap(buffers.stack);\n";
+	}
+
+	result += "		return v;\n";
+
+	return result;
+}
+
+std::string generate_machine_context(bool cuts, bool push)
+{
+	// a push machine keeps positions in the whole input, see $PushInput
+	auto whole = [&](const std::string &s) {
+		return push ? "whole(" + s + ")" : s;
+	};
+
+	std::string result;
+
+	result += R"AAA(// Heap stacks of the iterative parser
+struct $Machine
+{
+	// Continuation of a rule/group call
+	struct Frame
+	{
+		uint32_t ret;
+		const char *start;
+		size_t stack;
+	};
+
+	// Pending alternative, resumed at target on failure
+	struct Backtrack
+	{
+		uint32_t target;
+		const char *s;
+		size_t stack;
+		$Arena::Mark arena;
+		size_t frames;
+	};
+
+	$Arena &arena;
+
+	std::vector<$Parsed> stack;
+	std::vector<Frame> frames;
+	std::vector<Backtrack> backtrack;
+)AAA";
+
+	if (push)
+	{
+		result += R"AAA(
+	// Frames, choices and nodes point where a byte would be if the input were
+	// in one piece from where the window first started; the window is at
+	// that minus shift
+	uintptr_t shift = 0;
+)AAA";
+	}
+
+	result += R"AAA(
+	explicit $Machine($Arena &arena)
+		: arena(arena)
+	{
+	}
+
+	// Drops what the last parse left, the stacks keep their capacity
+	void reset()
+	{
+		stack.clear();
+		frames.clear();
+		backtrack.clear();
+	}
+)AAA";
+
+	if (push)
+	{
+		result += R"AAA(
+	[[nodiscard]]
+	const char *whole(const char *s) const
+	{
+		return (const char *)((uintptr_t)s + shift);
+	}
+
+	[[nodiscard]]
+	const char *window(const char *p) const
+	{
+		return (const char *)((uintptr_t)p - shift);
+	}
+
+	// Input before this is never looked at again
+	[[nodiscard]]
+	const char *floor(const char *s) const
+	{
+		return backtrack.empty() ? s : window(backtrack.front().s);
+	}
+)AAA";
+	}
+
+	result += R"AAA(
+	[[nodiscard]]
+	bool push(const std::optional<$Parsed> &v)
+	{
+		if (!v)
+			return false;
+
+		add(v.value());
+		return true;
+	}
+
+	void add($Parsed v)
+	{
+)AAA";
+
+	if (push)
+	{
+		result += R"AAA(		v.span = std::string_view(whole(v.span.data()), v.span.size());
+)AAA";
+	}
+
+	result += R"AAA(		stack.push_back(v);
+	}
+
+	void call(uint32_t ret, const char *s)
+	{
+		frames.push_back({ ret, )AAA" + whole("s") + R"AAA(, stack.size() });
+	}
+
+	// Folds the children of the current call into its node, returns where to continue
+	[[nodiscard]]
+	uint32_t ret($ParsedType type, $IdentifierType id, const char *s)
+	{
+		const Frame f = frames.back();
+		frames.pop_back();
+
+		const size_t count = stack.size() - f.stack;
+
+		$Parsed result;
+		result.type = type;
+		result.identifier = id;
+		result.span = std::string_view(f.start, )AAA" + whole("s") + R"AAA( - f.start);
+
+		if (count != 0)
+		{
+			$Parsed *block = arena.allocate(count);
+			std::copy(stack.begin() + f.stack, stack.end(), block);
+			stack.resize(f.stack);
+			result.group = { block, count };
+		}
+
+		stack.push_back(result);
+		return f.ret;
+	}
+
+	// Ends a transparent call, its children stay where they are
+	[[nodiscard]]
+	uint32_t splice()
+	{
+		const uint32_t ret = frames.back().ret;
+		frames.pop_back();
+		return ret;
+	}
+
+	void choice(uint32_t target, const char *s)
+	{
+		backtrack.push_back({ target, )AAA" + whole("s") + R"AAA(, stack.size(), arena.mark(), frames.size() });
+	}
+
+	void partial_commit(const char *s)
+	{
+		Backtrack &b = backtrack.back();
+		b.s = )AAA" + whole("s") + R"AAA(;
+		b.stack = stack.size();
+		b.arena = arena.mark();
+	}
+)AAA";
+
+	if (cuts)
+	{
+		result += R"AAA(
+	// Passes a cut, own drops the choice of the alternative it is in. There is
+	// no memo to drop here, and the tree views the input before the cut.
+	void cut(bool own)
+	{
+		if (own)
+			backtrack.pop_back();
+	}
+)AAA";
+	}
+
+	result += R"AAA(
+	// Restores the latest pending alternative, false when there is none
+	[[nodiscard]]
+	bool fail(uint32_t &pc, const char *&s)
+	{
+		if (backtrack.empty())
+			return false;
+
+		const Backtrack &b = backtrack.back();
+		pc = b.target;
+		s = )AAA" + std::string(push ? "window(b.s)" : "b.s") + R"AAA(;
+		stack.resize(b.stack);
+		arena.rewind(b.arena);
+		frames.resize(b.frames);
+		backtrack.pop_back();
+		return true;
+	}
+};
+)AAA";
+
+	return result;
+}
+
+// One switch over the whole vm program. Jumps known at compile time are gotos,
+// only returns and backtracking go through the switch.
+std::string generate_machine(const vm::Program &program, const GrammarInfo &info, bool push)
+{
+	const size_t size = program.code.size();
+
+	// dynamic targets get a case, static ones a label
+	std::vector<bool> is_case(size);
+	std::vector<bool> is_label(size);
+
+	// rule/group each instruction belongs to, bodies are laid out in id order
+	std::vector<uint32_t> owner(size);
+
+	is_case[0] = true;
+
+	for (size_t id = 1; id < program.entry.size(); ++id)
+	{
+		is_case[program.entry[id]] = true;
+
+		const size_t end = id + 1 < program.entry.size() ? program.entry[id + 1] : size;
+
+		for (size_t i = program.entry[id]; i < end; ++i)
+			owner[i] = (uint32_t)id;
+	}
+
+	for (size_t i = 0; i < size; ++i)
+	{
+		const auto &ins = program.code[i];
+
+		switch (ins.op)
+		{
+			case vm::Op::Call:
+				is_case[i + 1] = true;
+				is_label[program.entry[ins.arg]] = true;
+				break;
+			case vm::Op::Choice:
+				is_case[ins.target] = true;
+				break;
+			case vm::Op::Commit:
+			case vm::Op::PartialCommit:
+			case vm::Op::TestSet:
+				is_label[ins.target] = true;
+				break;
+			default:
+				break;
+		}
+	}
+
+	auto jump = [](uint32_t target) {
+		return "goto $l" + std::to_string(target) + ";";
+	};
+
+	// a push machine waits for the bytes an instruction looks at, or the end
+	auto wait = [&](size_t count) {
+		if (!push || count == 0)
+			return std::string();
+
+		return "		while ((size_t)(e - s) < " + std::to_string(count) + " && !in.closed)\n"
+			"			co_await in.more(m, s, e);\n";
+	};
+
+	std::string result;
+
+	if (push)
+	{
+		result += R"AAA([[nodiscard]]
+$PushTask $run_push($PushInput &in, $Arena &arena, uint32_t pc)
+{
+	$Machine m(arena);
+
+	const char *s = in.begin();
+	const char *e = in.end();
+)AAA";
+	}
+	else
+	{
+		result += R"AAA([[nodiscard]]
+std::optional<$Parsed> $run($Machine &m, uint32_t pc, const char *&input, const char *e)
+{
+	const char *s = input;
+)AAA";
+	}
+
+	result += R"AAA(
+	m.call(0, s);
+
+$dispatch:
+	switch (pc)
+	{
+)AAA";
+
+	for (size_t i = 0; i < size; ++i)
+	{
+		const auto &ins = program.code[i];
+		const std::string name = program.names[owner[i]];
+
+		if (i != 0 && program.entry[owner[i]] == i)
+			result += "\n	// " + std::string(owner[i] <= program.rule_count ? "Rule" : "Group") + ": " + name + "\n";
+
+		if (is_case[i])
+			result += "	case " + std::to_string(i) + ":\n";
+
+		if (is_label[i])
+			result += "	$l" + std::to_string(i) + ":\n";
+
+		switch (ins.op)
+		{
+			case vm::Op::Literal:
+				result += wait(program.literals[ins.arg].size());
+				result += "		if (!m.push($parse_literal(s, e, \"" + escape_string(program.literals[ins.arg]) + "\")))\n";
+				result += "			goto $fail;\n";
+				break;
+			case vm::Op::NegateLiteral:
+				result += wait(std::max<size_t>(program.literals[ins.arg].size(), 1));
+				result += "		if (!m.push(" + std::string(info.utf8 ? "$parse_negate_code_point" : "$parse_negate_literal") + "(s, e, \"" + escape_string(program.literals[ins.arg]) + "\")))\n";
+				result += "			goto $fail;\n";
+				break;
+			case vm::Op::CharClass:
+				result += wait(1);
+				result += "		if (!m.push($parse_class(s, e, " + info.char_class_name(ins.arg) + ")))\n";
+				result += "			goto $fail;\n";
+				break;
+			case vm::Op::LiteralSet:
+				{
+					std::vector<std::string_view> literals;
+					size_t longest = 0;
+
+					for (uint32_t lit : program.literal_sets[ins.arg])
+					{
+						literals.push_back(program.literals[lit]);
+						longest = std::max(longest, program.literals[lit].size());
+					}
+
+					result += wait(longest);
+					result += "		{\n";
+					result += generate_trie_match(literals, "\t\t\t");
+					result += "\n";
+					result += "			if (length < 0)\n";
+					result += "				goto $fail;\n";
+					result += "\n";
+					result += "			m.add($literal_node(s, length));\n";
+					result += "			s += length;\n";
+					result += "		}\n";
+					break;
+				}
+			case vm::Op::Call:
+				result += "		m.call(" + std::to_string(i + 1) + ", s);\n";
+				result += "		" + jump(program.entry[ins.arg]) + "\n";
+				break;
+			case vm::Op::Return:
+				result += "		pc = m.ret($ParsedType::" + std::string(owner[i] <= program.rule_count ? "Identifier" : "Group") + ", $IdentifierType::$i_" + name + ", s);\n";
+				result += "		goto $dispatch;\n";
+				break;
+			case vm::Op::Splice:
+				result += "		pc = m.splice();\n";
+				result += "		goto $dispatch;\n";
+				break;
+			case vm::Op::Choice:
+				result += "		m.choice(" + std::to_string(ins.target) + ", s);\n";
+				break;
+			case vm::Op::Commit:
+				result += "		m.backtrack.pop_back();\n";
+				result += "		" + jump(ins.target) + "\n";
+				break;
+			case vm::Op::PartialCommit:
+				result += "		m.partial_commit(s);\n";
+				result += "		" + jump(ins.target) + "\n";
+				break;
+			case vm::Op::TestSet:
+				result += wait(1);
+				result += "		if ($is_eof(s, e) || !" + info.char_class_name(ins.arg) + ".contains(*s))\n";
+				result += "			" + jump(ins.target) + "\n";
+				break;
+			case vm::Op::Cut:
+				result += "		m.cut(" + std::string(ins.arg ? "true" : "false") + ");\n";
+				break;
+			case vm::Op::Fail:
+				result += "		goto $fail;\n";
+				break;
+			case vm::Op::End:
+				if (push)
+				{
+					result += "		in.consumed = (uintptr_t)m.whole(s) - in.origin;\n";
+					result += "		co_return m.stack.back();\n";
+				}
+				else
+				{
+					result += "		input = s;\n";
+					result += "		return m.stack.back();\n";
+				}
+				break;
+		}
+
+		const bool falls_through = ins.op == vm::Op::Literal
+			|| ins.op == vm::Op::NegateLiteral
+			|| ins.op == vm::Op::CharClass
+			|| ins.op == vm::Op::LiteralSet
+			|| ins.op == vm::Op::Choice
+			|| ins.op == vm::Op::TestSet
+			|| ins.op == vm::Op::Cut;
+
+		if (falls_through && i + 1 < size && is_case[i + 1])
+			result += "		[[fallthrough]];\n";
+	}
+
+	result += R"AAA(	}
+
+$fail:
+	if (!m.fail(pc, s))
+		)AAA";
+
+	result += push ? "co_return" : "return";
+
+	result += R"AAA( std::nullopt;
+
+	goto $dispatch;
+}
+)AAA";
+
+	return result;
+}
+
+// What a push parse has been fed and the coroutine it runs in
+std::string generate_push_input(bool utf8)
+{
+	std::string result;
+
+	result += R"AAA(// Bytes fed to a push parse so far. The machine reads them in the window,
+// from the oldest position it may go back to on; the bytes before move to
+// done once they are half of it, so moving them costs no more than reading
+// them. The machine keeps positions in the whole input, so when the window
+// moves only s and e follow it, in more().
+struct $PushInput
+{
+	// input before the window
+	std::vector<char> done;
+
+	// input from done.size() on
+	std::vector<char> window;
+
+	// bytes of the window the machine may look at
+	size_t valid = 0;
+
+	// nothing past valid will come
+	bool closed = false;
+
+	// where in the window the machine may go back to
+	size_t floor = 0;
+
+	// of the whole input
+	size_t consumed = 0;
+
+	// the machine's position of the first byte, see $Machine::shift
+	uintptr_t origin = 0;
+
+	$PushInput()
+	{
+		window.reserve(4096);
+		origin = (uintptr_t)window.data();
+	}
+
+	[[nodiscard]]
+	const char *begin() const
+	{
+		return window.data();
+	}
+
+	[[nodiscard]]
+	const char *end() const
+	{
+		return window.data() + valid;
+	}
+
+	[[nodiscard]]
+	uintptr_t shift() const
+	{
+		return origin + done.size() - (uintptr_t)window.data();
+	}
+
+	void append(std::string_view chunk)
+	{
+		if (floor != 0 && floor * 2 >= window.size())
+		{
+			done.insert(done.end(), window.begin(), window.begin() + floor);
+			window.erase(window.begin(), window.begin() + floor);
+			valid -= floor;
+			floor = 0;
+		}
+
+		window.insert(window.end(), chunk.begin(), chunk.end());
+		update();
+	}
+
+	void close()
+	{
+		closed = true;
+		update();
+	}
+
+	// The whole input in one piece
+	[[nodiscard]]
+	std::vector<char> take()
+	{
+		done.insert(done.end(), window.begin(), window.end());
+		window.clear();
+
+		return std::move(done);
+	}
+
+	void update()
+	{
+)AAA";
+
+	if (utf8)
+	{
+		result += R"AAA(		valid = $validate_utf8(begin() + valid, window.data() + window.size()) - begin();
+
+		// fewer bytes than a sequence may still be completed by the next chunk
+		if (window.size() - valid >= 4)
+			closed = true;
+)AAA";
+	}
+	else
+	{
+		result += R"AAA(		valid = window.size();
+)AAA";
+	}
+
+	result += R"AAA(	}
+
+	struct More
+	{
+		$PushInput &in;
+		$Machine &m;
+		const char *&s;
+		const char *&e;
+
+		bool await_ready() const noexcept
+		{
+			return false;
+		}
+
+		void await_suspend(std::coroutine_handle<>) const noexcept
+		{
+		}
+
+		void await_resume() const
+		{
+			const char *at = m.whole(s);
+
+			m.shift = in.shift();
+			s = m.window(at);
+			e = in.end();
+		}
+	};
+
+	// Waits for the next chunk
+	[[nodiscard]]
+	More more($Machine &m, const char *&s, const char *&e)
+	{
+		floor = m.floor(s) - begin();
+		return { *this, m, s, e };
+	}
+};
+
+// Coroutine of a push parse, suspended while it waits for input
+struct $PushTask
+{
+	struct promise_type
+	{
+		std::optional<$Parsed> result;
+
+		$PushTask get_return_object()
+		{
+			return $PushTask(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		std::suspend_always final_suspend() noexcept
+		{
+			return {};
+		}
+
+		void return_value(std::optional<$Parsed> v)
+		{
+			result = v;
+		}
+
+		void unhandled_exception()
+		{
+			throw;
+		}
+	};
+
+	std::coroutine_handle<promise_type> handle;
+
+	explicit $PushTask(std::coroutine_handle<promise_type> handle)
+		: handle(handle)
+	{
+	}
+
+	$PushTask(const $PushTask &) = delete;
+	$PushTask &operator=(const $PushTask &) = delete;
+
+	$PushTask($PushTask &&other) noexcept
+		: handle(std::exchange(other.handle, nullptr))
+	{
+	}
+
+	$PushTask &operator=($PushTask &&other) noexcept
+	{
+		std::swap(handle, other.handle);
+		return *this;
+	}
+
+	~$PushTask()
+	{
+		if (handle)
+			handle.destroy();
+	}
+};
+)AAA";
+
+	return result;
+}
+
+std::string generate_push_parser()
+{
+	return R"AAA(// Parses input that arrives in chunks. The machine runs as far as the bytes
+// fed so far take it and waits on its coroutine frame for the rest, so reading
+// the next chunk can overlap with parsing the last one. The tree views the
+// whole input, which is kept until finish() hands it over with the tree.
+class $PushParser
+{
+public:
+	explicit $PushParser(uint32_t entry)
+		: state(std::make_unique<State>())
+		, task($run_push(state->input, state->tree.arena, entry))
+	{
+	}
+
+	// Appends a chunk and parses as far as it goes. False once the parse has
+	// ended, the rest of the input can't change the result then.
+	bool feed(std::string_view chunk)
+	{
+		if (task.handle.done())
+			return false;
+
+		state->input.append(chunk);
+		task.handle.resume();
+
+		return !task.handle.done();
+	}
+
+	// Ends the input and parses the rest, once
+	[[nodiscard]]
+	std::optional<$Tree> finish(size_t *consumed = nullptr)
+	{
+		state->input.close();
+
+		if (!task.handle.done())
+			task.handle.resume();
+
+		if (consumed)
+			*consumed = state->input.consumed;
+
+		const std::optional<$Parsed> &v = task.handle.promise().result;
+
+		if (!v)
+			return std::nullopt;
+
+		$Tree tree = std::move(state->tree);
+		static_cast<$Parsed &>(tree) = v.value();
+
+		// the nodes point where the machine kept their bytes, now they are here
+		auto input = std::make_shared<const std::vector<char>>(state->input.take());
+		const uintptr_t origin = state->input.origin;
+
+		auto move = [&]($Parsed &node) {
+			node.span = std::string_view(input->data() + ((uintptr_t)node.span.data() - origin), node.span.size());
+		};
+
+		tree.arena.for_each(move);
+		move(tree);
+
+		tree.input = std::move(input);
+		return tree;
+	}
+
+private:
+	struct State
+	{
+		$PushInput input;
+		$Tree tree;
+	};
+
+	// the coroutine refers into the state, so it goes first
+	std::unique_ptr<State> state;
+	$PushTask task;
+};
+)AAA";
+}
+
+std::string generate_push_entry_point(const std::string &name, uint32_t entry)
+{
+	std::string result;
+
+	result += "[[nodiscard]]\n";
+	result += "$PushParser $push_" + name + "()\n";
+	result += "{\n";
+	result += "	return $PushParser(" + std::to_string(entry) + ");\n";
+	result += "}\n";
+
+	return result;
+}
+
+// The coroutine machine and a $push_<rule>() per rule, after $Machine
+std::string generate_push(const ir::Grammar &g, const vm::Program &program, const GrammarInfo &info)
+{
+	std::string result;
+
+	result += generate_push_input(info.utf8);
+	result += "\n";
+	result += generate_machine(program, info, true);
+	result += "\n";
+	result += generate_push_parser();
+	result += "\n";
+
+	for (uint32_t id = 1; id < g.size(); ++id)
+	{
+		if (g.definitions[id].transparent)
+			continue;
+
+		result += generate_push_entry_point(g.definitions[id].name, program.entry[id]);
+		result += "\n";
+	}
+
+	return result;
+}
+
+std::string generate_machine_entry_point(const std::string &name, uint32_t entry, bool utf8)
+{
+	std::string result;
+
+	result += "[[nodiscard]]\n";
+	result += "std::optional<$Tree> $parse_" + name + "(const char *&s, const char *e)\n";
+	result += "{\n";
+
+	if (utf8)
+	{
+		result += "	// the input ends in front of the first invalid sequence\n";
+		result += "	e = $validate_utf8(s, e);\n";
+		result += "\n";
+	}
+
+	result += "	$Tree tree;\n";
+	result += "\n";
+	result += "	$Machine m(tree.arena);\n";
+	result += "	auto v = $run(m, " + std::to_string(entry) + ", s, e);\n";
+	result += "\n";
+	result += "	if (!v)\n";
+	result += "		return std::nullopt;\n";
+	result += "\n";
+	result += "	static_cast<$Parsed &>(tree) = v.value();\n";
+	result += "	return tree;\n";
+	result += "}\n";
+
+	return result;
+}
+
+std::string generate_code(const ir::Grammar &grammar, const GenerateCodeParams &params)
+{
+	std::string result;
+
+	if (!params.optimize.passes.empty())
+	{
+		ir::Grammar optimized = grammar;
+		ir::optimize(optimized, params.optimize);
+
+		GenerateCodeParams rest = params;
+		rest.optimize.passes.clear();
+		return generate_code(optimized, rest);
+	}
+
+	// without a rule to memoize the context doesn't need to keep failed subtrees around
+	if (params.profile_data && params.memoize != MemoizeMode::None && !params.incremental)
+	{
+		const bool any = std::any_of(grammar.definitions.begin() + 1, grammar.definitions.end(), [&](const ir::Definition &d) { return should_memoize(d.name, params); });
+
+		if (!any)
+		{
+			GenerateCodeParams unmemoized = params;
+			unmemoized.memoize = MemoizeMode::None;
+			return generate_code(grammar, unmemoized);
+		}
+	}
+
+	const bool tokens = params.lexer && std::any_of(grammar.definitions.begin(), grammar.definitions.end(), [](const ir::Definition &d) { return d.token || d.skip; });
+
+	// rules on tokens have no state machine and don't record what they looked at,
+	// leaving those out would leave out entry points the caller asked for
+	if (tokens && (params.explicit_stack || params.push_parser || params.incremental))
+		throw std::invalid_argument("explicit_stack, push_parser and incremental are not available with the lexer, the grammar has @token or @skip rules");
+
+	// and have no byte level shortcuts
+	if (tokens && (params.coalesce_repetitions || params.literal_trie || params.vectorized_scan))
+	{
+		GenerateCodeParams parser = params;
+		parser.coalesce_repetitions = false;
+		parser.literal_trie = false;
+		parser.vectorized_scan = false;
+		return generate_code(grammar, parser);
+	}
+
+	// every rule call is memoized with the bytes it looked at, which scans
+	// and runs don't tell
+	if (params.incremental && (params.explicit_stack || params.memoize != MemoizeMode::Full || params.coalesce_repetitions || params.vectorized_scan))
+	{
+		GenerateCodeParams parser = params;
+		parser.explicit_stack = false;
+		parser.memoize = MemoizeMode::Full;
+		parser.coalesce_repetitions = false;
+		parser.vectorized_scan = false;
+		return generate_code(grammar, parser);
+	}
+
+	// chunks are byte ranges with a recursive context each, that count and
+	// memoize on their own
+	if (params.parallel)
+	{
+		const bool sync = std::any_of(grammar.definitions.begin(), grammar.definitions.end(), [](const ir::Definition &d) { return d.sync; });
+
+		if (!sync || tokens || params.explicit_stack || params.incremental || params.profile)
+		{
+			GenerateCodeParams parser = params;
+			parser.parallel = false;
+			return generate_code(grammar, parser);
+		}
+	}
+
+	// in UTF-8 mode a class is looked up by the bytes its members start with
+	ir::Grammar decoded;
+
+	if (params.utf8)
+	{
+		decoded = grammar;
+
+		for (size_t i = 0; i < decoded.classes.size(); ++i)
+			decoded.classes[i] = utf8_first_bytes(decoded.class_code_points[i]);
+	}
+
+	const ir::Grammar &input = params.utf8 ? decoded : grammar;
+
+	GrammarInfo info;
+	info.first_sets = compute_first_sets(input);
+
+	// reordering keeps every body in place, so the FIRST sets stay valid
+	ir::Grammar guided;
+
+	if (params.profile_data)
+	{
+		guided = input;
+
+		for (uint32_t id = 1; id < guided.size(); ++id)
+			apply_profile(guided, id, params.profile_data.value(), info.first_sets);
+	}
+
+	const ir::Grammar &g = params.profile_data ? guided : input;
+
+	info.char_classes = g.classes;
+	info.reaches_cut = find_reaches_cut(g);
+	info.incremental = params.incremental;
+
+	if (params.utf8)
+	{
+		info.utf8 = true;
+		info.class_code_points = g.class_code_points;
+	}
+
+	if (tokens)
+		info.lexer = build_lexer(g, params.utf8);
+	info.cuts = std::any_of(info.reaches_cut.begin(), info.reaches_cut.end(), [](bool v) { return v; });
+
+	if (params.profile)
+	{
+		info.alternative_base.resize(g.size());
+
+		for (uint32_t id = 1; id < g.size(); ++id)
+		{
+			const auto items = g.body(id);
+
+			if (params.literal_trie && is_literal_alternation(items))
+				continue;
+
+			info.alternative_base[id] = info.alternatives.size();
+
+			for (const auto &[begin, end] : split_alternatives(items))
+				info.alternatives.push_back({ g.definitions[id].name, alternative_key(g, items.subspan(begin, end - begin)) });
+		}
+	}
 
-	std::vector<const RuleItemGroup *> groups;
-	
-	for (const auto &rule : rules)
-		collect_groups(groups, rule.seq);
+	std::optional<vm::Program> program;
+
+	if (params.explicit_stack || params.push_parser)
+	{
+		// FIRST set guards add classes after the grammar's own
+		program = vm::compile(g);
+		info.char_classes = program->classes;
+	}
 
 	result += R"AAA(// This file is generated
 
@@ -705,10 +5112,73 @@ std::string generate_code(const std::vector<Rule> &rules, const GenerateCodePara
 #include <vector>
 #include <optional>
 #include <unordered_map>
+#include <span>
+#include <memory>
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <cstdint>
 #include <cassert>
 
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
 )AAA";
 
+	if (params.file_input)
+	{
+		result += "#ifdef _WIN32\n";
+		result += "#ifndef WIN32_LEAN_AND_MEAN\n";
+		result += "#define WIN32_LEAN_AND_MEAN\n";
+		result += "#endif\n";
+		result += "#ifndef NOMINMAX\n";
+		result += "#define NOMINMAX\n";
+		result += "#endif\n";
+		result += "#include <windows.h>\n";
+		result += "#else\n";
+		result += "#include <fcntl.h>\n";
+		result += "#include <sys/mman.h>\n";
+		result += "#include <sys/stat.h>\n";
+		result += "#include <unistd.h>\n";
+		result += "#include <cerrno>\n";
+		result += "#endif\n";
+		result += "#include <system_error>\n";
+		result += "\n";
+	}
+
+	if (params.parallel || params.batch)
+	{
+		result += "#include <thread>\n";
+		result += "#include <mutex>\n";
+		result += "#include <condition_variable>\n";
+		result += "#include <atomic>\n";
+		result += "\n";
+	}
+
+	if (params.push_parser)
+	{
+		result += "#include <coroutine>\n";
+		result += "#include <utility>\n";
+		result += "\n";
+	}
+
+	if (params.profile && !params.explicit_stack)
+	{
+		result += "#include <atomic>\n";
+		result += "#include <mutex>\n";
+		result += "#include <chrono>\n";
+		result += "#include <cstdio>\n";
+
+		if (params.profile_reentries)
+			result += "#include <unordered_set>\n";
+
+		result += "\n";
+	}
+
 	if (!params.custom_namespace.empty())
 		result += "namespace " + params.custom_namespace + "\n{\n\n";
 
@@ -716,17 +5186,13 @@ std::string generate_code(const std::vector<Rule> &rules, const GenerateCodePara
 	result += "{\n";
 	result += "	None,\n";
 
-	for (const auto &rule : rules)
-	{
-		result += "	$i_" + rule.name + ",\n";
-	}
+	for (uint32_t id = 1; id <= g.rule_count; ++id)
+		result += "	$i_" + g.definitions[id].name + ",\n";
 
 	result += "\n";
 
-	for (const auto &group : groups)
-	{
-		result += "	$i_" + group->name + ",\n";
-	}
+	for (uint32_t id = g.rule_count + 1; id < g.size(); ++id)
+		result += "	$i_" + g.definitions[id].name + ",\n";
 
 	result += "};\n";
 	result += "\n";
@@ -735,23 +5201,22 @@ std::string generate_code(const std::vector<Rule> &rules, const GenerateCodePara
 	result += "{\n";
 	result += "	\"\",\n";
 
-	for (const auto &rule : rules)
-	{
-		result += "	\"" + rule.name + "\",\n";
-	}
+	for (uint32_t id = 1; id <= g.rule_count; ++id)
+		result += "	\"" + g.definitions[id].name + "\",\n";
 
 	result += "\n";
 
-	for (const auto &group : groups)
-	{
-		result += "	\"" + group->name + "\",\n";
-	}
+	for (uint32_t id = g.rule_count + 1; id < g.size(); ++id)
+		result += "	\"" + g.definitions[id].name + "\",\n";
 
 	result += "};\n";
 	result += "\n";
 
+	result += "constexpr size_t $identifier_count = " + std::to_string(g.size()) + ";\n";
+	result += "\n";
+
 	result += R"AAA(
-enum class $ParsedType
+enum class $ParsedType : uint8_t
 {
 	Literal,
 	Identifier,
@@ -763,13 +5228,16 @@ struct $ParsedCustomData
 	virtual ~$ParsedCustomData() {}
 };
 
+// Nodes are small and trivially copyable, children live in a $Arena block.
+// Every node views the part of the input it matched, so the input buffer
+// has to outlive the tree unless the tree owns it, see $Tree::input.
 struct $Parsed
 {
 	$ParsedType type;
 	$IdentifierType identifier = $IdentifierType::None;
-	std::string literal;
-	std::vector<$Parsed> group;
-	mutable std::unique_ptr<$ParsedCustomData> custom_data;
+	std::string_view span;
+	std::span<const $Parsed> group;
+	mutable $ParsedCustomData *custom_data = nullptr;
 
 	constexpr const $Parsed *find($IdentifierType id) const
 	{
@@ -797,25 +5265,180 @@ struct $Parsed
 		return group[index];
 	}
 
-	constexpr std::string flatten() const
+	constexpr std::string_view flatten() const
+	{
+		return span;
+	}
+};
+
+// Bump allocator for child blocks. Rewinding to a mark drops every block
+// allocated after it, chunks are kept around for reuse.
+class $Arena
+{
+public:
+	struct Mark
+	{
+		size_t chunk = 0;
+		size_t used = 0;
+	};
+
+	$Arena() = default;
+	$Arena(const $Arena &) = delete;
+	$Arena &operator=(const $Arena &) = delete;
+	$Arena($Arena &&) = default;
+	$Arena &operator=($Arena &&) = default;
+
+	[[nodiscard]]
+	Mark mark() const
+	{
+		if (chunks.empty())
+			return {};
+
+		return { current, chunks[current].used };
+	}
+
+	void rewind(const Mark &m)
 	{
-		switch (type)
+		current = m.chunk;
+
+		if (!chunks.empty())
+			chunks[current].used = m.used;
+	}
+
+	void reset()
+	{
+		rewind({});
+	}
+
+	// Every node allocated and not rewound since the last reset
+	template <typename F>
+	void for_each(F &&f)
+	{
+		for (size_t i = 0; i < chunks.size() && i <= current; ++i)
 		{
-			case $ParsedType::Literal:
-				return literal;
-			case $ParsedType::Identifier:
-			case $ParsedType::Group:
-				{
-					std::string result;
+			for (size_t j = 0; j < chunks[i].used; ++j)
+				f(chunks[i].data[j]);
+		}
+	}
+
+	[[nodiscard]]
+	$Parsed *allocate(size_t count)
+	{
+		while (current < chunks.size())
+		{
+			Chunk &c = chunks[current];
 
-					for (const auto &v : group)
-						result += v.flatten();
+			if (c.size - c.used >= count)
+			{
+				$Parsed *result = c.data.get() + c.used;
+				c.used += count;
+				return result;
+			}
 
-					return result;
-				}
+			if (current + 1 == chunks.size())
+				break;
+
+			++current;
+			chunks[current].used = 0;
 		}
 
-		__assume(0);
+		size_t size = chunks.empty() ? 256 : std::min<size_t>(chunks.back().size * 2, 65536);
+		size = std::max(size, count);
+
+		chunks.push_back({ std::make_unique<$Parsed[]>(size), size, count });
+		current = chunks.size() - 1;
+
+		return chunks.back().data.get();
+	}
+
+private:
+	struct Chunk
+	{
+		std::unique_ptr<$Parsed[]> data;
+		size_t size;
+		size_t used;
+	};
+
+	std::vector<Chunk> chunks;
+	size_t current = 0;
+};
+)AAA";
+
+	if (params.incremental)
+	{
+		result += R"AAA(
+// Bytes removed at offset and replaced by inserted ones, offsets count from
+// the start of the input the previous tree was parsed from
+struct $Edit
+{
+	size_t offset = 0;
+	size_t removed = 0;
+	size_t inserted = 0;
+
+	// One edit covering this one followed by next
+	[[nodiscard]]
+	$Edit then(const $Edit &next) const
+	{
+		const size_t first = std::min(offset, next.offset);
+		const size_t last = std::max(offset + inserted, next.offset + next.removed);
+
+		return { first, last - inserted + removed - first, last - next.removed + next.inserted - first };
+	}
+};
+
+// A rule call at some offset: what it gave, where it ended and one past the
+// furthest byte it looked at
+struct $Memo
+{
+	std::optional<$Parsed> parsed;
+	size_t end;
+	size_t reach;
+
+	// parsed is the node of that call in the tree, without its children,
+	// when the call was carried over from a previous tree
+	bool in_tree;
+};
+)AAA";
+	}
+
+	result += R"AAA(
+// Result of an entry point, owns every node below the root
+struct $Tree : $Parsed
+{
+	$Arena arena;
+	mutable std::vector<std::unique_ptr<$ParsedCustomData>> custom_data_storage;
+
+	// The input, when the entry point owns it, like a mapped file
+	std::shared_ptr<const void> input;
+)AAA";
+
+	if (params.parallel)
+	{
+		result += R"AAA(
+	// Child blocks of the chunks parsed on a $ThreadPool
+	std::vector<$Arena> arenas;
+)AAA";
+	}
+
+	if (params.incremental)
+	{
+		result += R"AAA(
+	// Every rule call by memo key, what $reparse_ entry points take subtrees
+	// from: the ones the parse made and, in key order, the ones it carried over
+	// from the previous tree
+	std::unordered_map<size_t, $Memo> memo;
+	std::vector<std::pair<size_t, $Memo>> carried;
+	uintptr_t memo_base = 0;
+	size_t memo_end = 0;
+)AAA";
+	}
+
+	result += R"AAA(
+
+	void set_custom_data(const $Parsed &p, std::unique_ptr<$ParsedCustomData> data) const
+	{
+		p.custom_data = data.get();
+		custom_data_storage.push_back(std::move(data));
 	}
 };
 
@@ -830,7 +5453,6 @@ std::optional<$Parsed> $parse_literal(const char *&s, const char *e, const std::
 {
 	$Parsed result;
 	result.type = $ParsedType::Literal;
-	result.literal = lit;
 
 	if ($is_eof(s, e))
 		return std::nullopt;
@@ -846,6 +5468,7 @@ std::optional<$Parsed> $parse_literal(const char *&s, const char *e, const std::
 			return std::nullopt;
 	}
 
+	result.span = std::string_view(s, lit.size());
 	s = s + lit.size();
 
 	return result;
@@ -879,11 +5502,52 @@ std::optional<$Parsed> $parse_negate_literal(const char *&s, const char *e, cons
 			return std::nullopt;
 	}
 
-	result.literal = std::string(1, *s);
+	result.span = std::string_view(s, 1);
 	++s;
 	return result;
 }
 
+[[nodiscard]]
+$Parsed $literal_node(const char *s, size_t size)
+{
+	$Parsed result;
+	result.type = $ParsedType::Literal;
+	result.span = std::string_view(s, size);
+	return result;
+}
+
+// Set of bytes, one bit each
+struct $CharClass
+{
+	uint64_t bits[4];
+
+	[[nodiscard]]
+	constexpr bool contains(char c) const
+	{
+		return (bits[(uint8_t)c >> 6] >> ((uint8_t)c & 63)) & 1;
+	}
+};
+
+[[nodiscard]]
+std::optional<$Parsed> $parse_class(const char *&s, const char *e, const $CharClass &cls)
+{
+	if ($is_eof(s, e) || !cls.contains(*s))
+		return std::nullopt;
+
+	++s;
+	return $literal_node(s - 1, 1);
+}
+
+// End of the run of class members starting at s
+[[nodiscard]]
+const char *$scan_class(const char *s, const char *e, const $CharClass &cls)
+{
+	while (s != e && cls.contains(*s))
+		++s;
+
+	return s;
+}
+
 namespace helpers
 {
 
@@ -929,7 +5593,7 @@ std::string _generate_graphviz_ids(const $Parsed &p, std::unordered_map<const $P
 	{
 		case $ParsedType::Literal:
 			{
-				result += std::string("\ta") + std::to_string(id) + "[label=\"" + p.literal + "\" shape=ellipse];\n";
+				result += std::string("\ta") + std::to_string(id) + "[label=\"" + std::string(p.span) + "\" shape=ellipse];\n";
 				break;
 			}
 		case $ParsedType::Identifier:
@@ -1008,7 +5672,7 @@ std::string generate_tree(const $Parsed &p, size_t align = 0)
 	std::string result;
 
 	if (p.type == $ParsedType::Literal)
-		result += std::string(align, ' ') + "'" + p.literal + "'\n";
+		result += std::string(align, ' ') + "'" + std::string(p.span) + "'\n";
 	else
 		result += std::string(align, ' ') + table_$IdentifierType[(int)p.identifier] + "\n";
 
@@ -1036,7 +5700,7 @@ std::string ansii_colored(const $Parsed &v, const std::unordered_map<std::string
 	switch (v.type)
 	{
 		case $ParsedType::Literal:
-			result += v.literal;
+			result += v.span;
 			break;
 
 		case $ParsedType::Identifier:
@@ -1061,32 +5725,232 @@ std::string ansii_colored(const $Parsed &v, const std::unordered_map<std::string
 
 	result += "\n";
 
-	for (const auto &rule : rules)
+	if (params.vectorized_scan || params.utf8)
+	{
+		result += generate_cpu_features();
+		result += "\n";
+	}
+
+	if (params.utf8)
+	{
+		result += generate_utf8();
+		result += "\n";
+	}
+
+	for (size_t i = 0; i < info.char_classes.size(); ++i)
+	{
+		const auto &bits = info.char_classes[i];
+
+		uint64_t words[4] = {};
+
+		for (size_t c = 0; c < 256; ++c)
+		{
+			if (bits.test(c))
+				words[c / 64] |= (uint64_t)1 << (c % 64);
+		}
+
+		const std::string name = info.char_class_name((uint32_t)i);
+		const std::string table = "{ { " + to_hex(words[0]) + ", " + to_hex(words[1]) + ", " + to_hex(words[2]) + ", " + to_hex(words[3]) + " } }";
+
+		if (info.unicode_class((uint32_t)i))
+		{
+			const auto &code_points = info.class_code_points[i];
+
+			std::string ranges;
+
+			for (const auto &r : code_points)
+			{
+				if (r.last >= 0x80)
+					ranges += std::string(ranges.empty() ? "" : ", ") + "{ " + to_hex(std::max<char32_t>(r.first, 0x80)) + ", " + to_hex(r.last) + " }";
+			}
+
+			result += "// " + dump_class(code_points) + "\n";
+			result += "constexpr $CodePointRange " + name + "_ranges[] { " + ranges + " };\n";
+			result += "constexpr $UnicodeClass " + name + " { " + table + ", " + name + "_ranges, std::size(" + name + "_ranges) };\n";
+		}
+		else
+		{
+			result += "// " + dump_class(bits) + "\n";
+			result += "constexpr $CharClass " + name + " " + table + ";\n";
+		}
+	}
+
+	if (!info.char_classes.empty())
+		result += "\n";
+
+	if (params.vectorized_scan)
+	{
+		result += generate_scanners();
+		result += "\n";
+	}
+
+	if (params.file_input)
+	{
+		result += generate_mapped_file();
+		result += "\n";
+	}
+
+	if (params.parallel || params.batch)
+	{
+		result += generate_thread_pool();
+		result += "\n";
+	}
+
+	if (params.batch && !params.explicit_stack)
+	{
+		result += generate_batch(false);
+		result += "\n";
+	}
+
+	if (params.explicit_stack)
+	{
+		result += generate_machine_context(info.cuts, params.push_parser);
+		result += "\n";
+
+		if (params.batch)
+		{
+			result += generate_batch(true);
+			result += "\n";
+		}
+
+		result += generate_machine(program.value(), info, false);
+		result += "\n";
+
+		if (params.push_parser)
+			result += generate_push(g, program.value(), info);
+
+		for (uint32_t id = 1; id < g.size(); ++id)
+		{
+			if (g.definitions[id].transparent)
+				continue;
+
+			result += generate_machine_entry_point(g.definitions[id].name, program->entry[id], params.utf8);
+			result += "\n";
+
+			if (params.batch)
+			{
+				result += generate_batch_entry_point(g.definitions[id].name, generate_batch_document(g.definitions[id].name, params.utf8, false, program->entry[id]));
+				result += "\n";
+			}
+
+			if (params.file_input)
+			{
+				result += generate_file_entry_point(g.definitions[id].name);
+				result += "\n";
+			}
+		}
+
+		if (!params.custom_namespace.empty())
+			result += "\n\n} // namespace " + params.custom_namespace + "\n";
+
+		return result;
+	}
+
+	result += generate_input(info);
+	result += "\n";
+	result += generate_context(params, info);
+
+	result += "\n";
+
+	if (params.parallel)
+	{
+		result += generate_parallel(params.utf8);
+		result += "\n";
+	}
+
+	if (params.profile)
+	{
+		result += generate_profile(info, params);
+		result += "\n";
+	}
+
+	// the lexer matches tokens, they get no functions
+	auto parsed = [&](uint32_t id) {
+		return !info.lexer || !g.lexed(id);
+	};
+
+	for (uint32_t id = 1; id <= g.rule_count; ++id)
+	{
+		if (parsed(id))
+			result += "[[nodiscard]] std::optional<$Parsed> $parse_" + g.definitions[id].name + "($Context &ctx, $Pos &s, $Pos e);\n";
+	}
+
+	result += "\n";
+
+	for (uint32_t id = g.rule_count + 1; id < g.size(); ++id)
 	{
-		result += "[[nodiscard]] std::optional<$Parsed> $parse_" + rule.name + "(const char *&s, const char *e);\n";
+		if (parsed(id))
+			result += "[[nodiscard]] std::optional<$Parsed> $parse_" + g.definitions[id].name + "($Context &ctx, $Pos &s, $Pos e);\n";
 	}
 
 	result += "\n";
 
-	for (const auto &group : groups)
+	for (uint32_t id = 1; id <= g.rule_count; ++id)
 	{
-		result += "[[nodiscard]] std::optional<$Parsed> $parse_" + group->name + "(const char *&s, const char *e);\n";
+		if (!parsed(id))
+			continue;
+
+		result += generate_rule(g, id, params, info);
+		result += "\n";
 	}
 
 	result += "\n";
 
-	for (const auto &rule : rules)
+	for (uint32_t id = g.rule_count + 1; id < g.size(); ++id)
 	{
-		result += generate_rule(rule.seq, rule.name, "Identifier");
+		if (!parsed(id))
+			continue;
+
+		result += generate_rule(g, id, params, info);
 		result += "\n";
 	}
 
 	result += "\n";
 
-	for (const auto &group : groups)
+	for (uint32_t id = 1; id < g.size(); ++id)
+	{
+		if (g.definitions[id].transparent || !parsed(id))
+			continue;
+
+		result += info.lexer ? generate_token_entry_point(g.definitions[id].name, params.utf8) : generate_entry_point(g.definitions[id].name, params.utf8, params.incremental);
+		result += "\n";
+
+		if (params.incremental)
+		{
+			result += generate_entry_point(g.definitions[id].name, params.utf8, true, true);
+			result += "\n";
+		}
+
+		if (params.parallel)
+		{
+			result += generate_entry_point(g.definitions[id].name, params.utf8, false, false, true);
+			result += "\n";
+		}
+
+		if (params.batch)
+		{
+			result += generate_batch_entry_point(g.definitions[id].name, generate_batch_document(g.definitions[id].name, params.utf8, info.lexer.has_value()));
+			result += "\n";
+		}
+
+		if (params.file_input)
+		{
+			result += generate_file_entry_point(g.definitions[id].name);
+			result += "\n";
+		}
+
+		if (params.file_input && params.parallel)
+		{
+			result += generate_file_entry_point(g.definitions[id].name, true);
+			result += "\n";
+		}
+	}
+
+	if (params.push_parser)
 	{
-		result += generate_rule(group->seq, group->name, "Group");
+		result += generate_machine_context(info.cuts, true);
 		result += "\n";
+		result += generate_push(g, program.value(), info);
 	}
 
 	if (!params.custom_namespace.empty())
@@ -1095,6 +5959,11 @@ std::string ansii_colored(const $Parsed &v, const std::unordered_map<std::string
 	return result;
 }
 
+std::string generate_code(const std::vector<Rule> &rules, const GenerateCodeParams &params)
+{
+	return generate_code(ir::lower(rules), params);
+}
+
 
 } // namespace helpers
 
@@ -5,6 +5,9 @@
 #include <vector>
 #include <optional>
 #include <unordered_map>
+#include <bitset>
+#include <span>
+#include <memory>
 
 
 namespace pgen
@@ -25,6 +28,19 @@ enum class RuleItemType
 	OneOrMore,
 	ZeroOrOne,
 	Negate,
+	CharClass,
+
+	// `~`, commits the enclosing rule or group to the alternative it is in
+	Cut,
+};
+
+// Inclusive range of code points
+struct CodePointRange
+{
+	char32_t first = 0;
+	char32_t last = 0;
+
+	bool operator==(const CodePointRange &other) const = default;
 };
 
 struct RuleItemGroup
@@ -40,6 +56,12 @@ struct RuleItem
 	std::string literal;
 	std::string identifier;
 	RuleItemGroup group;
+	std::bitset<256> char_class;
+
+	// What a class matches in UTF-8 mode, sorted and disjoint, surrogates left
+	// out. char_class is what it matches byte by byte: raw text and `\u{e9}` in
+	// a class are the bytes of their encoding there, `\xe9` is U+00E9 here.
+	std::vector<CodePointRange> code_points;
 
 	bool optional = false;
 	bool multiple = false;
@@ -50,8 +72,194 @@ struct Rule
 {
 	std::string name;
 	std::vector<RuleItem> seq;
+
+	// `@token` rules are matched by the generated lexer, `@skip` ones too but
+	// left out of the token stream
+	bool token = false;
+	bool skip = false;
+
+	// `@sync` rules start at points a parallel parse may split the input at,
+	// see GenerateCodeParams::parallel
+	bool sync = false;
+};
+
+// Flat form of a grammar that analysis and code generation work on
+namespace ir
+{
+
+
+enum class NodeType : uint8_t
+{
+	Literal,   // literals[value]
+	CharClass, // classes[value]
+	Reference, // definitions[value], a rule
+	Group,     // definitions[value], a group
+	Or,
+	Cut,
+};
+
+// One item of a body
+struct Node
+{
+	NodeType type = NodeType::Literal;
+	bool optional = false;
+	bool multiple = false;
+	bool negate = false;
+	uint32_t value = 0;
+};
+
+// A rule or a group. Its items are nodes[begin, end), '|' separated.
+struct Definition
+{
+	std::string name;
+	uint32_t begin = 0;
+	uint32_t end = 0;
+
+	// definition a group is nested in, 0 for rules
+	uint32_t parent = 0;
+	bool group = false;
+
+	// no node of its own, the children of a match go to the caller's node
+	bool transparent = false;
+
+	// rules only, as in Rule
+	bool token = false;
+	bool skip = false;
+	bool sync = false;
 };
 
+// Definitions are numbered like the generated $IdentifierType: 0 is none, then
+// the rules, then the groups. lower() numbers groups in the order they appear,
+// passes append the ones they add. Literals and classes are stored once however
+// often they are used.
+struct Grammar
+{
+	std::vector<Definition> definitions;
+	std::vector<Node> nodes;
+	std::vector<std::string> literals;
+	std::vector<std::bitset<256>> classes;
+	uint32_t rule_count = 0;
+
+	// code points of classes[i], as in RuleItem
+	std::vector<std::vector<CodePointRange>> class_code_points;
+
+	std::span<const Node> body(uint32_t id) const
+	{
+		const auto &d = definitions[id];
+		return { nodes.data() + d.begin, d.end - d.begin };
+	}
+
+	uint32_t size() const
+	{
+		return (uint32_t)definitions.size();
+	}
+
+	// The rule a group is nested in, a rule itself
+	uint32_t rule_of(uint32_t id) const
+	{
+		while (definitions[id].parent != 0)
+			id = definitions[id].parent;
+
+		return id;
+	}
+
+	bool lexed(uint32_t id) const
+	{
+		const Definition &d = definitions[rule_of(id)];
+		return d.token || d.skip;
+	}
+};
+
+// Throws when a rule references an undefined one
+Grammar lower(const std::vector<Rule> &rules);
+
+// Rewrites that keep the language of every rule. Trees change only as noted.
+enum class Pass
+{
+	// References to rules made of a single item, like `digit: [0-9]` or
+	// `value: expr`, are replaced by that item; the rule's node is left out.
+	// Annotated rules are kept.
+	InlineRules,
+
+	// Adjacent alternatives sharing leading items, `p a | p b`, become
+	// `p (a | b)` with a transparent group, so p is matched once. Alternatives
+	// with a cut are left as they are.
+	LeftFactor,
+
+	// Adjacent plain literals, `"<" "="`, become one; so do their leaves.
+	// With @token rules only those are merged, elsewhere a literal is a token.
+	MergeLiterals,
+
+	// Drops rules not reachable from the roots, and groups no longer used.
+	// @skip rules are always kept.
+	RemoveUnreachable,
+};
+
+struct PassOptions
+{
+	// run in this order, a pass may be listed more than once
+	std::vector<Pass> passes;
+
+	// rules InlineRules leaves alone, so their nodes stay in the tree;
+	// @token and @skip rules always are
+	std::vector<std::string> keep;
+
+	// rules RemoveUnreachable starts from, empty for all of them
+	std::vector<std::string> roots;
+};
+
+void inline_rules(Grammar &grammar, const std::vector<std::string> &keep);
+void left_factor(Grammar &grammar);
+void merge_literals(Grammar &grammar);
+void remove_unreachable(Grammar &grammar, const std::vector<std::string> &roots);
+
+void optimize(Grammar &grammar, const PassOptions &options);
+
+
+} // namespace ir
+
+enum class ParseErrorKind
+{
+	ExpectedRuleName,
+	ExpectedColon,
+	ExpectedItem,
+	UnterminatedString,
+	UnterminatedGroup,
+	InvalidCharClass,
+	InvalidNegation,
+	EmptyRule,
+	DuplicateRule,
+	UndefinedRule,
+	UnknownAnnotation,
+};
+
+struct ParseError
+{
+	ParseErrorKind kind = ParseErrorKind::ExpectedItem;
+
+	// where in the grammar source, line and column count from 1
+	size_t offset = 0;
+	size_t line = 0;
+	size_t column = 0;
+
+	// the rule an EmptyRule, DuplicateRule or UndefinedRule is about
+	std::string name;
+
+	// "line:column: what went wrong"
+	std::string message() const;
+};
+
+// Either the grammar, as rules and in flat form, or an error
+struct ParseResult
+{
+	std::vector<Rule> rules;
+	ir::Grammar grammar;
+	std::optional<ParseError> error;
+};
+
+ParseResult try_parse(const char *str, size_t size);
+
+// Same as try_parse, but throws the ParseError when the grammar has one
 std::vector<Rule> parse(const char *str, size_t size);
 
 
@@ -64,17 +272,289 @@ std::string dump(const RuleItemGroup &group);
 std::string dump(const RuleItem &ruleitem);
 std::string dump(const Rule &rule);
 std::string dump(const std::vector<Rule> &rules);
+std::string dump_class(const std::bitset<256> &bits);
+std::string dump_class(const std::vector<CodePointRange> &code_points);
+
+// Items in the same notation as dump(seq)
+std::string dump(const ir::Grammar &grammar, std::span<const ir::Node> items);
+std::string dump(const ir::Grammar &grammar);
+
+// Counts of a representative run, read from the generated helpers::profile_dump()
+struct RuleProfile
+{
+	uint64_t calls = 0;
+
+	// calls at an offset the rule was already tried at during the same parse,
+	// none when the run didn't count them, see GenerateCodeParams::profile_reentries
+	std::optional<uint64_t> reentries;
+
+	// successes per alternative, keyed by the dump() of its items
+	std::unordered_map<std::string, uint64_t> alternatives;
+};
+
+using ProfileData = std::unordered_map<std::string, RuleProfile>;
+
+enum class ProfileErrorKind
+{
+	ExpectedWord,
+	ExpectedNumber,
+	UnknownLine,
+};
+
+struct ProfileError
+{
+	ProfileErrorKind kind = ProfileErrorKind::ExpectedWord;
+
+	// where in the profile, line and column count from 1
+	size_t offset = 0;
+	size_t line = 0;
+	size_t column = 0;
+
+	// "line:column: what went wrong"
+	std::string message() const;
+};
+
+// Either the counts or the line they stopped at, like ParseResult
+struct ProfileResult
+{
+	ProfileData data;
+	std::optional<ProfileError> error;
+};
+
+ProfileResult parse_profile(const char *str, size_t size);
+
+enum class MemoizeMode
+{
+	None,
+	Full,
+	FailuresOnly,
+};
 
 struct GenerateCodeParams
 {
 	std::string custom_namespace;
+
+	// Packrat memoization of rule/group results keyed by (id, offset).
+	// FailuresOnly keeps just a bitset of failed attempts, grown up to the
+	// furthest one instead of sized for the whole input.
+	MemoizeMode memoize = MemoizeMode::None;
+
+	// Skip alternatives whose FIRST set does not contain the next byte
+	bool first_set_dispatch = true;
+
+	// Run "x"^* and "x"^+ with SSE2/AVX2 byte search instead of one call per byte
+	bool vectorized_scan = true;
+
+	// Collapse repetitions of literals and literal-only groups, like "x"^* or
+	// ("a" | "b")+, into one literal node spanning the whole run
+	bool coalesce_repetitions = false;
+
+	// Match rules made only of literal alternatives with a generated trie
+	bool literal_trie = true;
+
+	// Emit one iterative state machine, compiled from the vm program, instead
+	// of a recursive function per rule. Calls and pending alternatives live on
+	// heap stacks, so nesting depth is bounded by memory, not by the native stack.
+	// memoize, coalesce_repetitions and profile are not applied in this mode.
+	bool explicit_stack = false;
+
+	// Count calls, successes, failed alternatives, consumed bytes and ticks of
+	// every rule in thread local counters, helpers::profile_report() sums them up
+	bool profile = false;
+
+	// With profile, also count calls at an offset the rule was already tried at.
+	// Every parse keeps the (offset, rule) pairs it tried in a hash set for that,
+	// so it is off unless asked for; profile_data needs it to choose what to memoize.
+	bool profile_reentries = false;
+
+	// Passes run on the grammar before anything is generated, none by default
+	ir::PassOptions optimize;
+
+	// Match @token and @skip rules with one table driven DFA, longest match
+	// first, and run the other rules on the resulting tokens. Only applies to
+	// grammars that have such rules; generate_code throws std::invalid_argument
+	// for explicit_stack, push_parser or incremental on them.
+	bool lexer = true;
+
+	// Read the input as UTF-8: "x"^ and classes match whole code points, see
+	// RuleItem::code_points. Entry points validate the input first and parse
+	// only up to the first invalid sequence. ASCII takes the byte paths.
+	bool utf8 = false;
+
+	// Keep every rule call of a parse in the $Tree, with where it ended and how
+	// far it looked, and emit $reparse_<rule>(previous, edit, s, e). After an
+	// $Edit it takes over the calls of the previous tree that looked only at
+	// bytes outside the edit, copying their subtrees, and parses the rest. The
+	// calls those made are kept too, so the next edit can reuse them in turn.
+	// Implies memoize Full without vectorized_scan, coalesce_repetitions and
+	// explicit_stack; not available with the lexer.
+	bool incremental = false;
+
+	// Also emit $push_<rule>(), a $PushParser that takes the input in chunks.
+	// It runs the state machine of explicit_stack as a C++20 coroutine that
+	// waits for the next chunk when an instruction needs bytes not fed yet.
+	// Not available with the lexer, like explicit_stack.
+	bool push_parser = false;
+
+	// Also emit $parse_file_<rule>(path, consumed, error), which maps the file
+	// read-only and parses it in place. The resulting $Tree keeps the mapping
+	// alive, so its spans view the file without a copy. A file that can't be
+	// opened or mapped, or isn't a regular file, gives nullopt with *error set
+	// and *consumed 0; *error is clear when the file was read. Truncating the
+	// file while it is mapped is undefined, as with any mapping.
+	bool file_input = false;
+
+	// Also emit $parse_<rule>(s, e, pool), where repetitions of a @sync rule,
+	// like `record*`, are split into chunks that run on a $ThreadPool. Each
+	// chunk matches the rule from its first match past the chunk's offset on;
+	// its matches are taken from where they line up with the ones before,
+	// anything else is parsed again in order. Needs a @sync rule; not
+	// available with explicit_stack, incremental, profile or on tokens.
+	bool parallel = false;
+
+	// Also emit $parse_batch_<rule>(inputs, pool, visit), which parses many
+	// documents on a $ThreadPool. A thread parses into one arena it resets for
+	// every document, so visit(index, tree) only gets a tree while it runs, on
+	// the thread that parsed it. Returns a $BatchStatus per input, in order.
+	bool batch = false;
+
+	// Tune for a recorded profile: alternatives with disjoint FIRST sets are
+	// tried in order of measured successes, and memoize only applies to rules
+	// that were re-entered at the same offset, all of them when the profile has
+	// no re-entry counts
+	std::optional<ProfileData> profile_data;
 };
 
+std::string generate_code(const ir::Grammar &grammar, const GenerateCodeParams &params);
 std::string generate_code(const std::vector<Rule> &rules, const GenerateCodeParams &params);
 
 
 } // namespace helpers
 
 
+// Runs grammars in process, without generating and compiling code
+namespace vm
+{
+
+
+enum class Op : uint8_t
+{
+	Literal,       // match literals[arg]
+	NegateLiteral, // match one byte unless literals[arg] starts here
+	CharClass,     // match one byte of classes[arg]
+	LiteralSet,    // match the first of literal_sets[arg] that fits
+	Call,          // match rule/group arg
+	Return,        // finish the node of the current call
+	Splice,        // finish a transparent call, its children stay with the caller
+	Choice,        // on failure resume at target
+	Commit,        // drop the choice, jump to target
+	PartialCommit, // move the choice to the current position, jump to target
+	TestSet,       // jump to target unless the next byte is in classes[arg]
+	Cut,           // drop the choice of the current alternative if arg is 1
+	Fail,
+	End,
+};
+
+struct Instruction
+{
+	Op op;
+	uint32_t arg = 0;
+	uint32_t target = 0;
+};
+
+// Identifiers are numbered like the generated $IdentifierType:
+// 0 is none, then the rules, then the groups.
+struct Program
+{
+	std::vector<Instruction> code;
+	std::vector<uint32_t> entry;
+	std::vector<std::string> names;
+	uint32_t rule_count = 0;
+
+	std::vector<std::string> literals;
+	std::vector<std::vector<uint32_t>> literal_sets;
+	std::vector<std::bitset<256>> classes;
+
+	std::optional<uint32_t> find(std::string_view name) const;
+};
+
+Program compile(const ir::Grammar &grammar);
+Program compile(const std::vector<Rule> &rules);
+
+std::string disassemble(const Program &program);
+
+enum class NodeType : uint8_t
+{
+	Literal,
+	Identifier,
+	Group,
+};
+
+// Same shape as the generated $Parsed
+struct Node
+{
+	NodeType type = NodeType::Literal;
+	uint32_t identifier = 0;
+	std::string_view span;
+	std::span<const Node> group;
+
+	const Node *find(uint32_t id) const;
+
+	size_t size() const
+	{
+		return group.size();
+	}
+
+	const Node &get(size_t index) const
+	{
+		return group[index];
+	}
+
+	std::string_view flatten() const
+	{
+		return span;
+	}
+};
+
+// Chunked storage of child blocks, rewinding keeps the chunks for reuse
+class NodeArena
+{
+public:
+	struct Mark
+	{
+		size_t chunk = 0;
+		size_t used = 0;
+	};
+
+	Mark mark() const;
+	void rewind(const Mark &m);
+	Node *allocate(size_t count);
+
+private:
+	struct Chunk
+	{
+		std::unique_ptr<Node[]> data;
+		size_t size;
+		size_t used;
+	};
+
+	std::vector<Chunk> chunks;
+	size_t current = 0;
+};
+
+// Root node owning every node below it; spans view the input
+struct Tree : Node
+{
+	NodeArena arena;
+};
+
+std::optional<Tree> run(const Program &program, uint32_t rule, const char *&s, const char *e);
+
+std::string dump_tree(const Program &program, const Node &node, size_t align = 0);
+
+
+} // namespace vm
+
+
 } // namespace pgen
 
@@ -0,0 +1,1224 @@
+#pragma once
+
+#include "pgen.hpp"
+
+#include <array>
+#include <algorithm>
+#include <cstring>
+
+
+namespace pgen
+{
+
+
+// Grammars parsed during compilation. Parser<"value: ...">::parse<"value">(s, e)
+// runs matchers instantiated from the grammar itself, no code is generated.
+// Errors in the grammar are compile errors pointing at the throw that found them.
+namespace ct
+{
+
+
+template <size_t N>
+struct FixedString
+{
+	char data[N] = {};
+
+	constexpr FixedString(const char (&str)[N])
+	{
+		std::copy_n(str, N, data);
+	}
+
+	constexpr std::string_view view() const
+	{
+		return { data, N - 1 };
+	}
+};
+
+// Set of bytes, one bit each
+struct CharClass
+{
+	uint64_t bits[4] = {};
+
+	constexpr void set(uint8_t c)
+	{
+		bits[c >> 6] |= (uint64_t)1 << (c & 63);
+	}
+
+	constexpr void flip()
+	{
+		for (auto &v : bits)
+			v = ~v;
+	}
+
+	constexpr bool contains(char c) const
+	{
+		return (bits[(uint8_t)c >> 6] >> ((uint8_t)c & 63)) & 1;
+	}
+
+	constexpr bool all() const
+	{
+		return (bits[0] & bits[1] & bits[2] & bits[3]) == ~(uint64_t)0;
+	}
+
+	constexpr CharClass &operator|=(const CharClass &other)
+	{
+		for (size_t i = 0; i < 4; ++i)
+			bits[i] |= other.bits[i];
+
+		return *this;
+	}
+
+	constexpr bool operator==(const CharClass &other) const = default;
+};
+
+// Bytes a match can start with, and whether it can match nothing at all
+struct FirstSet
+{
+	CharClass bytes;
+	bool nullable = false;
+
+	constexpr bool operator==(const FirstSet &other) const = default;
+};
+
+// Same meaning as ir::Node, a literal is literals[value, value + size)
+struct Node
+{
+	ir::NodeType type = ir::NodeType::Literal;
+	bool optional = false;
+	bool multiple = false;
+	bool negate = false;
+	uint32_t value = 0;
+	uint32_t size = 0;
+};
+
+// Numbered like ir::Definition, the name is names[name, name + name_size)
+struct Definition
+{
+	uint32_t name = 0;
+	uint32_t name_size = 0;
+	uint32_t begin = 0;
+	uint32_t end = 0;
+	bool group = false;
+};
+
+template <size_t Definitions, size_t Nodes, size_t Literals, size_t Names, size_t Classes>
+struct Grammar
+{
+	std::array<Definition, Definitions> definitions;
+	std::array<Node, Nodes> nodes;
+	std::array<char, Literals> literals;
+	std::array<char, Names> names;
+	std::array<CharClass, Classes> classes;
+	std::array<FirstSet, Definitions> first;
+	uint32_t rule_count = 0;
+
+	constexpr std::string_view name(uint32_t id) const
+	{
+		return { names.data() + definitions[id].name, definitions[id].name_size };
+	}
+
+	constexpr std::string_view literal(const Node &node) const
+	{
+		return { literals.data() + node.value, node.size };
+	}
+
+	constexpr FirstSet first_set(const Node &node) const
+	{
+		FirstSet result;
+
+		switch (node.type)
+		{
+			case ir::NodeType::Literal:
+				{
+					const std::string_view lit = literal(node);
+
+					if (node.negate)
+					{
+						// "x"^ takes any byte but 'x', "xy"^ any byte at all
+						if (!lit.empty())
+							result.bytes.flip();
+
+						if (lit.size() == 1)
+							result.bytes.bits[(uint8_t)lit[0] >> 6] &= ~((uint64_t)1 << ((uint8_t)lit[0] & 63));
+					}
+					else
+					{
+						if (lit.empty())
+							result.nullable = true;
+						else
+							result.bytes.set((uint8_t)lit[0]);
+					}
+				}
+				break;
+			case ir::NodeType::CharClass:
+				result.bytes = classes[node.value];
+				break;
+			case ir::NodeType::Reference:
+			case ir::NodeType::Group:
+				result = first[node.value];
+				break;
+			case ir::NodeType::Cut:
+				result.nullable = true;
+				break;
+			default:
+				break;
+		}
+
+		if (node.optional)
+			result.nullable = true;
+
+		return result;
+	}
+
+	// Of the sequence nodes[begin, end)
+	constexpr FirstSet first_set(uint32_t begin, uint32_t end) const
+	{
+		FirstSet result;
+		result.nullable = true;
+
+		for (uint32_t i = begin; i < end && result.nullable; ++i)
+		{
+			// a cut reached without taking a byte can fail the definition
+			if (nodes[i].type == ir::NodeType::Cut)
+				break;
+
+			const FirstSet item = first_set(nodes[i]);
+			result.bytes |= item.bytes;
+			result.nullable = item.nullable;
+		}
+
+		return result;
+	}
+
+	constexpr uint32_t find(std::string_view rule) const
+	{
+		for (uint32_t id = 1; id <= rule_count; ++id)
+		{
+			if (name(id) == rule)
+				return id;
+		}
+
+		throw ParseErrorKind::UndefinedRule;
+	}
+};
+
+
+namespace detail
+{
+
+
+// The front end of pgen.cpp over constexpr vectors and strings
+
+constexpr bool is_whitespace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+constexpr bool is_identifier(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+constexpr uint8_t hex2num(char c)
+{
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= '0' && c <= '9')
+		return c - '0';
+
+	return 0;
+}
+
+constexpr std::string encode_utf8(char32_t c)
+{
+	if (c < 0x80)
+		return std::string(1, (char)c);
+
+	if (c < 0x800)
+		return { (char)(0xC0 | c >> 6), (char)(0x80 | (c & 0x3F)) };
+
+	if (c < 0x10000)
+		return { (char)(0xE0 | c >> 12), (char)(0x80 | (c >> 6 & 0x3F)), (char)(0x80 | (c & 0x3F)) };
+
+	return { (char)(0xF0 | c >> 18), (char)(0x80 | (c >> 12 & 0x3F)), (char)(0x80 | (c >> 6 & 0x3F)), (char)(0x80 | (c & 0x3F)) };
+}
+
+// Size of the valid UTF-8 sequence at s, 0 if there is none
+constexpr size_t utf8_sequence(const char *s, const char *e)
+{
+	const uint8_t b = (uint8_t)*s;
+
+	if (b < 0x80)
+		return 1;
+
+	const size_t size = b >= 0xC2 && b <= 0xDF ? 2 : b >= 0xE0 && b <= 0xEF ? 3 : b >= 0xF0 && b <= 0xF4 ? 4 : 0;
+
+	if (size == 0 || (size_t)(e - s) < size)
+		return 0;
+
+	const uint8_t c = (uint8_t)s[1];
+	const uint8_t min = b == 0xE0 ? 0xA0 : b == 0xF0 ? 0x90 : 0x80;
+	const uint8_t max = b == 0xED ? 0x9F : b == 0xF4 ? 0x8F : 0xBF;
+
+	if (c < min || c > max)
+		return 0;
+
+	for (size_t i = 2; i < size; ++i)
+	{
+		if (((uint8_t)s[i] & 0xC0) != 0x80)
+			return 0;
+	}
+
+	return size;
+}
+
+constexpr std::string to_string(size_t v)
+{
+	std::string result;
+
+	do
+	{
+		result.insert(result.begin(), (char)('0' + v % 10));
+		v /= 10;
+	}
+	while (v != 0);
+
+	return result;
+}
+
+struct ParsedDefinition
+{
+	std::string name;
+	std::vector<Node> items;
+};
+
+// Groups are counted from 0 and references point into `references` until resolve()
+struct ParsedGrammar
+{
+	std::vector<ParsedDefinition> rules;
+	std::vector<ParsedDefinition> groups;
+	std::vector<std::string> references;
+	std::string literals;
+	std::vector<CharClass> classes;
+	size_t names = 0;
+};
+
+class Parser
+{
+public:
+	constexpr explicit Parser(std::string_view text)
+		: s(text.data())
+		, e(text.data() + text.size())
+	{
+	}
+
+	constexpr ParsedGrammar parse()
+	{
+		skip_whitespace();
+
+		while (s != e)
+		{
+			if (*s == '#')
+			{
+				while (s != e && *s != '\n')
+					++s;
+
+				skip_whitespace();
+				continue;
+			}
+
+			parse_rule();
+			skip_whitespace();
+		}
+
+		resolve();
+
+		return std::move(result);
+	}
+
+private:
+	const char *s;
+	const char *e;
+
+	ParsedGrammar result;
+
+	constexpr void skip_whitespace()
+	{
+		while (s != e && is_whitespace(*s))
+			++s;
+	}
+
+	constexpr bool parse_newline()
+	{
+		if (s != e && *s == '\n')
+		{
+			++s;
+			return true;
+		}
+
+		if (e - s >= 2 && s[0] == '\r' && s[1] == '\n')
+		{
+			s += 2;
+			return true;
+		}
+
+		return false;
+	}
+
+	constexpr bool parse_two_newlines()
+	{
+		const char *start = s;
+
+		if (parse_newline() && parse_newline())
+			return true;
+
+		s = start;
+		return false;
+	}
+
+	constexpr std::string parse_name()
+	{
+		const char *start = s;
+
+		while (s != e && is_identifier(*s))
+			++s;
+
+		return std::string(start, s);
+	}
+
+	// `{e9}` after a `\u`
+	constexpr char32_t parse_code_point(ParseErrorKind error)
+	{
+		if (s == e || *s != '{')
+			throw error;
+
+		++s;
+
+		char32_t c = 0;
+		size_t digits = 0;
+
+		for (; s != e && *s != '}' && digits < 6; ++s, ++digits)
+		{
+			if (!((*s >= '0' && *s <= '9') || (*s >= 'a' && *s <= 'f') || (*s >= 'A' && *s <= 'F')))
+				throw error;
+
+			c = c << 4 | hex2num(*s);
+		}
+
+		if (digits == 0 || s == e || *s != '}' || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+			throw error;
+
+		++s;
+		return c;
+	}
+
+	// A member of a class as bytes, and as the code point pgen::parse orders ranges by
+	struct ClassChar
+	{
+		std::string bytes;
+		char32_t code_point = 0;
+	};
+
+	constexpr ClassChar parse_class_char()
+	{
+		if (s == e)
+			throw ParseErrorKind::InvalidCharClass;
+
+		if (*s != '\\')
+		{
+			// raw text is read as UTF-8, a byte that starts no valid sequence as itself
+			const size_t size = utf8_sequence(s, e);
+
+			if (size <= 1)
+				return { std::string(1, *s), (uint8_t)*s++ };
+
+			constexpr uint8_t lead[] = { 0, 0x7F, 0x1F, 0x0F, 0x07 };
+
+			char32_t c = (uint8_t)s[0] & lead[size];
+
+			for (size_t i = 1; i < size; ++i)
+				c = c << 6 | ((uint8_t)s[i] & 0x3F);
+
+			s += size;
+			return { std::string(s - size, s), c };
+		}
+
+		++s;
+
+		if (s == e)
+			throw ParseErrorKind::InvalidCharClass;
+
+		const char c = *s++;
+
+		auto byte = [](char v) {
+			return ClassChar{ std::string(1, v), (uint8_t)v };
+		};
+
+		switch (c)
+		{
+			case 'x':
+				if (e - s < 2)
+					throw ParseErrorKind::InvalidCharClass;
+
+				s += 2;
+				return byte((char)(hex2num(s[-2]) << 4 | hex2num(s[-1])));
+			case 'u':
+				{
+					const char32_t v = parse_code_point(ParseErrorKind::InvalidCharClass);
+					return { encode_utf8(v), v };
+				}
+			case 'a': return byte('\a');
+			case 'b': return byte('\b');
+			case 't': return byte('\t');
+			case 'n': return byte('\n');
+			case 'v': return byte('\v');
+			case 'f': return byte('\f');
+			case 'r': return byte('\r');
+			default: return byte(c);
+		}
+	}
+
+	constexpr Node parse_class()
+	{
+		++s;
+
+		CharClass cls;
+
+		const bool negate = s != e && *s == '^';
+
+		if (negate)
+			++s;
+
+		while (true)
+		{
+			if (s == e)
+				throw ParseErrorKind::InvalidCharClass;
+
+			if (*s == ']')
+			{
+				++s;
+				break;
+			}
+
+			const ClassChar first = parse_class_char();
+			ClassChar last = first;
+
+			if (e - s >= 2 && s[0] == '-' && s[1] != ']')
+			{
+				++s;
+				last = parse_class_char();
+
+				if (last.code_point < first.code_point)
+					throw ParseErrorKind::InvalidCharClass;
+			}
+
+			// a range of longer sequences has no byte form, its ends stand for themselves
+			if (first.bytes.size() == 1 && last.bytes.size() == 1)
+			{
+				if ((uint8_t)last.bytes[0] < (uint8_t)first.bytes[0])
+					throw ParseErrorKind::InvalidCharClass;
+
+				for (uint32_t c = (uint8_t)first.bytes[0]; c <= (uint8_t)last.bytes[0]; ++c)
+					cls.set((uint8_t)c);
+			}
+			else
+			{
+				for (char c : first.bytes + last.bytes)
+					cls.set((uint8_t)c);
+			}
+		}
+
+		if (negate)
+			cls.flip();
+
+		Node node;
+		node.type = ir::NodeType::CharClass;
+		node.value = intern(cls);
+		return node;
+	}
+
+	constexpr Node parse_string()
+	{
+		++s;
+
+		std::string lit;
+
+		while (true)
+		{
+			if (s == e)
+				throw ParseErrorKind::UnterminatedString;
+
+			if (*s == '"')
+			{
+				++s;
+				break;
+			}
+
+			if (*s != '\\')
+			{
+				lit += *s++;
+				continue;
+			}
+
+			++s;
+
+			if (s == e)
+				throw ParseErrorKind::UnterminatedString;
+
+			const char c = *s++;
+
+			switch (c)
+			{
+				case 'x':
+					if (e - s < 2)
+						throw ParseErrorKind::UnterminatedString;
+
+					lit += (char)(hex2num(s[0]) << 4 | hex2num(s[1]));
+					s += 2;
+					break;
+				case 'u':
+					lit += encode_utf8(parse_code_point(ParseErrorKind::UnterminatedString));
+					break;
+				case '"': lit += '"'; break;
+				case '\\': lit += '\\'; break;
+				case 'a': lit += '\a'; break;
+				case 'b': lit += '\b'; break;
+				case 't': lit += '\t'; break;
+				case 'n': lit += '\n'; break;
+				case 'v': lit += '\v'; break;
+				case 'f': lit += '\f'; break;
+				case 'r': lit += '\r'; break;
+				default: lit += '\\'; break;
+			}
+		}
+
+		Node node;
+		node.type = ir::NodeType::Literal;
+		node.value = intern(lit);
+		node.size = (uint32_t)lit.size();
+		return node;
+	}
+
+	constexpr uint32_t intern(const std::string &lit)
+	{
+		const size_t at = result.literals.find(lit);
+
+		if (at != std::string::npos)
+			return (uint32_t)at;
+
+		result.literals += lit;
+		return (uint32_t)(result.literals.size() - lit.size());
+	}
+
+	constexpr uint32_t intern(const CharClass &cls)
+	{
+		for (size_t i = 0; i < result.classes.size(); ++i)
+		{
+			if (result.classes[i] == cls)
+				return (uint32_t)i;
+		}
+
+		result.classes.push_back(cls);
+		return (uint32_t)(result.classes.size() - 1);
+	}
+
+	constexpr uint32_t parse_group(const std::string &parent, size_t &parent_group_id)
+	{
+		++s;
+		skip_whitespace();
+
+		// numbered on the way in, which is the preorder lower() uses
+		const uint32_t index = (uint32_t)result.groups.size();
+		result.groups.push_back({ parent + "_$g" + to_string(parent_group_id++), {} });
+
+		std::vector<Node> items;
+		size_t group_id = 0;
+
+		while (true)
+		{
+			if (s == e)
+				throw ParseErrorKind::UnterminatedGroup;
+
+			if (*s == ')')
+			{
+				++s;
+				break;
+			}
+
+			parse_item(items, result.groups[index].name, group_id);
+			skip_whitespace();
+		}
+
+		result.groups[index].items = std::move(items);
+		return index;
+	}
+
+	constexpr void parse_item(std::vector<Node> &items, const std::string &parent, size_t &group_id)
+	{
+		if (s == e)
+			throw ParseErrorKind::ExpectedItem;
+
+		const char c = *s;
+
+		if (c == '"')
+		{
+			items.push_back(parse_string());
+			return;
+		}
+
+		if (is_identifier(c))
+		{
+			Node node;
+			node.type = ir::NodeType::Reference;
+			node.value = (uint32_t)result.references.size();
+			result.references.push_back(parse_name());
+			items.push_back(node);
+			return;
+		}
+
+		if (c == '(')
+		{
+			const std::string name = parent;
+
+			Node node;
+			node.type = ir::NodeType::Group;
+			node.value = parse_group(name, group_id);
+			items.push_back(node);
+			return;
+		}
+
+		if (c == '[')
+		{
+			items.push_back(parse_class());
+			return;
+		}
+
+		if (c == '|')
+		{
+			++s;
+
+			Node node;
+			node.type = ir::NodeType::Or;
+			items.push_back(node);
+			return;
+		}
+
+		if (c == '~')
+		{
+			++s;
+
+			Node node;
+			node.type = ir::NodeType::Cut;
+			items.push_back(node);
+			return;
+		}
+
+		if (c != '*' && c != '+' && c != '?' && c != '^')
+			throw ParseErrorKind::ExpectedItem;
+
+		++s;
+
+		if (items.empty())
+			return;
+
+		Node &last = items.back();
+
+		if (last.type == ir::NodeType::Cut)
+			throw ParseErrorKind::ExpectedItem;
+
+		if (c == '*')
+		{
+			last.optional = true;
+			last.multiple = true;
+		}
+		else
+		if (c == '+')
+		{
+			last.multiple = true;
+		}
+		else
+		if (c == '?')
+		{
+			last.optional = true;
+		}
+		else
+		if (last.type == ir::NodeType::CharClass)
+		{
+			// classes are interned, so the flipped one is a class of its own
+			CharClass cls = result.classes[last.value];
+			cls.flip();
+			last.value = intern(cls);
+		}
+		else
+		if (last.type == ir::NodeType::Literal)
+		{
+			last.negate = true;
+		}
+		else
+		{
+			throw ParseErrorKind::InvalidNegation;
+		}
+	}
+
+	constexpr void parse_rule()
+	{
+		// there is no lexer stage here, annotated rules match like the others
+		if (*s == '@')
+		{
+			++s;
+
+			const std::string annotation = parse_name();
+
+			if (annotation != "token" && annotation != "skip" && annotation != "sync")
+				throw ParseErrorKind::UnknownAnnotation;
+
+			skip_whitespace();
+		}
+
+		ParsedDefinition rule;
+		rule.name = parse_name();
+
+		if (rule.name.empty())
+			throw ParseErrorKind::ExpectedRuleName;
+
+		for (const auto &v : result.rules)
+		{
+			if (v.name == rule.name)
+				throw ParseErrorKind::DuplicateRule;
+		}
+
+		skip_whitespace();
+
+		if (s == e || *s != ':')
+			throw ParseErrorKind::ExpectedColon;
+
+		++s;
+		skip_whitespace();
+
+		size_t group_id = 0;
+
+		while (s != e)
+		{
+			parse_item(rule.items, rule.name, group_id);
+
+			if (parse_two_newlines())
+				break;
+
+			skip_whitespace();
+		}
+
+		if (rule.items.empty())
+			throw ParseErrorKind::EmptyRule;
+
+		result.rules.push_back(std::move(rule));
+	}
+
+	// Rules are 1..rules.size(), groups follow
+	constexpr void resolve()
+	{
+		const uint32_t groups_begin = (uint32_t)result.rules.size() + 1;
+
+		auto fix = [&](ParsedDefinition &d) {
+			result.names += d.name.size();
+
+			for (auto &node : d.items)
+			{
+				if (node.type == ir::NodeType::Group)
+				{
+					node.value += groups_begin;
+				}
+				else
+				if (node.type == ir::NodeType::Reference)
+				{
+					const std::string &name = result.references[node.value];
+
+					auto it = std::find_if(result.rules.begin(), result.rules.end(), [&](const ParsedDefinition &r) { return r.name == name; });
+
+					if (it == result.rules.end())
+						throw ParseErrorKind::UndefinedRule;
+
+					node.value = (uint32_t)(it - result.rules.begin()) + 1;
+				}
+			}
+		};
+
+		for (auto &rule : result.rules)
+			fix(rule);
+
+		for (auto &group : result.groups)
+			fix(group);
+	}
+};
+
+struct Sizes
+{
+	size_t definitions = 0;
+	size_t nodes = 0;
+	size_t literals = 0;
+	size_t names = 0;
+	size_t classes = 0;
+};
+
+constexpr Sizes sizes(std::string_view text)
+{
+	const ParsedGrammar g = Parser(text).parse();
+
+	Sizes result;
+	result.definitions = 1 + g.rules.size() + g.groups.size();
+	result.literals = g.literals.size();
+	result.names = g.names;
+	result.classes = g.classes.size();
+
+	for (const auto &d : g.rules)
+		result.nodes += d.items.size();
+
+	for (const auto &d : g.groups)
+		result.nodes += d.items.size();
+
+	return result;
+}
+
+
+} // namespace detail
+
+
+// Parses twice, once to size the arrays and once to fill them
+template <FixedString Text>
+constexpr auto compile()
+{
+	constexpr detail::Sizes sizes = detail::sizes(Text.view());
+
+	const detail::ParsedGrammar g = detail::Parser(Text.view()).parse();
+
+	Grammar<sizes.definitions, sizes.nodes, sizes.literals, sizes.names, sizes.classes> result{};
+	result.rule_count = (uint32_t)g.rules.size();
+
+	std::copy(g.literals.begin(), g.literals.end(), result.literals.begin());
+	std::copy(g.classes.begin(), g.classes.end(), result.classes.begin());
+
+	uint32_t id = 1;
+	uint32_t node = 0;
+	uint32_t name = 0;
+
+	auto add = [&](const detail::ParsedDefinition &d, bool group) {
+		Definition &def = result.definitions[id++];
+		def.name = name;
+		def.name_size = (uint32_t)d.name.size();
+		def.begin = node;
+		def.end = node + (uint32_t)d.items.size();
+		def.group = group;
+
+		std::copy(d.name.begin(), d.name.end(), result.names.begin() + name);
+		std::copy(d.items.begin(), d.items.end(), result.nodes.begin() + node);
+
+		name += def.name_size;
+		node = def.end;
+	};
+
+	for (const auto &d : g.rules)
+		add(d, false);
+
+	for (const auto &d : g.groups)
+		add(d, true);
+
+	// least fixpoint, as helpers::compute_first_sets
+	for (bool changed = true; changed; )
+	{
+		changed = false;
+
+		for (uint32_t id = 1; id < sizes.definitions; ++id)
+		{
+			FirstSet v;
+
+			for (uint32_t begin = result.definitions[id].begin, i = begin; i <= result.definitions[id].end; ++i)
+			{
+				if (i != result.definitions[id].end && result.nodes[i].type != ir::NodeType::Or)
+					continue;
+
+				const FirstSet alt = result.first_set(begin, i);
+				v.bytes |= alt.bytes;
+				v.nullable = v.nullable || alt.nullable;
+				begin = i + 1;
+			}
+
+			if (!(v == result.first[id]))
+			{
+				result.first[id] = v;
+				changed = true;
+			}
+		}
+	}
+
+	return result;
+}
+
+// Matchers for every node of the grammar, instantiated as they are reached
+// from the rule being parsed. Trees have the shape of vm::run's.
+template <FixedString Text>
+class Parser
+{
+public:
+	static constexpr auto grammar = compile<Text>();
+
+	template <FixedString Rule>
+	static std::optional<vm::Tree> parse(const char *&s, const char *e)
+	{
+		constexpr uint32_t id = grammar.find(Rule.view());
+
+		vm::Tree tree;
+		Context ctx{ tree.arena, {} };
+
+		const char *sc = s;
+
+		if (!match_definition<id>(ctx, sc, e))
+			return std::nullopt;
+
+		static_cast<vm::Node &>(tree) = ctx.stack.back();
+		s = sc;
+		return tree;
+	}
+
+	static constexpr std::string_view name(uint32_t id)
+	{
+		return grammar.name(id);
+	}
+
+	static std::string dump_tree(const vm::Node &node, size_t align = 0)
+	{
+		std::string result;
+
+		if (node.type == vm::NodeType::Literal)
+			result += std::string(align, ' ') + "'" + std::string(node.span) + "'\n";
+		else
+			result += std::string(align, ' ') + std::string(name(node.identifier)) + "\n";
+
+		for (const auto &v : node.group)
+			result += dump_tree(v, align + 1);
+
+		return result;
+	}
+
+private:
+	struct Context
+	{
+		vm::NodeArena &arena;
+		std::vector<vm::Node> stack;
+	};
+
+	static vm::Node literal_node(const char *s, size_t size)
+	{
+		vm::Node node;
+		node.span = std::string_view(s, size);
+		return node;
+	}
+
+	template <uint32_t Id>
+	static bool match_definition(Context &ctx, const char *&s, const char *e)
+	{
+		constexpr Definition d = grammar.definitions[Id];
+
+		const size_t mark = ctx.stack.size();
+		const auto arena = ctx.arena.mark();
+		const char *sc = s;
+
+		if (!match_alternatives<d.begin, d.end>(ctx, sc, e, mark, arena))
+			return false;
+
+		vm::Node node;
+		node.type = d.group ? vm::NodeType::Group : vm::NodeType::Identifier;
+		node.identifier = Id;
+		node.span = std::string_view(s, sc - s);
+
+		if (const size_t count = ctx.stack.size() - mark; count != 0)
+		{
+			vm::Node *block = ctx.arena.allocate(count);
+			std::copy(ctx.stack.begin() + mark, ctx.stack.end(), block);
+			ctx.stack.resize(mark);
+			node.group = { block, count };
+		}
+
+		ctx.stack.push_back(node);
+		s = sc;
+		return true;
+	}
+
+	static constexpr uint32_t alternative_end(uint32_t begin, uint32_t end)
+	{
+		while (begin != end && grammar.nodes[begin].type != ir::NodeType::Or)
+			++begin;
+
+		return begin;
+	}
+
+	static constexpr uint32_t find_cut(uint32_t begin, uint32_t end)
+	{
+		while (begin != end && grammar.nodes[begin].type != ir::NodeType::Cut)
+			++begin;
+
+		return begin;
+	}
+
+	// Each failed alternative leaves the stack and arena as they were on entry
+	template <uint32_t Begin, uint32_t End>
+	static bool match_alternatives(Context &ctx, const char *&s, const char *e, size_t mark, const vm::NodeArena::Mark &arena)
+	{
+		constexpr uint32_t split = alternative_end(Begin, End);
+		constexpr uint32_t cut = find_cut(Begin, split);
+		constexpr FirstSet first = grammar.first_set(Begin, split);
+
+		// alternatives that cannot start with the next byte are not tried
+		const bool feasible = first.nullable || first.bytes.all() || (s != e && first.bytes.contains(*s));
+
+		if (feasible)
+		{
+			const char *sc = s;
+
+			if constexpr (cut != split)
+			{
+				// past the cut the remaining alternatives are not tried
+				if (match_sequence<Begin, cut>(ctx, sc, e))
+				{
+					if (match_sequence<cut + 1, split>(ctx, sc, e))
+					{
+						s = sc;
+						return true;
+					}
+
+					ctx.stack.resize(mark);
+					ctx.arena.rewind(arena);
+					return false;
+				}
+			}
+			else
+			{
+				if (match_sequence<Begin, split>(ctx, sc, e))
+				{
+					s = sc;
+					return true;
+				}
+			}
+
+			ctx.stack.resize(mark);
+			ctx.arena.rewind(arena);
+		}
+
+		if constexpr (split == End)
+			return false;
+		else
+			return match_alternatives<split + 1, End>(ctx, s, e, mark, arena);
+	}
+
+	template <uint32_t Begin, uint32_t End>
+	static bool match_sequence(Context &ctx, const char *&s, const char *e)
+	{
+		if constexpr (Begin == End)
+			return true;
+		else
+			return match_item<Begin>(ctx, s, e) && match_sequence<Begin + 1, End>(ctx, s, e);
+	}
+
+	template <uint32_t I>
+	static bool match_item(Context &ctx, const char *&s, const char *e)
+	{
+		constexpr Node node = grammar.nodes[I];
+
+		// only later cuts of an alternative get here, the first one is already past
+		if constexpr (node.type == ir::NodeType::Cut)
+		{
+			return true;
+		}
+		else
+		if constexpr (!node.multiple)
+		{
+			return match_once<I>(ctx, s, e) || node.optional;
+		}
+		else
+		{
+			if constexpr (!node.optional)
+			{
+				if (!match_once<I>(ctx, s, e))
+					return false;
+			}
+
+			while (match_once<I>(ctx, s, e))
+			{
+			}
+
+			return true;
+		}
+	}
+
+	// A failed match pushes nothing and leaves s alone
+	template <uint32_t I>
+	static bool match_once(Context &ctx, const char *&s, const char *e)
+	{
+		constexpr Node node = grammar.nodes[I];
+
+		if constexpr (node.type == ir::NodeType::Literal && node.negate)
+		{
+			constexpr std::string_view lit = grammar.literal(node);
+
+			if (s == e)
+				return false;
+
+			if constexpr (lit.size() == 1)
+			{
+				if (*s == lit[0])
+					return false;
+			}
+			else
+			{
+				if ((size_t)(e - s) >= lit.size() && std::memcmp(s, lit.data(), lit.size()) == 0)
+					return false;
+			}
+
+			ctx.stack.push_back(literal_node(s, 1));
+			++s;
+			return true;
+		}
+		else
+		if constexpr (node.type == ir::NodeType::Literal)
+		{
+			constexpr std::string_view lit = grammar.literal(node);
+
+			if constexpr (lit.size() == 1)
+			{
+				if (s == e || *s != lit[0])
+					return false;
+			}
+			else
+			{
+				if (s == e || (size_t)(e - s) < lit.size() || std::memcmp(s, lit.data(), lit.size()) != 0)
+					return false;
+			}
+
+			ctx.stack.push_back(literal_node(s, lit.size()));
+			s += lit.size();
+			return true;
+		}
+		else
+		if constexpr (node.type == ir::NodeType::CharClass)
+		{
+			constexpr CharClass cls = grammar.classes[node.value];
+
+			if (s == e || !cls.contains(*s))
+				return false;
+
+			ctx.stack.push_back(literal_node(s, 1));
+			++s;
+			return true;
+		}
+		else
+		{
+			return match_definition<node.value>(ctx, s, e);
+		}
+	}
+};
+
+
+} // namespace ct
+
+
+} // namespace pgen
@@ -0,0 +1,243 @@
+#include "pch.hpp"
+#include "pgen.hpp"
+#include "analysis.hpp"
+
+
+namespace pgen
+{
+
+
+namespace helpers
+{
+
+
+namespace
+{
+
+
+constexpr char32_t surrogate_first = 0xD800;
+constexpr char32_t surrogate_last = 0xDFFF;
+constexpr char32_t code_point_last = 0x10FFFF;
+
+void split(char32_t first, char32_t last, std::vector<Utf8Sequence> &result)
+{
+	// one encoding length at a time
+	for (char32_t max : { 0x7F, 0x7FF, 0xFFFF })
+	{
+		if (first <= max && last > max)
+		{
+			split(first, max, result);
+			split(max + 1, last, result);
+			return;
+		}
+	}
+
+	// until every trailing byte either is the same at both ends or runs from 80 to BF
+	for (size_t i = 1; i < 4; ++i)
+	{
+		const char32_t mask = ((char32_t)1 << (6 * i)) - 1;
+
+		if ((first & ~mask) == (last & ~mask))
+			continue;
+
+		if ((first & mask) != 0)
+		{
+			split(first, first | mask, result);
+			split((first | mask) + 1, last, result);
+			return;
+		}
+
+		if ((last & mask) != mask)
+		{
+			split(first, (last & ~mask) - 1, result);
+			split(last & ~mask, last, result);
+			return;
+		}
+	}
+
+	const std::string a = encode_utf8(first);
+	const std::string b = encode_utf8(last);
+
+	Utf8Sequence sequence;
+
+	for (size_t i = 0; i < a.size(); ++i)
+		sequence.push_back({ (uint8_t)a[i], (uint8_t)b[i] });
+
+	result.push_back(std::move(sequence));
+}
+
+
+} // namespace
+
+
+std::string encode_utf8(char32_t c)
+{
+	std::string result;
+
+	if (c < 0x80)
+	{
+		result += (char)c;
+	}
+	else
+	if (c < 0x800)
+	{
+		result += (char)(0xC0 | c >> 6);
+		result += (char)(0x80 | (c & 0x3F));
+	}
+	else
+	if (c < 0x10000)
+	{
+		result += (char)(0xE0 | c >> 12);
+		result += (char)(0x80 | (c >> 6 & 0x3F));
+		result += (char)(0x80 | (c & 0x3F));
+	}
+	else
+	{
+		result += (char)(0xF0 | c >> 18);
+		result += (char)(0x80 | (c >> 12 & 0x3F));
+		result += (char)(0x80 | (c >> 6 & 0x3F));
+		result += (char)(0x80 | (c & 0x3F));
+	}
+
+	return result;
+}
+
+std::optional<char32_t> decode_utf8(const char *&s, const char *e)
+{
+	if (s >= e)
+		return std::nullopt;
+
+	const uint8_t b = (uint8_t)*s;
+
+	if (b < 0x80)
+	{
+		++s;
+		return b;
+	}
+
+	size_t size = 0;
+	char32_t c = 0;
+
+	if (b >= 0xC2 && b <= 0xDF)
+	{
+		size = 2;
+		c = b & 0x1F;
+	}
+	else
+	if (b >= 0xE0 && b <= 0xEF)
+	{
+		size = 3;
+		c = b & 0x0F;
+	}
+	else
+	if (b >= 0xF0 && b <= 0xF4)
+	{
+		size = 4;
+		c = b & 0x07;
+	}
+	else
+	{
+		return std::nullopt;
+	}
+
+	if ((size_t)(e - s) < size)
+		return std::nullopt;
+
+	for (size_t i = 1; i < size; ++i)
+	{
+		if (((uint8_t)s[i] & 0xC0) != 0x80)
+			return std::nullopt;
+
+		c = c << 6 | ((uint8_t)s[i] & 0x3F);
+	}
+
+	// overlong forms, surrogates and code points past U+10FFFF
+	if ((size == 3 && c < 0x800) || (c >= surrogate_first && c <= surrogate_last) || (size == 4 && (c < 0x10000 || c > code_point_last)))
+		return std::nullopt;
+
+	s += size;
+	return c;
+}
+
+void normalize_code_points(std::vector<CodePointRange> &ranges)
+{
+	std::sort(ranges.begin(), ranges.end(), [](const CodePointRange &a, const CodePointRange &b) { return a.first < b.first; });
+
+	std::vector<CodePointRange> result;
+
+	auto add = [&](char32_t first, char32_t last) {
+		if (first > last)
+			return;
+
+		if (!result.empty() && first <= result.back().last + 1)
+			result.back().last = std::max(result.back().last, last);
+		else
+			result.push_back({ first, last });
+	};
+
+	for (const auto &r : ranges)
+	{
+		if (r.first > surrogate_last || r.last < surrogate_first)
+		{
+			add(r.first, std::min(r.last, code_point_last));
+			continue;
+		}
+
+		if (r.first < surrogate_first)
+			add(r.first, surrogate_first - 1);
+
+		if (r.last > surrogate_last)
+			add(surrogate_last + 1, std::min(r.last, code_point_last));
+	}
+
+	ranges = std::move(result);
+}
+
+std::vector<CodePointRange> negate_code_points(const std::vector<CodePointRange> &ranges)
+{
+	std::vector<CodePointRange> result;
+	char32_t next = 0;
+
+	for (const auto &r : ranges)
+	{
+		if (r.first > next)
+			result.push_back({ next, r.first - 1 });
+
+		next = r.last + 1;
+	}
+
+	if (next <= code_point_last)
+		result.push_back({ next, code_point_last });
+
+	normalize_code_points(result);
+	return result;
+}
+
+std::vector<Utf8Sequence> utf8_sequences(const std::vector<CodePointRange> &ranges)
+{
+	std::vector<Utf8Sequence> result;
+
+	for (const auto &r : ranges)
+		split(r.first, r.last, result);
+
+	return result;
+}
+
+std::bitset<256> utf8_first_bytes(const std::vector<CodePointRange> &ranges)
+{
+	std::bitset<256> result;
+
+	for (const auto &sequence : utf8_sequences(ranges))
+	{
+		for (size_t c = sequence[0].first; c <= sequence[0].second; ++c)
+			result.set(c);
+	}
+
+	return result;
+}
+
+
+} // namespace helpers
+
+
+} // namespace pgen
@@ -0,0 +1,614 @@
+#include "pch.hpp"
+#include "pgen.hpp"
+#include "analysis.hpp"
+
+
+namespace pgen
+{
+
+
+namespace vm
+{
+
+
+std::optional<uint32_t> Program::find(std::string_view name) const
+{
+	for (size_t i = 1; i < names.size(); ++i)
+	{
+		if (names[i] == name)
+			return (uint32_t)i;
+	}
+
+	return std::nullopt;
+}
+
+struct Compiler
+{
+	const ir::Grammar &grammar;
+	Program program{};
+	helpers::FirstSets first_sets{};
+
+	// program.classes starts out as the grammar's, guards are added as needed
+	std::unordered_map<std::bitset<256>, uint32_t> class_ids{};
+
+	uint32_t here() const
+	{
+		return (uint32_t)program.code.size();
+	}
+
+	uint32_t emit(Op op, uint32_t arg = 0)
+	{
+		program.code.push_back({ op, arg });
+		return here() - 1;
+	}
+
+	void patch(uint32_t at, uint32_t target)
+	{
+		program.code[at].target = target;
+	}
+
+	// TestSet guard for a match that cannot start with every byte, patched by the caller
+	std::optional<uint32_t> emit_test(const helpers::FirstSet &first)
+	{
+		if (first.nullable || first.bytes.all())
+			return std::nullopt;
+
+		return emit(Op::TestSet, char_class(first.bytes));
+	}
+
+	uint32_t char_class(const std::bitset<256> &bits)
+	{
+		auto [it, inserted] = class_ids.try_emplace(bits, (uint32_t)program.classes.size());
+
+		if (inserted)
+			program.classes.push_back(bits);
+
+		return it->second;
+	}
+
+	void compile_once(const ir::Node &node)
+	{
+		switch (node.type)
+		{
+			case ir::NodeType::Literal:
+				emit(node.negate ? Op::NegateLiteral : Op::Literal, node.value);
+				break;
+			case ir::NodeType::CharClass:
+				emit(Op::CharClass, node.value);
+				break;
+			case ir::NodeType::Reference:
+			case ir::NodeType::Group:
+				emit(Op::Call, node.value);
+				break;
+			default:
+				throw 2;
+		}
+	}
+
+	//  X?  TestSet L; Choice L; X; Commit L; L:
+	//  X*  Choice L2; L1: TestSet Lx; X; PartialCommit L1; Lx: Commit L2; L2:
+	//  X+  X; X*
+	void compile_item(const ir::Node &node)
+	{
+		if (!node.optional && !node.multiple)
+		{
+			compile_once(node);
+			return;
+		}
+
+		ir::Node once = node;
+		once.optional = false;
+		once.multiple = false;
+
+		const helpers::FirstSet first = helpers::first_set(grammar, once, first_sets);
+
+		if (!node.multiple)
+		{
+			auto test = emit_test(first);
+			uint32_t choice = emit(Op::Choice);
+			compile_once(node);
+			uint32_t commit = emit(Op::Commit);
+
+			if (test)
+				patch(test.value(), here());
+
+			patch(choice, here());
+			patch(commit, here());
+			return;
+		}
+
+		if (!node.optional)
+			compile_once(node);
+
+		uint32_t choice = emit(Op::Choice);
+		uint32_t loop = here();
+		auto test = emit_test(first);
+		compile_once(node);
+		patch(emit(Op::PartialCommit), loop);
+
+		if (test)
+		{
+			patch(test.value(), here());
+			patch(emit(Op::Commit), here() + 1);
+		}
+
+		patch(choice, here());
+	}
+
+	// L1: TestSet L2; Choice L2; alt1; Commit end;
+	// L2: TestSet fail; alt2;
+	// end: Return; fail: Fail
+	void compile_body(uint32_t id)
+	{
+		const auto items = grammar.body(id);
+		const Op ret = grammar.definitions[id].transparent ? Op::Splice : Op::Return;
+
+		if (helpers::is_literal_alternation(items))
+		{
+			std::vector<uint32_t> set;
+
+			for (const auto &v : items)
+			{
+				if (v.type == ir::NodeType::Literal)
+					set.push_back(v.value);
+			}
+
+			program.literal_sets.push_back(std::move(set));
+			emit(Op::LiteralSet, (uint32_t)program.literal_sets.size() - 1);
+			emit(ret);
+			return;
+		}
+
+		const auto alternatives = helpers::split_alternatives(items);
+
+		std::vector<uint32_t> commits;
+		std::vector<uint32_t> to_fail;
+
+		for (size_t k = 0; k < alternatives.size(); ++k)
+		{
+			const auto [begin, end] = alternatives[k];
+			const bool last = k + 1 == alternatives.size();
+
+			auto test = emit_test(helpers::first_set(grammar, items.subspan(begin, end - begin), first_sets));
+			auto choice = last ? std::nullopt : std::optional<uint32_t>(emit(Op::Choice));
+
+			bool cut = false;
+
+			for (size_t j = begin; j < end; ++j)
+			{
+				if (items[j].type != ir::NodeType::Cut)
+				{
+					compile_item(items[j]);
+					continue;
+				}
+
+				// the first cut drops the choice, the alternative can't go back to the next one
+				emit(Op::Cut, choice && !cut ? 1 : 0);
+				cut = true;
+			}
+
+			if (choice && cut)
+			{
+				emit(ret);
+				patch(choice.value(), here());
+			}
+			else
+			if (choice)
+			{
+				commits.push_back(emit(Op::Commit));
+				patch(choice.value(), here());
+			}
+
+			if (test && last)
+				to_fail.push_back(test.value());
+			else
+			if (test)
+				patch(test.value(), here());
+		}
+
+		for (uint32_t commit : commits)
+			patch(commit, here());
+
+		emit(ret);
+
+		if (!to_fail.empty())
+		{
+			for (uint32_t test : to_fail)
+				patch(test, here());
+
+			emit(Op::Fail);
+		}
+	}
+};
+
+// Literal and class indices are the grammar's, so the generator can share its class tables
+Program compile(const ir::Grammar &grammar)
+{
+	Compiler c{ grammar };
+
+	c.first_sets = helpers::compute_first_sets(grammar);
+
+	c.program.literals = grammar.literals;
+	c.program.classes = grammar.classes;
+
+	for (uint32_t i = 0; i < grammar.classes.size(); ++i)
+		c.class_ids.emplace(grammar.classes[i], i);
+
+	for (const auto &d : grammar.definitions)
+		c.program.names.push_back(d.name);
+
+	c.program.rule_count = grammar.rule_count;
+	c.program.entry.resize(grammar.size());
+
+	// the outermost call returns here
+	c.emit(Op::End);
+
+	for (uint32_t id = 1; id < grammar.size(); ++id)
+	{
+		c.program.entry[id] = c.here();
+		c.compile_body(id);
+	}
+
+	return std::move(c.program);
+}
+
+Program compile(const std::vector<Rule> &rules)
+{
+	return compile(ir::lower(rules));
+}
+
+std::string disassemble(const Program &program)
+{
+	static const char *op_names[] = {
+		"Literal",
+		"NegateLiteral",
+		"CharClass",
+		"LiteralSet",
+		"Call",
+		"Return",
+		"Splice",
+		"Choice",
+		"Commit",
+		"PartialCommit",
+		"TestSet",
+		"Cut",
+		"Fail",
+		"End",
+	};
+
+	std::string result;
+
+	for (size_t i = 0; i < program.code.size(); ++i)
+	{
+		for (size_t id = 1; id < program.entry.size(); ++id)
+		{
+			if (program.entry[id] == i)
+				result += program.names[id] + ":\n";
+		}
+
+		const auto &ins = program.code[i];
+
+		result += "\t" + std::to_string(i) + "\t" + op_names[(size_t)ins.op];
+
+		switch (ins.op)
+		{
+			case Op::Literal:
+			case Op::NegateLiteral:
+				result += " \"" + program.literals[ins.arg] + "\"";
+				break;
+			case Op::CharClass:
+				result += " " + helpers::dump_class(program.classes[ins.arg]);
+				break;
+			case Op::LiteralSet:
+				for (uint32_t lit : program.literal_sets[ins.arg])
+					result += " \"" + program.literals[lit] + "\"";
+				break;
+			case Op::Call:
+				result += " " + program.names[ins.arg];
+				break;
+			case Op::Choice:
+			case Op::Commit:
+			case Op::PartialCommit:
+				result += " " + std::to_string(ins.target);
+				break;
+			case Op::TestSet:
+				result += " " + helpers::dump_class(program.classes[ins.arg]) + " " + std::to_string(ins.target);
+				break;
+			case Op::Cut:
+				result += " " + std::to_string(ins.arg);
+				break;
+			default:
+				break;
+		}
+
+		result += "\n";
+	}
+
+	return result;
+}
+
+const Node *Node::find(uint32_t id) const
+{
+	for (const auto &v : group)
+	{
+		if (v.identifier == id)
+			return &v;
+	}
+
+	return nullptr;
+}
+
+NodeArena::Mark NodeArena::mark() const
+{
+	if (chunks.empty())
+		return {};
+
+	return { current, chunks[current].used };
+}
+
+void NodeArena::rewind(const Mark &m)
+{
+	current = m.chunk;
+
+	if (!chunks.empty())
+		chunks[current].used = m.used;
+}
+
+Node *NodeArena::allocate(size_t count)
+{
+	while (current < chunks.size())
+	{
+		Chunk &c = chunks[current];
+
+		if (c.size - c.used >= count)
+		{
+			Node *result = c.data.get() + c.used;
+			c.used += count;
+			return result;
+		}
+
+		if (current + 1 == chunks.size())
+			break;
+
+		++current;
+		chunks[current].used = 0;
+	}
+
+	size_t size = chunks.empty() ? 256 : std::min<size_t>(chunks.back().size * 2, 65536);
+	size = std::max(size, count);
+
+	chunks.push_back({ std::make_unique<Node[]>(size), size, count });
+	current = chunks.size() - 1;
+
+	return chunks.back().data.get();
+}
+
+std::optional<Tree> run(const Program &program, uint32_t rule, const char *&s, const char *e)
+{
+	struct Frame
+	{
+		uint32_t ret;
+		uint32_t id;
+		const char *start;
+		size_t stack;
+	};
+
+	struct Backtrack
+	{
+		uint32_t target;
+		const char *pos;
+		size_t stack;
+		NodeArena::Mark arena;
+		size_t frames;
+	};
+
+	Tree tree;
+
+	std::vector<Node> stack;
+	std::vector<Frame> frames;
+	std::vector<Backtrack> backtrack;
+
+	const Instruction *code = program.code.data();
+	const char *pos = s;
+
+	frames.push_back({ 0, rule, pos, 0 });
+	uint32_t pc = program.entry[rule];
+
+	while (true)
+	{
+		const Instruction &ins = code[pc];
+
+		switch (ins.op)
+		{
+			case Op::Literal:
+				{
+					const std::string &lit = program.literals[ins.arg];
+
+					if ((size_t)(e - pos) < lit.size() || pos == e || std::memcmp(pos, lit.data(), lit.size()) != 0)
+						goto fail;
+
+					Node node;
+					node.span = std::string_view(pos, lit.size());
+					stack.push_back(node);
+
+					pos += lit.size();
+					++pc;
+					continue;
+				}
+
+			case Op::NegateLiteral:
+				{
+					const std::string &lit = program.literals[ins.arg];
+
+					if (pos == e)
+						goto fail;
+
+					if ((size_t)(e - pos) >= lit.size() && std::memcmp(pos, lit.data(), lit.size()) == 0)
+						goto fail;
+
+					Node node;
+					node.span = std::string_view(pos, 1);
+					stack.push_back(node);
+
+					++pos;
+					++pc;
+					continue;
+				}
+
+			case Op::CharClass:
+				{
+					if (pos == e || !program.classes[ins.arg].test((uint8_t)*pos))
+						goto fail;
+
+					Node node;
+					node.span = std::string_view(pos, 1);
+					stack.push_back(node);
+
+					++pos;
+					++pc;
+					continue;
+				}
+
+			case Op::LiteralSet:
+				{
+					bool matched = false;
+
+					for (uint32_t index : program.literal_sets[ins.arg])
+					{
+						const std::string &lit = program.literals[index];
+
+						if (pos != e && (size_t)(e - pos) >= lit.size() && std::memcmp(pos, lit.data(), lit.size()) == 0)
+						{
+							Node node;
+							node.span = std::string_view(pos, lit.size());
+							stack.push_back(node);
+
+							pos += lit.size();
+							matched = true;
+							break;
+						}
+					}
+
+					if (!matched)
+						goto fail;
+
+					++pc;
+					continue;
+				}
+
+			case Op::TestSet:
+				if (pos == e || !program.classes[ins.arg].test((uint8_t)*pos))
+					pc = ins.target;
+				else
+					++pc;
+
+				continue;
+
+			case Op::Call:
+				frames.push_back({ pc + 1, ins.arg, pos, stack.size() });
+				pc = program.entry[ins.arg];
+				continue;
+
+			case Op::Return:
+				{
+					const Frame &f = frames.back();
+					const size_t count = stack.size() - f.stack;
+
+					Node node;
+					node.type = f.id <= program.rule_count ? NodeType::Identifier : NodeType::Group;
+					node.identifier = f.id;
+					node.span = std::string_view(f.start, pos - f.start);
+
+					if (count != 0)
+					{
+						Node *block = tree.arena.allocate(count);
+						std::copy(stack.begin() + f.stack, stack.end(), block);
+						stack.resize(f.stack);
+						node.group = { block, count };
+					}
+
+					stack.push_back(node);
+
+					pc = f.ret;
+					frames.pop_back();
+					continue;
+				}
+
+			case Op::Splice:
+				pc = frames.back().ret;
+				frames.pop_back();
+				continue;
+
+			case Op::Choice:
+				backtrack.push_back({ ins.target, pos, stack.size(), tree.arena.mark(), frames.size() });
+				++pc;
+				continue;
+
+			case Op::Commit:
+				backtrack.pop_back();
+				pc = ins.target;
+				continue;
+
+			case Op::PartialCommit:
+				{
+					Backtrack &b = backtrack.back();
+					b.pos = pos;
+					b.stack = stack.size();
+					b.arena = tree.arena.mark();
+					pc = ins.target;
+					continue;
+				}
+
+			case Op::Cut:
+				if (ins.arg)
+					backtrack.pop_back();
+
+				++pc;
+				continue;
+
+			case Op::Fail:
+				goto fail;
+
+			case Op::End:
+				static_cast<Node &>(tree) = stack.back();
+				s = pos;
+				return tree;
+		}
+
+	fail:
+		if (backtrack.empty())
+			return std::nullopt;
+
+		{
+			const Backtrack &b = backtrack.back();
+			pc = b.target;
+			pos = b.pos;
+			stack.resize(b.stack);
+			tree.arena.rewind(b.arena);
+			frames.resize(b.frames);
+			backtrack.pop_back();
+		}
+	}
+}
+
+std::string dump_tree(const Program &program, const Node &node, size_t align)
+{
+	std::string result;
+
+	if (node.type == NodeType::Literal)
+		result += std::string(align, ' ') + "'" + std::string(node.span) + "'\n";
+	else
+		result += std::string(align, ' ') + program.names[node.identifier] + "\n";
+
+	for (const auto &v : node.group)
+		result += dump_tree(program, v, align + 1);
+
+	return result;
+}
+
+
+} // namespace vm
+
+
+} // namespace pgen
+
@@ -0,0 +1,165 @@
+#include "differential.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+
+
+namespace differential
+{
+
+
+namespace
+{
+
+
+std::map<std::string, Suite> &suites()
+{
+	static std::map<std::string, Suite> result;
+	return result;
+}
+
+// The first bytes the two differ at, with some context
+std::string difference(const std::string &a, const std::string &b)
+{
+	const size_t at = std::mismatch(a.begin(), a.begin() + std::min(a.size(), b.size()), b.begin()).first - a.begin();
+	const size_t from = at > 40 ? at - 40 : 0;
+
+	return "at " + std::to_string(at) + ":\n    expected ..." + a.substr(from, 120) + "\n    actual   ..." + b.substr(from, 120);
+}
+
+
+} // namespace
+
+
+Report::Report(std::string_view suite)
+	: suite(suite)
+{
+}
+
+bool Report::expect(const Outcome &expected, const Outcome &actual, std::string_view what, size_t input)
+{
+	++checked;
+
+	if (expected == actual)
+		return true;
+
+	++failed;
+
+	std::printf("%s: %.*s differs on input %zu: parsed %d/%d, consumed %zu/%zu\n",
+		suite.c_str(),
+		(int)what.size(), what.data(),
+		input,
+		(int)expected.parsed, (int)actual.parsed,
+		expected.consumed, actual.consumed);
+
+	if (expected.tree != actual.tree)
+		std::printf("  tree %s\n", difference(expected.tree, actual.tree).c_str());
+
+	return false;
+}
+
+bool Report::expect(bool ok, std::string_view what, size_t input)
+{
+	++checked;
+
+	if (ok)
+		return true;
+
+	++failed;
+
+	std::printf("%s: %.*s failed on input %zu\n", suite.c_str(), (int)what.size(), what.data(), input);
+
+	return false;
+}
+
+Random::Random(uint64_t seed)
+	: state(seed ? seed : 0x9e3779b97f4a7c15)
+{
+}
+
+uint64_t Random::next()
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545f4914f6cdd1d;
+}
+
+std::vector<std::string> variants(const std::string &corpus, uint64_t seed)
+{
+	Random rng(seed);
+
+	std::vector<std::string> result = { corpus, "" };
+
+	for (size_t i = 0; i < 4 && !corpus.empty(); ++i)
+		result.push_back(corpus.substr(0, rng.below(corpus.size())));
+
+	// printable ASCII only, so that the UTF-8 mode reads the same input
+	for (size_t i = 0; i < 6 && !corpus.empty(); ++i)
+	{
+		std::string v = corpus;
+
+		for (size_t k = 0, n = 1 + rng.below(3); k < n; ++k)
+			v[rng.below(v.size())] = (char)(' ' + rng.below(95));
+
+		result.push_back(std::move(v));
+	}
+
+	for (size_t i = 0; i < 4 && !corpus.empty(); ++i)
+	{
+		const size_t from = rng.below(corpus.size());
+		const size_t size = rng.below(std::min<size_t>(corpus.size() - from, 256));
+
+		std::string v = corpus;
+		v.insert(rng.below(v.size()), corpus, from, size);
+		result.push_back(std::move(v));
+	}
+
+	return result;
+}
+
+int add_suite(const char *name, Suite suite)
+{
+	suites().emplace(name, suite);
+	return 0;
+}
+
+
+} // namespace differential
+
+
+// pgen-differential [suite...], every suite when none is named
+int main(int argc, char **argv)
+{
+	using namespace differential;
+
+	std::vector<std::string> selected(argv + 1, argv + argc);
+
+	for (const auto &name : selected)
+	{
+		if (!suites().contains(name))
+		{
+			std::fprintf(stderr, "unknown suite %s\n", name.c_str());
+			return 1;
+		}
+	}
+
+	size_t failures = 0;
+
+	for (const auto &[name, suite] : suites())
+	{
+		if (!selected.empty() && std::find(selected.begin(), selected.end(), name) == selected.end())
+			continue;
+
+		Report report(name);
+		suite(report);
+
+		std::printf("%s: %zu checks, %zu failed\n", name.c_str(), report.checks(), report.failures());
+		std::fflush(stdout);
+
+		failures += report.failures();
+	}
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+
+// Runs every generation mode of a grammar on the same inputs and compares
+// the trees with the ones of vm::run
+namespace differential
+{
+
+
+// Node names with offsets from base and sizes, children in parentheses.
+// Literals have no name.
+template <typename Node, typename NameOf>
+void dump(std::string &out, const Node &node, const char *base, const NameOf &name_of)
+{
+	out += name_of(node);
+	out += '@';
+	out += std::to_string(node.span.data() - base);
+	out += '+';
+	out += std::to_string(node.span.size());
+
+	if (node.group.empty())
+		return;
+
+	out += '(';
+
+	for (const auto &v : node.group)
+	{
+		dump(out, v, base, name_of);
+		out += ' ';
+	}
+
+	out += ')';
+}
+
+struct Outcome
+{
+	bool parsed = false;
+	size_t consumed = 0;
+
+	// dump() of the root, empty when it didn't parse
+	std::string tree;
+
+	bool operator==(const Outcome &other) const = default;
+};
+
+template <typename Tree, typename NameOf>
+Outcome outcome(const Tree &tree, size_t consumed, const NameOf &name_of)
+{
+	Outcome result;
+	result.consumed = consumed;
+
+	if (tree)
+	{
+		result.parsed = true;
+		dump(result.tree, *tree, tree->span.data(), name_of);
+	}
+
+	return result;
+}
+
+class Report
+{
+public:
+	explicit Report(std::string_view suite);
+
+	// Counts a comparison, prints what differs when it fails
+	bool expect(const Outcome &expected, const Outcome &actual, std::string_view what, size_t input);
+	bool expect(bool ok, std::string_view what, size_t input);
+
+	size_t failures() const
+	{
+		return failed;
+	}
+
+	size_t checks() const
+	{
+		return checked;
+	}
+
+private:
+	std::string suite;
+	size_t failed = 0;
+	size_t checked = 0;
+};
+
+// xorshift64*, like the corpora
+class Random
+{
+public:
+	explicit Random(uint64_t seed);
+
+	uint64_t next();
+
+	size_t below(size_t n)
+	{
+		return (size_t)(next() % n);
+	}
+
+private:
+	uint64_t state;
+};
+
+// The corpus, cut short, with bytes replaced and with parts of it copied
+// elsewhere, so that parses also fail and stop early
+std::vector<std::string> variants(const std::string &corpus, uint64_t seed);
+
+using Suite = void (*)(Report &report);
+
+// Returns something to initialize a static with
+int add_suite(const char *name, Suite suite);
+
+
+} // namespace differential
@@ -0,0 +1,313 @@
+#include "pgen.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+
+namespace
+{
+
+
+struct Mode
+{
+	pgen::helpers::GenerateCodeParams params;
+
+	// false when the mode changes the shape of trees, only what matches is compared then
+	bool same_tree = true;
+};
+
+std::optional<Mode> find_mode(std::string_view name, const std::string &root)
+{
+	using pgen::helpers::MemoizeMode;
+
+	Mode mode;
+	auto &p = mode.params;
+
+	if (name == "fast")
+	{
+		p.file_input = true;
+		p.batch = true;
+		p.push_parser = true;
+	}
+	else
+	if (name == "plain")
+	{
+		p.first_set_dispatch = false;
+		p.vectorized_scan = false;
+		p.literal_trie = false;
+	}
+	else
+	if (name == "memoize")
+	{
+		p.memoize = MemoizeMode::Full;
+	}
+	else
+	if (name == "failures")
+	{
+		p.memoize = MemoizeMode::FailuresOnly;
+	}
+	else
+	if (name == "explicit_stack")
+	{
+		p.explicit_stack = true;
+		p.file_input = true;
+		p.batch = true;
+	}
+	else
+	if (name == "profile")
+	{
+		p.profile = true;
+		p.profile_reentries = true;
+	}
+	else
+	if (name == "incremental")
+	{
+		p.incremental = true;
+	}
+	else
+	if (name == "utf8")
+	{
+		p.utf8 = true;
+	}
+	else
+	if (name == "coalesce")
+	{
+		p.coalesce_repetitions = true;
+		mode.same_tree = false;
+	}
+	else
+	if (name == "optimized")
+	{
+		using pgen::ir::Pass;
+		p.optimize.passes = { Pass::InlineRules, Pass::LeftFactor, Pass::MergeLiterals, Pass::RemoveUnreachable };
+		p.optimize.roots = { root };
+		mode.same_tree = false;
+	}
+	else
+	if (name == "parallel")
+	{
+		p.parallel = true;
+		p.file_input = true;
+	}
+	else
+	if (name == "parallel_failures")
+	{
+		p.parallel = true;
+		p.memoize = MemoizeMode::FailuresOnly;
+	}
+	else
+	{
+		return std::nullopt;
+	}
+
+	return mode;
+}
+
+std::string flag(bool v)
+{
+	return v ? "true" : "false";
+}
+
+// What the test sees of a mode: its options and entry points for the root rule
+std::string generate_adapter(const std::string &ns, const std::string &root, const Mode &mode)
+{
+	const auto &p = mode.params;
+
+	std::string result;
+
+	result += "namespace " + ns + "\n";
+	result += "{\n";
+	result += "\n";
+	result += "struct Mode\n";
+	result += "{\n";
+	result += "	static constexpr bool same_tree = " + flag(mode.same_tree) + ";\n";
+	result += "	static constexpr bool file_input = " + flag(p.file_input) + ";\n";
+	result += "	static constexpr bool batch = " + flag(p.batch) + ";\n";
+	result += "	static constexpr bool push_parser = " + flag(p.push_parser) + ";\n";
+	result += "	static constexpr bool incremental = " + flag(p.incremental) + ";\n";
+	result += "	static constexpr bool parallel = " + flag(p.parallel) + ";\n";
+	result += "\n";
+	result += "	using Parsed = $Parsed;\n";
+	result += "\n";
+	result += "	static std::string_view name_of(const $Parsed &v)\n";
+	result += "	{\n";
+	result += "		return v.type == $ParsedType::Literal ? std::string_view() : std::string_view(table_$IdentifierType[(size_t)v.identifier]);\n";
+	result += "	}\n";
+	result += "\n";
+	result += "	static auto parse(const char *&s, const char *e)\n";
+	result += "	{\n";
+	result += "		return $parse_" + root + "(s, e);\n";
+	result += "	}\n";
+
+	if (p.file_input)
+	{
+		result += "\n";
+		result += "	static auto parse_file(const char *path, size_t *consumed, std::error_code *error)\n";
+		result += "	{\n";
+		result += "		return $parse_file_" + root + "(path, consumed, error);\n";
+		result += "	}\n";
+	}
+
+	if (p.batch)
+	{
+		result += "\n";
+		result += "	template <typename F>\n";
+		result += "	static auto parse_batch(std::span<const std::string_view> inputs, $ThreadPool &pool, F visit)\n";
+		result += "	{\n";
+		result += "		return $parse_batch_" + root + "(inputs, pool, visit);\n";
+		result += "	}\n";
+	}
+
+	if (p.push_parser)
+	{
+		result += "\n";
+		result += "	static auto push()\n";
+		result += "	{\n";
+		result += "		return $push_" + root + "();\n";
+		result += "	}\n";
+	}
+
+	if (p.incremental)
+	{
+		result += "\n";
+		result += "	using Edit = $Edit;\n";
+		result += "\n";
+		result += "	static auto reparse(const $Tree &previous, const $Edit &edit, const char *&s, const char *e)\n";
+		result += "	{\n";
+		result += "		return $reparse_" + root + "(previous, edit, s, e);\n";
+		result += "	}\n";
+	}
+
+	if (p.batch || p.parallel)
+	{
+		result += "\n";
+		result += "	using ThreadPool = $ThreadPool;\n";
+	}
+
+	if (p.parallel)
+	{
+		result += "\n";
+		result += "	static auto parse(const char *&s, const char *e, $ThreadPool &pool)\n";
+		result += "	{\n";
+		result += "		return $parse_" + root + "(s, e, pool);\n";
+		result += "	}\n";
+	}
+
+	result += "};\n";
+	result += "\n";
+	result += "} // namespace " + ns + "\n";
+
+	return result;
+}
+
+
+} // namespace
+
+
+// pgen-test-gen <grammar> <namespace> <root> <output> <mode>...
+//
+// Writes the grammar's text for pgen::ct::Parser and the code generated in
+// every mode, mode m in <namespace>::m with a Mode struct the test runs it by
+int main(int argc, char **argv)
+{
+	if (argc < 6)
+	{
+		std::cerr << "usage: pgen-test-gen <grammar> <namespace> <root> <output> <mode>...\n";
+		return 1;
+	}
+
+	std::ifstream input(argv[1], std::ios::binary);
+
+	if (!input)
+	{
+		std::cerr << "can't open " << argv[1] << "\n";
+		return 1;
+	}
+
+	std::stringstream ss;
+	ss << input.rdbuf();
+	const std::string grammar = ss.str();
+
+	const auto parsed = pgen::try_parse(grammar.data(), grammar.size());
+
+	if (parsed.error)
+	{
+		std::cerr << argv[1] << ":" << parsed.error->message() << "\n";
+		return 1;
+	}
+
+	const std::string ns = argv[2];
+	const std::string root = argv[3];
+
+	const bool tokens = std::any_of(parsed.rules.begin(), parsed.rules.end(), [](const pgen::Rule &r) { return r.token || r.skip; });
+
+	std::string code;
+
+	code += "#pragma once\n";
+	code += "\n";
+	code += "#include <tuple>\n";
+	code += "\n";
+
+	std::vector<std::string> modes;
+
+	for (int i = 5; i < argc; ++i)
+	{
+		auto mode = find_mode(argv[i], root);
+
+		if (!mode)
+		{
+			std::cerr << "unknown mode " << argv[i] << "\n";
+			return 1;
+		}
+
+		// rules on tokens have no state machine, no incremental and no parallel
+		// parse, see generate_code; a token's node has no children
+		if (tokens && mode->params.lexer)
+		{
+			mode->params.explicit_stack = false;
+			mode->params.push_parser = false;
+			mode->params.incremental = false;
+			mode->params.parallel = false;
+			mode->same_tree = false;
+		}
+
+		auto &params = mode->params;
+		params.custom_namespace = ns + "::" + argv[i];
+
+		code += pgen::helpers::generate_code(parsed.grammar, params);
+		code += "\n";
+		code += generate_adapter(params.custom_namespace, root, mode.value());
+		code += "\n";
+
+		modes.push_back(argv[i]);
+	}
+
+	code += "namespace " + ns + "\n";
+	code += "{\n";
+	code += "\n";
+	code += "constexpr char grammar[] = R\"PGEN(" + grammar + ")PGEN\";\n";
+	code += "constexpr char root[] = \"" + root + "\";\n";
+	code += "\n";
+	code += "constexpr const char *mode_names[] = {";
+
+	for (const auto &m : modes)
+		code += " \"" + m + "\",";
+
+	code += " };\n";
+	code += "\n";
+	code += "using Modes = std::tuple<";
+
+	for (size_t i = 0; i < modes.size(); ++i)
+		code += std::string(i ? ", " : "") + modes[i] + "::Mode";
+
+	code += ">;\n";
+	code += "\n";
+	code += "} // namespace " + ns + "\n";
+
+	std::ofstream output(argv[4], std::ios::binary);
+	output << code;
+
+	return output ? 0 : 1;
+}
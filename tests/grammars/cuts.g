@@ -0,0 +1,11 @@
+# Statements commit to their keyword's alternative once it is read, so
+# "letx=1;" is not an assignment to letx
+program: (statement "\n")*
+
+statement: "let" ~ " " name "=" value ";" | "print" ~ " " value ("," ~ value)* ";" | name "=" value ";"
+
+value: number | name | "(" ~ value ")"
+
+name: [a-z]+
+
+number: [0-9]+
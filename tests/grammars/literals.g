@@ -0,0 +1,16 @@
+# Literal alternations, which the generator matches with a trie. Like any
+# other literal, the empty one fails at the end of the input.
+doc: entry* end
+
+entry: key flag ":" value ";"
+
+key: "a" | "ab" | "abc" | "b"
+
+flag: "" | "!"
+
+value: "x" | "xy" | ""
+
+end: "." | "=" tail | ""
+
+# a literal before an empty one, which isn't merged into it
+tail: "a" "" | "x" end
@@ -0,0 +1,10 @@
+# Records a parallel parse splits at, strings hold what looks like more of them
+file: record*
+
+@sync record: value ";" "\n"?
+
+value: number | string
+
+number: [0-9]+
+
+string: "\"" [^"]* "\""
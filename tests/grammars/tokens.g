@@ -0,0 +1,12 @@
+# Lexed tokens, digits is inlined into number and then dropped by the passes
+list: item*
+
+item: ident | number | op
+
+@token ident: [a-z] [a-z0-9]*
+
+@token number: digits ("." digits)?
+
+digits: ([0-9])+
+
+@token op: "+" | "-" | "=="
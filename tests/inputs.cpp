@@ -0,0 +1,167 @@
+#include "inputs.hpp"
+#include "differential.hpp"
+
+
+namespace inputs
+{
+
+
+std::string records(size_t size, uint64_t seed)
+{
+	differential::Random rng(seed);
+
+	std::string result;
+
+	while (result.size() < size)
+	{
+		if (rng.below(4) == 0)
+		{
+			result += '"';
+
+			for (size_t i = 0, n = rng.below(40); i < n; ++i)
+				result += "0123456789;\n ab"[rng.below(16)];
+
+			result += '"';
+		}
+		else
+		{
+			result += std::to_string(rng.next() % 1000000);
+		}
+
+		result += ';';
+
+		if (rng.below(2) == 0)
+			result += '\n';
+	}
+
+	return result;
+}
+
+// Without whitespace, the grammar has no @skip rule the vm could not run
+std::string tokens(size_t size, uint64_t seed)
+{
+	differential::Random rng(seed);
+
+	const char *ops[] = { "+", "-", "==" };
+
+	std::string result;
+
+	while (result.size() < size)
+	{
+		switch (rng.below(3))
+		{
+			case 0:
+				result += (char)('a' + rng.below(26));
+
+				for (size_t i = 0, n = rng.below(8); i < n; ++i)
+					result += "abcxyz0189"[rng.below(10)];
+
+				break;
+			case 1:
+				result += std::to_string(rng.below(100000));
+
+				if (rng.below(3) == 0)
+					result += "." + std::to_string(rng.below(1000));
+
+				break;
+			default:
+				result += ops[rng.below(3)];
+				break;
+		}
+	}
+
+	return result;
+}
+
+std::string literals(size_t size, uint64_t seed)
+{
+	differential::Random rng(seed);
+
+	const char *keys[] = { "a", "ab", "abc", "b" };
+	const char *values[] = { "x", "xy", "" };
+
+	std::string result;
+
+	while (result.size() < size)
+	{
+		result += keys[rng.below(4)];
+		result += ':';
+		result += values[rng.below(3)];
+		result += ';';
+	}
+
+	return result + ".";
+}
+
+std::string cuts(size_t size, uint64_t seed)
+{
+	differential::Random rng(seed);
+
+	auto name = [&] {
+		std::string result;
+
+		for (size_t i = 0, n = rng.below(6) + 1; i < n; ++i)
+			result += (char)('a' + rng.below(26));
+
+		return result;
+	};
+
+	auto value = [&] {
+		switch (rng.below(4))
+		{
+			case 0:
+				return name();
+			case 1:
+				return "(" + std::to_string(rng.below(1000)) + ")";
+			default:
+				return std::to_string(rng.below(100000));
+		}
+	};
+
+	std::string result;
+
+	while (result.size() < size)
+	{
+		switch (rng.below(3))
+		{
+			case 0:
+				result += "let " + name() + "=" + value() + ";";
+				break;
+			case 1:
+				result += "print " + value();
+
+				for (size_t i = 0, n = rng.below(3); i < n; ++i)
+					result += "," + value();
+
+				result += ";";
+				break;
+			default:
+				result += name() + "=" + value() + ";";
+				break;
+		}
+
+		result += '\n';
+	}
+
+	return result;
+}
+
+std::vector<std::string> extra(std::string_view suite)
+{
+	// the input ends where an empty literal is next
+	if (suite == "literals")
+		return { "a:", "a:x;b:", "ab", "a:x;", "", "=a", "=x", "=a.", "=x.", "a:x;=x=a", "a:x;=x=x" };
+
+	// every start a chunk tries parses the digits to the end of the input
+	if (suite == "records")
+		return { "1;" + std::string(150000, '1') + "x;" };
+
+	// past a cut the other alternatives are not tried
+	if (suite == "cuts")
+		return { "letx=1;\n", "printx;\n", "let x=(1;\n", "print 1,;\n", "let=1;\n", "lets=1;\nlet x=1;\n" };
+
+	return {};
+}
+
+
+} // namespace inputs
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+
+// Inputs for the grammars in tests/grammars, like the corpora of bench/
+namespace inputs
+{
+
+
+std::string records(size_t size, uint64_t seed);
+std::string tokens(size_t size, uint64_t seed);
+std::string literals(size_t size, uint64_t seed);
+std::string cuts(size_t size, uint64_t seed);
+
+// Cases a suite checks on top of its corpus
+std::vector<std::string> extra(std::string_view suite);
+
+
+} // namespace inputs
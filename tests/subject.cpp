@@ -0,0 +1,309 @@
+// Built once per grammar, see CMakeLists.txt: PGEN_TEST_HEADER is what
+// pgen-test-gen wrote for it into PGEN_TEST_NAMESPACE, PGEN_TEST_CORPUS
+// makes inputs of about PGEN_TEST_SIZE bytes from PGEN_TEST_SEEDS seeds
+#include "differential.hpp"
+#include "inputs.hpp"
+#include "corpora.hpp"
+
+#include "pgen.hpp"
+#include "pgen_static.hpp"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <system_error>
+
+#include PGEN_TEST_HEADER
+
+
+namespace
+{
+
+
+namespace subject = PGEN_TEST_NAMESPACE;
+
+using differential::Outcome;
+using differential::Report;
+
+using Static = pgen::ct::Parser<subject::grammar>;
+
+struct Reference
+{
+	pgen::vm::Program program;
+	uint32_t rule = 0;
+
+	Outcome parse(const std::string &input) const
+	{
+		const char *s = input.data();
+		const auto tree = pgen::vm::run(program, rule, s, input.data() + input.size());
+
+		return differential::outcome(tree, s - input.data(), [&](const pgen::vm::Node &v) {
+			return v.type == pgen::vm::NodeType::Literal ? std::string_view() : std::string_view(program.names[v.identifier]);
+		});
+	}
+};
+
+// Groups keep a parent through the passes, one that tells lexed() right
+void check_passes(Report &report, const pgen::ir::Grammar &grammar)
+{
+	using pgen::ir::Pass;
+
+	pgen::ir::Grammar g = grammar;
+	pgen::ir::optimize(g, { { Pass::InlineRules, Pass::LeftFactor, Pass::MergeLiterals, Pass::RemoveUnreachable }, {}, { subject::root } });
+
+	for (uint32_t id = 1; id < g.size(); ++id)
+	{
+		if (g.definitions[id].group)
+			report.expect(g.definitions[id].parent != 0, "parent of " + g.definitions[id].name, 0);
+
+		for (const auto &node : g.body(id))
+		{
+			if (node.type == pgen::ir::NodeType::Group)
+				report.expect(g.lexed(node.value) == g.lexed(id), "lexed " + g.definitions[node.value].name, 0);
+		}
+	}
+}
+
+template <typename Mode>
+auto name_of()
+{
+	return [](const typename Mode::Parsed &v) { return Mode::name_of(v); };
+}
+
+// Trees of modes that reshape them are not compared
+template <typename Mode>
+void expect(Report &report, const Outcome &expected, Outcome actual, const std::string &what, size_t input)
+{
+	if (!Mode::same_tree)
+		actual.tree = expected.tree;
+
+	report.expect(expected, actual, what, input);
+}
+
+template <typename Mode>
+void run_parse(Report &report, const char *mode, const std::vector<std::string> &inputs, const std::vector<Outcome> &expected)
+{
+	for (size_t i = 0; i < inputs.size(); ++i)
+	{
+		const char *s = inputs[i].data();
+		const auto tree = Mode::parse(s, inputs[i].data() + inputs[i].size());
+
+		expect<Mode>(report, expected[i], differential::outcome(tree, s - inputs[i].data(), name_of<Mode>()), mode, i);
+	}
+}
+
+template <typename Mode>
+void run_file(Report &report, const char *mode, const std::vector<std::string> &inputs, const std::vector<Outcome> &expected)
+{
+	const auto path = std::filesystem::temp_directory_path() / ("pgen-differential-" + std::string(PGEN_TEST_SUITE) + "-" + mode);
+
+	for (size_t i = 0; i < inputs.size(); ++i)
+	{
+		std::ofstream(path, std::ios::binary) << inputs[i];
+
+		size_t consumed = 0;
+		std::error_code error = std::make_error_code(std::errc::io_error);
+		const auto tree = Mode::parse_file(path.string().c_str(), &consumed, &error);
+
+		report.expect(!error, std::string(mode) + " file error", i);
+		expect<Mode>(report, expected[i], differential::outcome(tree, consumed, name_of<Mode>()), std::string(mode) + " file", i);
+	}
+
+	std::filesystem::remove(path);
+
+	// a file that isn't there or isn't a file fails apart from a parse
+	for (const auto &missing : { path, path.parent_path() })
+	{
+		size_t consumed = 1;
+		std::error_code error;
+		const auto tree = Mode::parse_file(missing.string().c_str(), &consumed, &error);
+
+		report.expect(!tree && error && consumed == 0, std::string(mode) + " file " + missing.string(), 0);
+	}
+}
+
+template <typename Mode>
+void run_batch(Report &report, const char *mode, const std::vector<std::string> &inputs, const std::vector<Outcome> &expected)
+{
+	typename Mode::ThreadPool pool(4);
+
+	const std::vector<std::string_view> views(inputs.begin(), inputs.end());
+	std::vector<Outcome> actual(inputs.size());
+
+	const auto status = Mode::parse_batch(views, pool, [&](size_t i, const auto &root) {
+		differential::dump(actual[i].tree, root, root.span.data(), name_of<Mode>());
+	});
+
+	for (size_t i = 0; i < inputs.size(); ++i)
+	{
+		actual[i].parsed = status[i].parsed;
+		actual[i].consumed = status[i].consumed;
+
+		expect<Mode>(report, expected[i], actual[i], std::string(mode) + " batch", i);
+	}
+}
+
+template <typename Mode>
+void run_push(Report &report, const char *mode, const std::vector<std::string> &inputs, const std::vector<Outcome> &expected)
+{
+	for (size_t chunk : { 7, 4096 })
+	{
+		for (size_t i = 0; i < inputs.size(); ++i)
+		{
+			auto parser = Mode::push();
+
+			for (size_t at = 0; at < inputs[i].size(); at += chunk)
+			{
+				if (!parser.feed(std::string_view(inputs[i]).substr(at, chunk)))
+					break;
+			}
+
+			size_t consumed = 0;
+			const auto tree = parser.finish(&consumed);
+
+			expect<Mode>(report, expected[i], differential::outcome(tree, consumed, name_of<Mode>()), std::string(mode) + " push " + std::to_string(chunk), i);
+		}
+	}
+}
+
+// Edits on top of edits, every tree reparsed from the one before
+template <typename Mode>
+void run_reparse(Report &report, const char *mode, const Reference &reference, const std::vector<std::string> &inputs)
+{
+	differential::Random rng(7);
+
+	for (size_t i = 0; i < inputs.size(); ++i)
+	{
+		std::vector<std::string> versions = { inputs[i] };
+
+		const char *s = versions.back().data();
+		auto tree = Mode::parse(s, s + versions.back().size());
+
+		for (size_t k = 0; k < 4 && tree; ++k)
+		{
+			const std::string &before = versions.back();
+
+			typename Mode::Edit edit;
+			edit.offset = rng.below(before.size() + 1);
+			edit.removed = rng.below(std::min<size_t>(before.size() - edit.offset, 16) + 1);
+
+			const size_t from = rng.below(inputs[i].size() + 1);
+			const std::string inserted = inputs[i].substr(from, rng.below(17));
+			edit.inserted = inserted.size();
+
+			std::string after = before;
+			after.replace(edit.offset, edit.removed, inserted);
+			versions.push_back(std::move(after));
+
+			s = versions.back().data();
+			auto next = Mode::reparse(tree.value(), edit, s, s + versions.back().size());
+
+			expect<Mode>(report, reference.parse(versions.back()), differential::outcome(next, s - versions.back().data(), name_of<Mode>()), std::string(mode) + " reparse " + std::to_string(k), i);
+
+			tree = std::move(next);
+		}
+	}
+}
+
+// Chunks that start in the wrong place give up long before the parse takes
+// much longer than one in order, the limit leaves room for a loaded machine
+template <typename Mode>
+void run_parallel(Report &report, const char *mode, const std::vector<std::string> &inputs, const std::vector<Outcome> &expected)
+{
+	std::vector<double> in_order;
+
+	for (const auto &input : inputs)
+	{
+		const char *s = input.data();
+		const auto start = std::chrono::steady_clock::now();
+		(void)Mode::parse(s, input.data() + input.size());
+		in_order.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	}
+
+	for (size_t threads : { 2, 8 })
+	{
+		typename Mode::ThreadPool pool(threads);
+
+		for (size_t i = 0; i < inputs.size(); ++i)
+		{
+			const char *s = inputs[i].data();
+			const auto start = std::chrono::steady_clock::now();
+			const auto tree = Mode::parse(s, inputs[i].data() + inputs[i].size(), pool);
+			const double parallel = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			expect<Mode>(report, expected[i], differential::outcome(tree, s - inputs[i].data(), name_of<Mode>()), std::string(mode) + " parallel " + std::to_string(threads), i);
+			report.expect(parallel < 50 * in_order[i] + 1, std::string(mode) + " parallel " + std::to_string(threads) + " time", i);
+		}
+	}
+}
+
+template <typename Mode>
+void run_mode(Report &report, const char *mode, const Reference &reference, const std::vector<std::string> &inputs, const std::vector<Outcome> &expected)
+{
+	run_parse<Mode>(report, mode, inputs, expected);
+
+	if constexpr (Mode::file_input)
+		run_file<Mode>(report, mode, inputs, expected);
+
+	if constexpr (Mode::batch)
+		run_batch<Mode>(report, mode, inputs, expected);
+
+	if constexpr (Mode::push_parser)
+		run_push<Mode>(report, mode, inputs, expected);
+
+	if constexpr (Mode::incremental)
+		run_reparse<Mode>(report, mode, reference, inputs);
+
+	if constexpr (Mode::parallel)
+		run_parallel<Mode>(report, mode, inputs, expected);
+}
+
+void run(Report &report)
+{
+	const auto grammar = pgen::try_parse(subject::grammar, sizeof(subject::grammar) - 1);
+
+	if (!report.expect(!grammar.error, "grammar", 0))
+		return;
+
+	check_passes(report, grammar.grammar);
+
+	Reference reference;
+	reference.program = pgen::vm::compile(grammar.grammar);
+	reference.rule = reference.program.find(subject::root).value();
+
+	std::vector<std::string> inputs;
+
+	for (uint64_t seed = 1; seed <= PGEN_TEST_SEEDS; ++seed)
+	{
+		for (auto &v : differential::variants(PGEN_TEST_CORPUS(PGEN_TEST_SIZE, seed), seed))
+			inputs.push_back(std::move(v));
+	}
+
+	for (auto &v : inputs::extra(PGEN_TEST_SUITE))
+		inputs.push_back(std::move(v));
+
+	std::vector<Outcome> expected;
+
+	for (const auto &input : inputs)
+		expected.push_back(reference.parse(input));
+
+	for (size_t i = 0; i < inputs.size(); ++i)
+	{
+		const char *s = inputs[i].data();
+		const auto tree = Static::parse<subject::root>(s, inputs[i].data() + inputs[i].size());
+
+		report.expect(expected[i], differential::outcome(tree, s - inputs[i].data(), [](const pgen::vm::Node &v) {
+			return v.type == pgen::vm::NodeType::Literal ? std::string_view() : Static::name(v.identifier);
+		}), "ct::Parser", i);
+	}
+
+	[&]<size_t... I>(std::index_sequence<I...>) {
+		(run_mode<std::tuple_element_t<I, subject::Modes>>(report, subject::mode_names[I], reference, inputs, expected), ...);
+	}(std::make_index_sequence<std::tuple_size_v<subject::Modes>>());
+}
+
+[[maybe_unused]] const int registered = differential::add_suite(PGEN_TEST_SUITE, run);
+
+
+} // namespace